@@ -0,0 +1,434 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include "../protocolSrc/frame.h"
+
+//load generator for twmailer-server: many concurrent connections log in with the test accounts and run a mix of
+//SEND/LIST/READ/DEL for a fixed time, then throughput and latency percentiles are printed per command
+//every connection is a thread that sends one request and waits for its response (no pipelining), like the interactive client
+
+//--- Settings ---
+
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_DURATION 10 //seconds
+#define DEFAULT_MESSAGE_SIZE 1024 //bytes of the body of a SEND
+#define DEFAULT_MIX "40,20,30,10" //weights of SEND,LIST,READ,DEL
+
+#define COMMAND_SEND 0
+#define COMMAND_LIST 1
+#define COMMAND_READ 2
+#define COMMAND_DEL 3
+#define NUMBER_OF_COMMANDS 4
+
+static const char *commandNames[NUMBER_OF_COMMANDS] = {"SEND", "LIST", "READ", "DEL"};
+
+//--- Latency histogram ---
+
+//log-linear buckets like an HDR histogram: values below 64 are exact, above that every power of two is split into 64 buckets,
+//so a recorded value is off by less than 1/64 (about 1.6%) and the histogram has a fixed size
+#define HISTOGRAM_SUB_BUCKETS 64
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * 41) //up to 2^46 microseconds
+
+struct Histogram {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(HISTOGRAM_BUCKETS, 0);
+    uint64_t total = 0;
+    uint64_t errors = 0;
+    uint64_t max = 0;
+
+    void record(uint64_t value);
+    void merge(const Histogram &other);
+    uint64_t percentile(double percent) const; //highest value of the bucket that contains the percentile
+};
+
+static size_t bucketOf(uint64_t value);
+static uint64_t highestValueOf(size_t bucket);
+
+//--- Connections ---
+
+struct BenchConfig {
+    struct sockaddr_in address;
+    int connections = DEFAULT_CONNECTIONS;
+    int duration = DEFAULT_DURATION;
+    size_t messageSize = DEFAULT_MESSAGE_SIZE;
+    int mix[NUMBER_OF_COMMANDS];
+    bool printHistograms = false;
+};
+
+static BenchConfig config;
+static std::atomic<int> connectionsReady(0);
+static std::atomic<bool> started(false);
+static std::atomic<bool> stopped(false);
+
+static void runConnection(int index, Histogram *histograms); //one thread per connection, histograms: one per command
+static bool request(int socket, const std::string &message, std::string &response); //sends one framed request and receives the response
+static bool sendAll(int socket, const char *data, size_t length);
+static bool receiveAll(int socket, char *data, size_t length);
+static void parseList(const std::string &response, std::deque<int> &ids); //message-ids of a LIST response
+static bool parseMix(const char *text, int *mix);
+static void printReport(Histogram *histograms, double seconds);
+
+int main(int argc, char *argv[]) {
+
+    parseMix(DEFAULT_MIX, config.mix);
+
+    int option;
+    while((option = getopt(argc, argv, "c:d:s:m:H")) != -1){
+        switch(option){
+            case 'c':
+                config.connections = atoi(optarg);
+                break;
+            case 'd':
+                config.duration = atoi(optarg);
+                break;
+            case 's':
+                config.messageSize = atol(optarg);
+                break;
+            case 'm':
+                if(!parseMix(optarg, config.mix)){
+                    fprintf(stderr, "Invalid mix: %s (weights of SEND,LIST,READ,DEL, e.g. %s)\n", optarg, DEFAULT_MIX);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'H':
+                config.printHistograms = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c connections] [-d seconds] [-s message-size] [-m send,list,read,del] [-H] <ip> <port>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if(argc - optind < 2 || config.connections < 1 || config.duration < 1){
+        fprintf(stderr, "Usage: %s [-c connections] [-d seconds] [-s message-size] [-m send,list,read,del] [-H] <ip> <port>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&config.address, 0, sizeof(config.address));
+    config.address.sin_family = AF_INET;
+    config.address.sin_port = htons(std::stoi(argv[optind + 1]));
+    if(inet_aton(argv[optind], &config.address.sin_addr) == 0){
+        fprintf(stderr, "Invalid ip: %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%d connections, %d s, message size %zu bytes, mix SEND %d LIST %d READ %d DEL %d\n", config.connections, config.duration,
+        config.messageSize, config.mix[COMMAND_SEND], config.mix[COMMAND_LIST], config.mix[COMMAND_READ], config.mix[COMMAND_DEL]);
+
+    //every connection records into its own histograms, they are merged after the run
+    std::vector<std::vector<Histogram>> histograms(config.connections, std::vector<Histogram>(NUMBER_OF_COMMANDS));
+    std::vector<std::thread> threads;
+    for(int i = 0; i < config.connections; i++){
+        threads.emplace_back(runConnection, i, histograms[i].data());
+    }
+
+    //measurement starts once every connection is logged in
+    while(connectionsReady < config.connections){
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto startTime = std::chrono::steady_clock::now();
+    started = true;
+    std::this_thread::sleep_for(std::chrono::seconds(config.duration));
+    stopped = true;
+
+    for(auto &thread : threads){
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    Histogram merged[NUMBER_OF_COMMANDS];
+    for(auto &connectionHistograms : histograms){
+        for(int command = 0; command < NUMBER_OF_COMMANDS; command++){
+            merged[command].merge(connectionHistograms[command]);
+        }
+    }
+
+    printReport(merged, seconds);
+
+    return 0;
+}
+
+static void runConnection(int index, Histogram *histograms){
+
+    int socketDescriptor = socket(AF_INET, SOCK_STREAM, 0);
+    if(socketDescriptor == -1 || connect(socketDescriptor, (struct sockaddr *)&config.address, sizeof(config.address)) == -1){
+        perror("Connect error - no server available");
+        exit(EXIT_FAILURE);
+    }
+
+    //requests are small and answered one at a time, Nagle's algorithm would only add delay
+    int noDelay = 1;
+    setsockopt(socketDescriptor, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    //the two test accounts, every connection sends to its own account so LIST/READ/DEL find messages
+    std::string username = index % 2 == 0 ? "test1" : "test2";
+    std::string response;
+    if(!request(socketDescriptor, "", response) || !request(socketDescriptor, "LOGIN\n" + username + "\ntest\n", response) || response != "OK\n"){
+        fprintf(stderr, "Login as %s failed (test accounts disabled or ip blacklisted?)\n", username.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    std::string body;
+    while(body.length() < config.messageSize){
+        size_t lineLength = std::min((size_t)79, config.messageSize - body.length() - 1);
+        body.append(lineLength, (char)('a' + body.length() % 26));
+        body += '\n';
+    }
+    std::string sendRequest = "SEND\n" + username + "\nbench\n" + body + ".\n";
+
+    std::mt19937 random(index);
+    int totalWeight = 0;
+    for(int command = 0; command < NUMBER_OF_COMMANDS; command++){
+        totalWeight += config.mix[command];
+    }
+
+    std::deque<int> ids; //message-ids of the last LIST, READ picks one of them and DEL the oldest
+    request(socketDescriptor, "LIST\n", response);
+    parseList(response, ids);
+
+    connectionsReady++;
+    while(!started){
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    while(!stopped){
+        int pick = (int)(random() % totalWeight);
+        int command = 0;
+        while(pick >= config.mix[command]){
+            pick -= config.mix[command];
+            command++;
+        }
+
+        //READ and DEL need message-ids, without any known ones the mailbox is listed instead
+        if((command == COMMAND_READ || command == COMMAND_DEL) && ids.empty()){
+            command = COMMAND_LIST;
+        }
+
+        std::string message;
+        switch(command){
+            case COMMAND_SEND:
+                message = sendRequest;
+                break;
+            case COMMAND_LIST:
+                message = "LIST\n";
+                break;
+            case COMMAND_READ:
+                message = "READ\n" + std::to_string(ids[random() % ids.size()]) + "\n";
+                break;
+            case COMMAND_DEL:
+                message = "DEL\n" + std::to_string(ids.front()) + "\n";
+                ids.pop_front();
+                break;
+        }
+
+        auto requestStart = std::chrono::steady_clock::now();
+        if(!request(socketDescriptor, message, response)){
+            fprintf(stderr, "Connection %d closed by server\n", index);
+            break;
+        }
+        uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - requestStart).count();
+
+        histograms[command].record(latency);
+
+        //another connection of the same account may have deleted the message already, that is counted as error
+        if(response.compare(0, 3, "ERR") == 0){
+            histograms[command].errors++;
+        }
+        if(command == COMMAND_LIST){
+            parseList(response, ids);
+        }
+    }
+
+    request(socketDescriptor, "QUIT\n", response);
+    close(socketDescriptor);
+}
+
+static bool request(int socket, const std::string &message, std::string &response){
+
+    //an empty message is not sent, only the next message from the server is received (welcome message)
+    if(!message.empty()){
+        uint32_t header = htonl((uint32_t)message.length());
+        if(!sendAll(socket, (const char *)&header, FRAME_HEADER_SIZE) || !sendAll(socket, message.data(), message.length())){
+            return false;
+        }
+    }
+
+    //responses are never chunked or tagged, the header is just the length
+    uint32_t header;
+    if(!receiveAll(socket, (char *)&header, FRAME_HEADER_SIZE)){
+        return false;
+    }
+    response.resize(ntohl(header) & FRAME_LENGTH_MASK);
+    return receiveAll(socket, &response[0], response.length());
+}
+
+static bool sendAll(int socket, const char *data, size_t length){
+    while(length > 0){
+        ssize_t bytesSent = send(socket, data, length, MSG_NOSIGNAL);
+        if(bytesSent <= 0){
+            return false;
+        }
+        data += bytesSent;
+        length -= bytesSent;
+    }
+    return true;
+}
+
+static bool receiveAll(int socket, char *data, size_t length){
+    while(length > 0){
+        ssize_t bytesReceived = recv(socket, data, length, MSG_WAITALL);
+        if(bytesReceived <= 0){
+            return false;
+        }
+        data += bytesReceived;
+        length -= bytesReceived;
+    }
+    return true;
+}
+
+static void parseList(const std::string &response, std::deque<int> &ids){
+
+    //"<count>\n<id> subject\n..." with ids in ascending order
+    ids.clear();
+    size_t position = 0;
+    while((position = response.find("\n<", position)) != std::string::npos){
+        position += 2;
+        ids.push_back(atoi(response.c_str() + position));
+    }
+}
+
+static bool parseMix(const char *text, int *mix){
+
+    int total = 0;
+    for(int command = 0; command < NUMBER_OF_COMMANDS; command++){
+        char *end;
+        long weight = strtol(text, &end, 10);
+        if(end == text || weight < 0 || (command < NUMBER_OF_COMMANDS - 1 && *end != ',') || (command == NUMBER_OF_COMMANDS - 1 && *end != '\0')){
+            return false;
+        }
+        mix[command] = (int)weight;
+        total += (int)weight;
+        text = end + 1;
+    }
+
+    //LIST is the fallback of READ and DEL, so it must be possible to pick SEND or LIST
+    return total > 0 && (mix[COMMAND_SEND] > 0 || mix[COMMAND_LIST] > 0 || (mix[COMMAND_READ] == 0 && mix[COMMAND_DEL] == 0));
+}
+
+static void printReport(Histogram *histograms, double seconds){
+
+    printf("\n%-8s %10s %8s %10s %10s %10s %10s %10s\n", "command", "requests", "errors", "req/s", "p50 us", "p99 us", "p999 us", "max us");
+
+    Histogram total;
+    for(int command = 0; command < NUMBER_OF_COMMANDS; command++){
+        Histogram &histogram = histograms[command];
+        total.merge(histogram);
+        if(histogram.total == 0){
+            continue;
+        }
+        printf("%-8s %10lu %8lu %10.0f %10lu %10lu %10lu %10lu\n", commandNames[command], histogram.total, histogram.errors, histogram.total / seconds,
+            histogram.percentile(50), histogram.percentile(99), histogram.percentile(99.9), histogram.max);
+    }
+    printf("%-8s %10lu %8lu %10.0f %10lu %10lu %10lu %10lu\n", "total", total.total, total.errors, total.total / seconds,
+        total.percentile(50), total.percentile(99), total.percentile(99.9), total.max);
+
+    if(!config.printHistograms){
+        return;
+    }
+
+    for(int command = 0; command < NUMBER_OF_COMMANDS; command++){
+        Histogram &histogram = histograms[command];
+        if(histogram.total == 0){
+            continue;
+        }
+        printf("\n%s latency histogram\n%12s %10s %10s\n", commandNames[command], "<= us", "count", "percent");
+        uint64_t cumulative = 0;
+        for(size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++){
+            if(histogram.counts[bucket] == 0){
+                continue;
+            }
+            cumulative += histogram.counts[bucket];
+            printf("%12lu %10lu %9.3f%%\n", highestValueOf(bucket), histogram.counts[bucket], 100.0 * cumulative / histogram.total);
+        }
+    }
+}
+
+//--- Histogram ---
+
+void Histogram::record(uint64_t value){
+    counts[bucketOf(value)]++;
+    total++;
+    if(value > max){
+        max = value;
+    }
+}
+
+void Histogram::merge(const Histogram &other){
+    for(size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++){
+        counts[bucket] += other.counts[bucket];
+    }
+    total += other.total;
+    errors += other.errors;
+    if(other.max > max){
+        max = other.max;
+    }
+}
+
+uint64_t Histogram::percentile(double percent) const{
+
+    if(total == 0){
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percent / 100.0 * total + 0.5);
+    if(rank < 1){
+        rank = 1;
+    }
+
+    uint64_t cumulative = 0;
+    for(size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++){
+        cumulative += counts[bucket];
+        if(cumulative >= rank){
+            return std::min(highestValueOf(bucket), max);
+        }
+    }
+    return max;
+}
+
+static size_t bucketOf(uint64_t value){
+
+    if(value < HISTOGRAM_SUB_BUCKETS){
+        return value;
+    }
+
+    //shift so that value >> shift is in [64, 128), the shift selects the power of two and the rest the bucket in it
+    //values in [64, 128) are still exact (shift 0) and continue right after the ones below 64
+    int shift = std::max(63 - __builtin_clzll(value) - 6, 0);
+    size_t bucket = HISTOGRAM_SUB_BUCKETS * shift + (value >> shift);
+    return std::min(bucket, (size_t)HISTOGRAM_BUCKETS - 1);
+}
+
+static uint64_t highestValueOf(size_t bucket){
+
+    if(bucket < 2 * HISTOGRAM_SUB_BUCKETS){
+        return bucket;
+    }
+
+    int shift = (int)(bucket / HISTOGRAM_SUB_BUCKETS) - 1;
+    uint64_t subBucket = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return ((subBucket + 1) << shift) - 1;
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string_view>
+#include <sstream>
+#include <regex>
+#include <vector>
+#include <chrono>
+#include <new>
+#include "../protocolSrc/parser.h"
+
+//compares the request parser (protocolSrc/parser.h) with the former istringstream/regex parsing of mailerLogic()
+//prints time and heap allocations per request for a mix of typical requests
+
+#define ITERATIONS 200000
+
+//--- Allocation counter ---
+
+static size_t allocations = 0;
+
+//only new is counted, delete just has to match it (noinline keeps the compiler from pairing malloc/free across them)
+__attribute__((noinline)) void *operator new(size_t size){
+    allocations++;
+    void *memory = malloc(size);
+    if(memory == nullptr){
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+__attribute__((noinline)) void operator delete(void *memory) noexcept{
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept{
+    free(memory);
+}
+
+//--- Former parsing (istringstream, std::string commands, regex per call) ---
+
+static int legacyCommand(std::string functionString){
+    if (functionString == "SEND") return SEND;
+    if (functionString == "LIST") return LIST;
+    if (functionString == "READ") return READ;
+    if (functionString == "DEL") return DEL;
+    if (functionString == "QUIT") return QUIT;
+    if (functionString == "LOGIN") return LOGIN;
+    return ERROR;
+}
+
+static int legacyParse(const std::string &buffer){
+
+    std::istringstream inputString(buffer);
+    std::string line;
+    std::getline(inputString, line);
+
+    int result = legacyCommand(line);
+    switch(result){
+        case LOGIN: {
+            std::string username, password;
+            std::getline(inputString, username);
+            std::getline(inputString, password);
+            result += username.length() + password.length();
+            break;
+        }
+        case SEND: {
+            std::string receiver, subject, body;
+            std::getline(inputString, receiver);
+            std::getline(inputString, subject);
+            result += std::regex_match(receiver, std::regex("[a-z0-9]{1,8}"));
+            result += std::regex_match(subject, std::regex(".{0,80}"));
+            while(std::getline(inputString, line)){
+                body += line + "\n";
+            }
+            result += body.length();
+            break;
+        }
+        case READ:
+        case DEL:
+            std::getline(inputString, line);
+            result += std::stoi(line);
+            break;
+    }
+
+    return result;
+}
+
+//--- Parser ---
+
+static int parserParse(const std::string &buffer){
+
+    RequestReader request{buffer};
+    std::string_view line;
+    request.nextLine(line);
+
+    int result = parseCommand(line);
+    switch(result){
+        case LOGIN: {
+            std::string_view username, password;
+            request.nextLine(username);
+            request.nextLine(password);
+            result += username.length() + password.length();
+            break;
+        }
+        case SEND: {
+            std::string_view receiver, subject;
+            request.nextLine(receiver);
+            request.nextLine(subject);
+            result += isValidUsername(receiver);
+            result += isValidSubject(subject);
+            result += request.rest.length();
+            break;
+        }
+        case READ:
+        case DEL: {
+            int id = 0;
+            request.nextLine(line);
+            parseMessageId(line, id);
+            result += id;
+            break;
+        }
+    }
+
+    return result;
+}
+
+static void run(const char *name, int (*parse)(const std::string &), const std::vector<std::string> &requests){
+
+    long checksum = 0;
+    size_t allocationsBefore = allocations;
+    auto start = std::chrono::steady_clock::now();
+
+    for(int i = 0; i < ITERATIONS; i++){
+        checksum += parse(requests[i % requests.size()]);
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    double nanoseconds = std::chrono::duration<double, std::nano>(end - start).count();
+
+    printf("%-8s %10.1f ns/request %8.2f allocations/request (checksum %ld)\n", name, nanoseconds / ITERATIONS,
+        (double)(allocations - allocationsBefore) / ITERATIONS, checksum);
+}
+
+int main(){
+
+    std::vector<std::string> requests = {
+        "LOGIN\nif21b001\nsecret\n",
+        "LIST\n",
+        "READ\n42\n",
+        "SEND\nif21b002\nMeeting tomorrow at ten in the usual room\nHi,\nsee you there.\n.\n",
+        "DEL\n7\n",
+        "SEND\nif21b003\nRe: Meeting\nok\n.\n",
+    };
+
+    printf("%d requests, mix of LOGIN, LIST, READ, SEND and DEL\n", ITERATIONS);
+    run("legacy", legacyParse, requests);
+    run("parser", parserParse, requests);
+
+    return 0;
+}
@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+//the server is a single translation unit, it is included without its main() so the benchmarks can call
+//sendMessage(), receiveMessage(), mailerLogic() and the storage backends exactly as the server does
+#define TWMAILER_NO_MAIN
+#include "../twmailer-server.cpp"
+
+//microbenchmarks of the server: framing over socketpairs, request parsing and validation, and the SEND, LIST, SEARCH,
+//READ and DEL paths of mailerLogic() on every storage backend at several mailbox sizes
+//results are written as JSON, one benchmark per line; with -b they are compared with an earlier run and the
+//benchmark fails if anything got slower than the threshold, so regressions between releases show up in `make bench`
+
+#define BENCH_MIN_TIME 0.5 //default seconds per benchmark (-t)
+#define BENCH_BATCH_TIME 0.01 //seconds a batch of iterations should take, the median over batches is reported
+#define BENCH_MIN_BATCHES 5
+#define BENCH_THRESHOLD 20 //default percent a benchmark may be slower than the baseline (-T)
+#define BENCH_MESSAGE_SIZE 1024 //body of the messages in the storage benchmarks
+
+static const int mailboxSizes[] = {10, 100, 1000, 10000};
+static const char *storageTypes[] = {STORAGE_DIRECTORY, STORAGE_SEGMENT};
+
+//--- Runner ---
+
+//passed to every benchmark, setup work inside a batch can be left out of the time with pause() and resume()
+struct BenchState {
+    long long iterations = 0;
+    std::chrono::steady_clock::duration paused{0};
+    std::chrono::steady_clock::time_point pausedAt;
+
+    void pause(){ pausedAt = std::chrono::steady_clock::now(); }
+    void resume(){ paused += std::chrono::steady_clock::now() - pausedAt; }
+};
+
+struct BenchResult {
+    std::string name;
+    long long iterations = 0; //over all measured batches
+    int batches = 0;
+    double median = 0; //nanoseconds per operation
+    double mean = 0;
+    double min = 0;
+    size_t bytes = 0; //payload per operation, 0 if it does not apply
+};
+
+static double minTime = BENCH_MIN_TIME;
+static const char *filter = NULL; //only benchmarks whose name contains it
+static std::vector<BenchResult> results;
+static volatile long sink; //results of pure functions go here, so the compiler can not drop the calls
+
+static double runBatch(const std::function<void(BenchState &)> &benchmark, long long iterations){
+
+    BenchState state;
+    state.iterations = iterations;
+
+    auto start = std::chrono::steady_clock::now();
+    benchmark(state);
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double>(end - start - state.paused).count();
+}
+
+//calibrates the iterations per batch to about BENCH_BATCH_TIME, then runs batches for at least minTime
+static void runBenchmark(const std::string &name, size_t bytes, const std::function<void(BenchState &)> &benchmark){
+
+    if(filter != NULL && name.find(filter) == std::string::npos){
+        return;
+    }
+
+    long long iterations = 1;
+    while(1){
+        double seconds = runBatch(benchmark, iterations);
+        if(seconds >= BENCH_BATCH_TIME || iterations >= (1LL << 30)){
+            break;
+        }
+        double factor = seconds > 0 ? BENCH_BATCH_TIME / seconds * 1.2 : 10;
+        iterations = std::max(iterations + 1, (long long)(iterations * std::min(factor, 10.0)));
+    }
+
+    BenchResult result;
+    result.name = name;
+    result.bytes = bytes;
+
+    std::vector<double> perOperation;
+    double total = 0;
+    while(total < minTime || (int)perOperation.size() < BENCH_MIN_BATCHES){
+        double seconds = runBatch(benchmark, iterations);
+        total += seconds;
+        result.iterations += iterations;
+        perOperation.push_back(seconds * 1e9 / iterations);
+    }
+
+    std::sort(perOperation.begin(), perOperation.end());
+    result.batches = perOperation.size();
+    result.median = perOperation[perOperation.size() / 2];
+    result.mean = total * 1e9 / result.iterations;
+    result.min = perOperation[0];
+
+    fprintf(stderr, "%-44s %12.1f ns/op %12.0f ops/s %10lld iterations\n", name.c_str(), result.median,
+        1e9 / result.median, result.iterations);
+    results.push_back(result);
+}
+
+//--- Framing ---
+
+//a message goes through sendMessage() on one end of a socketpair and receiveMessage() on the other,
+//one thread does both, so the message has to fit into the socket buffer
+static void framingBenchmarks(){
+
+    int sockets[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1){
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    for(size_t size : {64, 1024, 16 * 1024, 60 * 1024}){
+        for(bool tagged : {false, true}){
+            Session sender;
+            Session receiver;
+            sender.socket = sockets[0];
+            sender.requestTagged = tagged;
+            sender.requestId = 42;
+            sender.stringBuffer.assign(size, 'x');
+            receiver.socket = sockets[1];
+
+            std::string name = std::string("framing/") + (tagged ? "tagged/" : "") + "send+receive/" + std::to_string(size);
+            runBenchmark(name, size, [&](BenchState &state){
+                for(long long i = 0; i < state.iterations; i++){
+                    if(!sendMessage(sender) || !receiveMessage(receiver)){
+                        fprintf(stderr, "%s failed\n", name.c_str());
+                        exit(EXIT_FAILURE);
+                    }
+                }
+            });
+        }
+    }
+
+    close(sockets[0]);
+    close(sockets[1]);
+
+    //receiveData() alone, on a message that arrives in one piece and on one split into 1 KB chunks
+    for(size_t size : {64, 16 * 1024}){
+        std::string frames;
+        Session framer;
+        char header[FRAME_TAGGED_HEADER_SIZE];
+        frames.append(header, buildFrameHeader(framer, size, header));
+        frames.append(size, 'x');
+
+        for(size_t piece : {frames.length(), (size_t)1024}){
+            Session receiver;
+            std::string name = "framing/receiveData/" + std::to_string(size) + (piece == frames.length() ? "" : "/pieces");
+            runBenchmark(name, size, [&](BenchState &state){
+                for(long long i = 0; i < state.iterations; i++){
+                    for(size_t offset = 0; offset < frames.length(); offset += piece){
+                        size_t consumed;
+                        receiveData(receiver, &frames[offset], std::min(piece, frames.length() - offset), consumed);
+                    }
+                }
+            });
+        }
+    }
+}
+
+//--- Parsing and validation ---
+
+static void parsingBenchmarks(){
+
+    std::vector<std::string> commands = {"SEND", "LIST", "READ", "DEL", "QUIT", "LOGIN", "STATS", "HELLO"};
+    runBenchmark("parse/parseCommand", 0, [&](BenchState &state){
+        for(long long i = 0; i < state.iterations; i++){
+            sink += parseCommand(commands[i % commands.size()]);
+        }
+    });
+
+    std::vector<std::string> usernames = {"if21b001", "a", "toolongname", "Bad!", "if21b00x"};
+    runBenchmark("parse/isValidUsername", 0, [&](BenchState &state){
+        for(long long i = 0; i < state.iterations; i++){
+            sink += isValidUsername(usernames[i % usernames.size()]);
+        }
+    });
+
+    std::vector<std::string> subjects = {"Meeting tomorrow", std::string(80, 's'), std::string(81, 's'), ""};
+    runBenchmark("parse/isValidSubject", 0, [&](BenchState &state){
+        for(long long i = 0; i < state.iterations; i++){
+            sink += isValidSubject(subjects[i % subjects.size()]);
+        }
+    });
+
+    std::vector<int> ids;
+    runBenchmark("parse/parseMessageIdList", 0, [&](BenchState &state){
+        for(long long i = 0; i < state.iterations; i++){
+            sink += parseMessageIdList("1,3,5-9,20-40,77", ids);
+        }
+    });
+
+    ListRange range;
+    runBenchmark("parse/parseListRange", 0, [&](BenchState &state){
+        for(long long i = 0; i < state.iterations; i++){
+            sink += parseListRange(i % 2 ? "SINCE 1234,50" : "100,20", range);
+        }
+    });
+
+    std::vector<std::string> terms;
+    runBenchmark("parse/parseSearchQuery", 0, [&](BenchState &state){
+        for(long long i = 0; i < state.iterations; i++){
+            sink += parseSearchQuery(i % 2 ? "from:if21b001 Meeting" : "subject:report quarterly numbers", terms);
+        }
+    });
+
+    //requests that mailerLogic() parses completely but rejects before they reach the storage backend
+    std::vector<std::string> requests = {
+        "SEND\nif21b002\n" + std::string(81, 's') + "\nHi,\nsee you there.\n",
+        "SEND\nBad!,toolongname\n\n",
+        "READ\n12x\n",
+        "DEL\n1,2,,3\n",
+        "LIST\nSINCE x\n",
+        "SEARCH\na\n",
+        "HELLO\n",
+    };
+    Session session;
+    session.loggedIn = true;
+    session.sessionUsername = "bench";
+    runBenchmark("parse/mailerLogic/rejected", 0, [&](BenchState &state){
+        for(long long i = 0; i < state.iterations; i++){
+            session.stringBuffer = requests[i % requests.size()];
+            mailerLogic(session);
+        }
+    });
+}
+
+//--- Storage ---
+
+//SEND, LIST, SEARCH, READ and DEL through mailerLogic() on a mailbox that holds mailboxSize messages,
+//the mailbox keeps its size: what SEND adds and DEL removes is put back while the time is paused
+static void storageBenchmarks(const char *type, int mailboxSize){
+
+    std::string mailbox = "box" + std::to_string(mailboxSize);
+    std::string body(BENCH_MESSAGE_SIZE - 1, 'b');
+    body += '\n';
+    std::string message = "sender\n" + mailbox + "\nBenchmark\n" + body;
+
+    std::vector<int> ids;
+    for(int i = 0; i < mailboxSize; i++){
+        int id = storage->deliver(mailbox, "sender", "Benchmark", message);
+        if(id == -1){
+            fprintf(stderr, "could not fill mailbox %s\n", mailbox.c_str());
+            exit(EXIT_FAILURE);
+        }
+        ids.push_back(id);
+    }
+
+    Session session;
+    session.loggedIn = true;
+    session.sessionUsername = mailbox;
+    std::string prefix = std::string("storage/") + type + "/";
+    std::string suffix = "/n=" + std::to_string(mailboxSize);
+    int failures = 0;
+
+    //ids come from a counter and are never reused, the message of the next SEND gets the one after the last
+    int nextId = ids.back() + 1;
+    std::string sendRequest = "SEND\n" + mailbox + "\nBenchmark\n" + body;
+    runBenchmark(prefix + "send" + suffix, BENCH_MESSAGE_SIZE, [&](BenchState &state){
+        for(long long i = 0; i < state.iterations; i++){
+            session.stringBuffer = sendRequest;
+            mailerLogic(session);
+            state.pause();
+            failures += session.stringBuffer != "OK\n" || !storage->remove(mailbox, nextId++);
+            state.resume();
+        }
+    });
+
+    runBenchmark(prefix + "list" + suffix, 0, [&](BenchState &state){
+        for(long long i = 0; i < state.iterations; i++){
+            session.stringBuffer = "LIST\n";
+            mailerLogic(session);
+        }
+    });
+
+    //every message matches, so the answer is as long as the one of LIST
+    std::string searchCount = std::to_string(mailboxSize) + "\n";
+    runBenchmark(prefix + "search" + suffix, 0, [&](BenchState &state){
+        for(long long i = 0; i < state.iterations; i++){
+            session.stringBuffer = "SEARCH\nfrom:sender benchmark\n";
+            mailerLogic(session);
+            failures += session.stringBuffer.compare(0, searchCount.length(), searchCount) != 0;
+        }
+    });
+
+    std::vector<std::string> readRequests;
+    for(int id : ids){
+        readRequests.push_back("READ\n" + std::to_string(id) + "\n");
+    }
+    runBenchmark(prefix + "read" + suffix, message.length(), [&](BenchState &state){
+        for(long long i = 0; i < state.iterations; i++){
+            session.stringBuffer = readRequests[i % readRequests.size()];
+            mailerLogic(session);
+            failures += session.responseFiles.size() != 1;
+            closeResponseFiles(session);
+        }
+    });
+
+    runBenchmark(prefix + "del" + suffix, 0, [&](BenchState &state){
+        for(long long i = 0; i < state.iterations; i++){
+            state.pause();
+            int id = storage->deliver(mailbox, "sender", "Benchmark", message);
+            session.stringBuffer = "DEL\n" + std::to_string(id) + "\n";
+            state.resume();
+            mailerLogic(session);
+            failures += session.stringBuffer != "OK\n";
+        }
+    });
+
+    if(failures > 0){
+        fprintf(stderr, "%s%s: %d requests failed, results are not valid\n", prefix.c_str(), mailbox.c_str(), failures);
+        exit(EXIT_FAILURE);
+    }
+}
+
+//--- Output ---
+
+static std::string jsonString(const std::string &text){
+
+    std::string escaped = "\"";
+    for(char c : text){
+        if(c == '"' || c == '\\'){
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped + "\"";
+}
+
+static void writeResults(FILE *output){
+
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    char date[32];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    fprintf(output, "{\n\"context\": {\"date\": \"%s\", \"host\": %s, \"cpus\": %u, \"compiler\": %s, \"min_time\": %g},\n\"benchmarks\": [\n",
+        date, jsonString(host).c_str(), std::thread::hardware_concurrency(), jsonString(__VERSION__).c_str(), minTime);
+
+    for(size_t i = 0; i < results.size(); i++){
+        const BenchResult &result = results[i];
+        fprintf(output, "{\"name\": %s, \"ns_per_op\": %.1f, \"ns_per_op_mean\": %.1f, \"ns_per_op_min\": %.1f, \"ops_per_sec\": %.0f, \"bytes_per_op\": %zu, \"iterations\": %lld, \"batches\": %d}%s\n",
+            jsonString(result.name).c_str(), result.median, result.mean, result.min, 1e9 / result.median, result.bytes,
+            result.iterations, result.batches, i + 1 < results.size() ? "," : "");
+    }
+
+    fprintf(output, "]\n}\n");
+}
+
+//reads the results of an earlier run (one benchmark per line as written above) and compares the medians
+//returns the number of benchmarks that are slower than threshold percent
+static int compareResults(const char *baselinePath, double threshold){
+
+    FILE *baseline = fopen(baselinePath, "r");
+    if(baseline == NULL){
+        perror(baselinePath);
+        exit(EXIT_FAILURE);
+    }
+
+    int regressions = 0;
+    char line[1024];
+    fprintf(stderr, "\ncompared with %s (threshold %g%%):\n", baselinePath, threshold);
+    while(fgets(line, sizeof(line), baseline) != NULL){
+        char name[256];
+        double before;
+        if(sscanf(line, "{\"name\": \"%255[^\"]\", \"ns_per_op\": %lf", name, &before) != 2){
+            continue;
+        }
+
+        auto result = std::find_if(results.begin(), results.end(), [&name](const BenchResult &result){ return result.name == name; });
+        if(result == results.end()){
+            continue;
+        }
+
+        double change = (result->median - before) / before * 100;
+        bool regression = change > threshold;
+        regressions += regression;
+        if(regression || change < -threshold){
+            fprintf(stderr, "%-44s %12.1f -> %10.1f ns/op %+7.1f%%%s\n", name, before, result->median, change,
+                regression ? " REGRESSION" : "");
+        }
+    }
+    fclose(baseline);
+
+    fprintf(stderr, "%d regression%s\n", regressions, regressions == 1 ? "" : "s");
+    return regressions;
+}
+
+int main(int argc, char *argv[]){
+
+    const char *outputPath = NULL;
+    const char *baselinePath = NULL;
+    double threshold = BENCH_THRESHOLD;
+    const char *directory = NULL;
+    int durability = WAL_NONE; //the storage paths are measured without the write-ahead log unless -D says otherwise
+
+    int option;
+    while((option = getopt(argc, argv, "o:b:T:t:f:d:D:")) != -1){
+        switch(option){
+            case 'o':
+                outputPath = optarg;
+                break;
+            case 'b':
+                baselinePath = optarg;
+                break;
+            case 'T':
+                threshold = atof(optarg);
+                break;
+            case 't':
+                minTime = atof(optarg);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'd':
+                directory = optarg;
+                break;
+            case 'D':
+                durability = parseDurability(optarg);
+                if(durability == -1){
+                    fprintf(stderr, "Unknown durability: %s (none, batched or per-message)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-o results.json] [-b baseline.json] [-T threshold-percent] [-t seconds-per-benchmark] [-f name-filter] [-d data-directory] [-D none|batched|per-message]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    //mailboxes are created in a fresh directory that is removed afterwards
+    char temporaryDirectory[] = "/tmp/twmailer-bench.XXXXXX";
+    if(directory == NULL && (directory = mkdtemp(temporaryDirectory)) == NULL){
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    fs::create_directories(directory);
+
+    //log records go to stdout like in the server, only errors are logged so they do not end up in the results
+    signal(SIGPIPE, SIG_IGN);
+    initLogger(LOG_LEVEL_ERROR, LOG_DEFAULT_RATE_LIMIT);
+    initLocks(directory);
+    initMetrics(1);
+    if(!initWriteAheadLog(directory, durability)){
+        exit(EXIT_FAILURE);
+    }
+
+    for(const char *type : storageTypes){
+        fs::create_directories(fs::path(directory) / type);
+        storage = createStorage(type, (fs::path(directory) / type).string());
+
+        if(type == storageTypes[0]){
+            framingBenchmarks();
+            parsingBenchmarks();
+        }
+
+        for(int mailboxSize : mailboxSizes){
+            storageBenchmarks(type, mailboxSize);
+        }
+
+        delete storage;
+        storage = nullptr;
+    }
+
+    if(directory == temporaryDirectory){
+        fs::remove_all(directory);
+    }
+
+    FILE *output = stdout;
+    if(outputPath != NULL && (output = fopen(outputPath, "w")) == NULL){
+        perror(outputPath);
+        exit(EXIT_FAILURE);
+    }
+    writeResults(output);
+    if(output != stdout){
+        fclose(output);
+        fprintf(stderr, "results written to %s\n", outputPath);
+    }
+
+    if(baselinePath != NULL && compareResults(baselinePath, threshold) > 0){
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include "authCache.h"
+#include "../logSrc/log.h"
+#include "../storageSrc/lock.h"
+
+#define AUTH_CACHE_SALT_SIZE 16
+#define AUTH_CACHE_HASH_SIZE 32
+
+struct AuthCacheEntry {
+    char username[AUTH_CACHE_MAX_USERNAME + 1]; //empty if the entry is unused
+    unsigned char salt[AUTH_CACHE_SALT_SIZE];
+    unsigned char hash[AUTH_CACHE_HASH_SIZE];
+    long long expires; //milliseconds of CLOCK_MONOTONIC, same clock in all processes
+};
+
+static AuthCacheEntry *authCache = NULL; //shared mapping of authCacheSize entries
+static int authCacheSize = 0;
+static int authCacheTTL = 0;
+
+static bool hashPassword(const std::string &password, const unsigned char *salt, unsigned char *hash);
+static long long now(); //milliseconds of CLOCK_MONOTONIC
+static int findEntry(const std::string &username); //index of the entry of username, -1 if there is none, cache must be locked
+
+void initAuthCache(int size, int ttl){
+
+    authCacheTTL = ttl;
+    if(ttl <= 0 || size <= 0){
+        return;
+    }
+
+    //anonymous shared mapping, inherited by every process forked afterwards
+    void *mapping = mmap(NULL, size * sizeof(AuthCacheEntry), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mapping == MAP_FAILED){
+        logErrno("mmap auth cache");
+        return; //logins still work, always with LDAP
+    }
+
+    authCache = (AuthCacheEntry *)mapping; //zero-filled, so all entries are unused
+    authCacheSize = size;
+}
+
+bool checkAuthCache(const std::string &username, const std::string &password){
+
+    if(authCache == NULL || username.empty() || username.length() > AUTH_CACHE_MAX_USERNAME){
+        return false;
+    }
+
+    //the entry is copied, so the slow hash is computed without holding the lock
+    AuthCacheEntry entry;
+    int lockFile = lock("authCache", LOCK_SH);
+    if(lockFile == -1){
+        return false; //treated as a miss, the login goes to LDAP
+    }
+    int index = findEntry(username);
+    if(index != -1){
+        entry = authCache[index];
+    }
+    unlock(lockFile);
+
+    if(index == -1 || entry.expires <= now()){
+        return false;
+    }
+
+    unsigned char hash[AUTH_CACHE_HASH_SIZE];
+    return hashPassword(password, entry.salt, hash) && CRYPTO_memcmp(hash, entry.hash, AUTH_CACHE_HASH_SIZE) == 0;
+}
+
+void addToAuthCache(const std::string &username, const std::string &password){
+
+    if(authCache == NULL || username.empty() || username.length() > AUTH_CACHE_MAX_USERNAME){
+        return;
+    }
+
+    AuthCacheEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    strcpy(entry.username, username.c_str());
+    if(RAND_bytes(entry.salt, AUTH_CACHE_SALT_SIZE) != 1 || !hashPassword(password, entry.salt, entry.hash)){
+        return;
+    }
+    entry.expires = now() + authCacheTTL * 1000LL;
+
+    int lockFile = lock("authCache", LOCK_EX);
+    if(lockFile == -1){
+        return;
+    }
+
+    //same user again (e.g. new password) -> replace, otherwise replace the entry that expires first (unused entries expire at 0)
+    int index = findEntry(username);
+    if(index == -1){
+        index = 0;
+        for(int i = 1; i < authCacheSize; i++){
+            if(authCache[i].expires < authCache[index].expires){
+                index = i;
+            }
+        }
+    }
+    authCache[index] = entry;
+
+    unlock(lockFile);
+}
+
+static bool hashPassword(const std::string &password, const unsigned char *salt, unsigned char *hash){
+    return PKCS5_PBKDF2_HMAC(password.data(), password.length(), salt, AUTH_CACHE_SALT_SIZE, AUTH_CACHE_HASH_ITERATIONS, EVP_sha256(), AUTH_CACHE_HASH_SIZE, hash) == 1;
+}
+
+static long long now(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000LL + time.tv_nsec / 1000000;
+}
+
+static int findEntry(const std::string &username){
+
+    //the cache is small, a linear scan costs much less than the hash of the password
+    for(int i = 0; i < authCacheSize; i++){
+        if(authCache[i].username[0] != '\0' && username == authCache[i].username){
+            return i;
+        }
+    }
+    return -1;
+}
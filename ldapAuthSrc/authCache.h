@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+//successful LDAP logins are remembered for a while, so a user who logs in again (e.g. with a second connection) skips the LDAP bind
+//the cache lives in shared memory created before the server forks, so all client processes and worker threads use the same one
+//passwords are not stored, only a salted PBKDF2 hash of them; failed logins are never cached
+#define AUTH_CACHE_DEFAULT_TTL 300 //seconds a successful login is remembered, 0 disables the cache
+#define AUTH_CACHE_DEFAULT_SIZE 1024 //max. number of remembered logins, the oldest one is replaced when the cache is full
+#define AUTH_CACHE_MAX_USERNAME 32 //longer usernames are not cached
+#define AUTH_CACHE_HASH_ITERATIONS 10000 //PBKDF2-HMAC-SHA256 rounds, makes guessing passwords from a memory dump slow
+
+void initAuthCache(int size, int ttl); //has to be called before the server forks, uses the lock "authCache" (see lock.h)
+bool checkAuthCache(const std::string &username, const std::string &password); //true if username logged in with this password within the ttl
+void addToAuthCache(const std::string &username, const std::string &password); //remember a successful LDAP login
@@ -1,56 +1,315 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <time.h>
 #include <ldap.h>
 #include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include "ldapAuth.h"
+#include "../logSrc/log.h"
+
+static LDAPConfig ldapConfig;
+
+//idle connections, openConnections counts idle and borrowed ones
+static std::mutex poolMutex;
+static std::condition_variable connectionReleased;
+static std::vector<LDAP *> idleConnections;
+static int openConnections = 0;
+
+static int startBind(const std::string &username, const std::string &password, LDAPBind &bind, bool wait); //wait: for a free pooled connection
+static int sendBind(LDAPBind &bind, bool wait);
+static int receiveBind(LDAPBind &bind, struct timeval *timeout, bool wait);
+static LDAP *connectLDAP();
+static LDAP *acquireConnection(bool wait, bool &poolBusy); //NULL if connecting failed or (without wait) all connections are in use
+static void releaseConnection(LDAP *ldapHandle, bool healthy);
+static bool isConnectionAlive(LDAP *ldapHandle);
+static std::string escapeDNValue(const std::string &value);
+static long long now(); //milliseconds of CLOCK_MONOTONIC
+
+bool LDAPconfigure(const LDAPConfig &config){
+
+    //exactly one %s and no other conversion, the template is used as format string
+    size_t conversion = config.dnTemplate.find('%');
+    if(conversion == std::string::npos || config.dnTemplate.compare(conversion, 2, "%s") != 0 || config.dnTemplate.find('%', conversion + 1) != std::string::npos){
+        return false;
+    }
+    if(config.poolSize < 1 || config.timeout < 1){
+        return false;
+    }
+
+    ldapConfig = config;
+    return true;
+}
 
 bool LDAPauthenticate(std::string username, std::string password){
 
-    const char *ldapUri = "ldap://ldap.technikum-wien.at:389";
-    const int ldapVersion = LDAP_VERSION3;
-    LDAP *ldapHandle;
+    LDAPBind bind;
+    int result = startBind(username, password, bind, true);
+
+    while(result == LDAP_BIND_PENDING){
+        long long timeLeft = bind.deadline - now();
+        if(timeLeft <= 0){
+            logWarn("LDAP bind timed out");
+            LDAPcancelBind(bind);
+            return false;
+        }
+
+        struct timeval timeout;
+        timeout.tv_sec = timeLeft / 1000;
+        timeout.tv_usec = (timeLeft % 1000) * 1000;
+        result = receiveBind(bind, &timeout, true);
+    }
 
-    char ldapBindUser[256];
-    const char* ldapBindPassword;
-    
-    sprintf(ldapBindUser, "uid=%s,ou=people,dc=technikum-wien,dc=at", username.c_str());
-    ldapBindPassword = password.c_str();
-    
+    return result == LDAP_BIND_SUCCESS;
+}
 
-    if(ldap_initialize(&ldapHandle, ldapUri) != LDAP_SUCCESS){
-        fprintf(stderr, "ldap_init failed\n");
-        perror("ldap_initialize");
-        exit(EXIT_FAILURE);
+int LDAPstartBind(const std::string &username, const std::string &password, LDAPBind &bind){
+    return startBind(username, password, bind, false);
+}
+
+int LDAPcheckBind(LDAPBind &bind){
+
+    if(now() >= bind.deadline){
+        logWarn("LDAP bind timed out");
+        LDAPcancelBind(bind);
+        return LDAP_BIND_FAILED;
     }
 
-    //printf("connected to LDAP server %s\n", ldapUri);
+    if(bind.handle == NULL){
+        return sendBind(bind, false);
+    }
+
+    struct timeval noWait = {0, 0};
+    return receiveBind(bind, &noWait, false);
+}
+
+void LDAPcancelBind(LDAPBind &bind){
+
+    if(bind.handle != NULL){
+        //the result could still arrive later, so the connection is not reused
+        ldap_abandon_ext(bind.handle, bind.messageId, NULL, NULL);
+        releaseConnection(bind.handle, false);
+        bind.handle = NULL;
+        bind.socket = -1;
+    }
+}
+
+int LDAPnextCheck(const LDAPBind &bind){
+
+    long long timeLeft = bind.deadline - now();
+    if(timeLeft < 0){
+        timeLeft = 0;
+    }
+    if(bind.handle == NULL && timeLeft > LDAP_POOL_RETRY_INTERVAL){
+        timeLeft = LDAP_POOL_RETRY_INTERVAL;
+    }
+
+    return (int)timeLeft;
+}
+
+static int startBind(const std::string &username, const std::string &password, LDAPBind &bind, bool wait){
+
+    bind = LDAPBind();
+
+    //a simple bind with an empty password is an anonymous bind, which always succeeds
+    if(username.empty() || password.empty() || username.find('\0') != std::string::npos){
+        return LDAP_BIND_FAILED;
+    }
+
+    std::string escapedUsername = escapeDNValue(username);
+    std::vector<char> ldapBindUser(ldapConfig.dnTemplate.length() + escapedUsername.length() + 1);
+    snprintf(ldapBindUser.data(), ldapBindUser.size(), ldapConfig.dnTemplate.c_str(), escapedUsername.c_str());
+
+    bind.dn = ldapBindUser.data();
+    bind.password = password;
+    bind.deadline = now() + ldapConfig.timeout * 1000LL;
+
+    return sendBind(bind, wait);
+}
+
+static int sendBind(LDAPBind &bind, bool wait){
+
+    //a pooled connection may have been closed by the server in the meantime, then the bind is repeated once on a new connection
+    while(bind.attempt < 2){
+        bool poolBusy = false;
+        LDAP *ldapHandle = acquireConnection(wait, poolBusy);
+        if(ldapHandle == NULL){
+            return poolBusy ? LDAP_BIND_PENDING : LDAP_BIND_FAILED;
+        }
+
+        BerValue bindCredentials;
+        bindCredentials.bv_val = (char *)bind.password.c_str();
+        bindCredentials.bv_len = bind.password.length();
+
+        int rc = ldap_sasl_bind(ldapHandle, bind.dn.c_str(), LDAP_SASL_SIMPLE, &bindCredentials, NULL, NULL, &bind.messageId);
+        if(rc == LDAP_SUCCESS && ldap_get_option(ldapHandle, LDAP_OPT_DESC, &bind.socket) == LDAP_OPT_SUCCESS){
+            bind.handle = ldapHandle;
+            return LDAP_BIND_PENDING;
+        }
+
+        logWarn("LDAP bind error: %s", ldap_err2string(rc));
+        releaseConnection(ldapHandle, false);
+        bind.socket = -1;
+        bind.attempt++;
+    }
+
+    return LDAP_BIND_FAILED;
+}
+
+static int receiveBind(LDAPBind &bind, struct timeval *timeout, bool wait){
+
+    LDAPMessage *result = NULL;
+    int rc = ldap_result(bind.handle, bind.messageId, LDAP_MSG_ALL, timeout, &result);
+    if(rc == 0){
+        return LDAP_BIND_PENDING;
+    }
+
+    if(rc == -1){
+        //connection lost while waiting (e.g. closed by the server), the request is sent again on a new connection
+        logWarn("LDAP bind error: connection lost");
+        releaseConnection(bind.handle, false);
+        bind.handle = NULL;
+        bind.socket = -1;
+        bind.attempt++;
+        return sendBind(bind, wait);
+    }
+
+    int errorCode = -1;
+    if(ldap_parse_result(bind.handle, result, &errorCode, NULL, NULL, NULL, NULL, 1) != LDAP_SUCCESS){
+        errorCode = -1;
+    }
+
+    //a failed bind leaves the connection anonymous, it can be reused for the next bind either way
+    releaseConnection(bind.handle, true);
+    bind.handle = NULL;
+    bind.socket = -1;
+
+    return errorCode == LDAP_SUCCESS ? LDAP_BIND_SUCCESS : LDAP_BIND_FAILED;
+}
+
+static LDAP *connectLDAP(){
+
+    const int ldapVersion = LDAP_VERSION3;
+    LDAP *ldapHandle;
+
+    if(ldap_initialize(&ldapHandle, ldapConfig.uri.c_str()) != LDAP_SUCCESS){
+        logError("ldap_init failed");
+        return NULL;
+    }
 
     if(ldap_set_option(ldapHandle, LDAP_OPT_PROTOCOL_VERSION, &ldapVersion) != LDAP_SUCCESS){
-        fprintf(stderr, "ldap_set_option failed\n");
-        perror("ldap_set_option");
+        logError("ldap_set_option failed");
         ldap_unbind_ext_s(ldapHandle, NULL, NULL);
-        exit(EXIT_FAILURE);
+        return NULL;
     }
 
+    //connecting and StartTLS are still synchronous, the timeouts keep an unreachable server from stalling an event loop for long
+    struct timeval timeout;
+    timeout.tv_sec = ldapConfig.timeout;
+    timeout.tv_usec = 0;
+    ldap_set_option(ldapHandle, LDAP_OPT_NETWORK_TIMEOUT, &timeout);
+    ldap_set_option(ldapHandle, LDAP_OPT_TIMEOUT, &timeout);
+
     int rc = 0; // return code
 
-    if((rc = ldap_start_tls_s(ldapHandle, NULL, NULL)) != LDAP_SUCCESS){
-        fprintf(stderr, "ldap_start_tls_s(): %s\n", ldap_err2string(rc));
+    if(ldapConfig.startTLS && (rc = ldap_start_tls_s(ldapHandle, NULL, NULL)) != LDAP_SUCCESS){
+        logError("ldap_start_tls_s(): %s", ldap_err2string(rc));
         ldap_unbind_ext_s(ldapHandle, NULL, NULL);
-        exit(EXIT_FAILURE);
-    };
+        return NULL;
+    }
+
+    return ldapHandle;
+}
+
+static LDAP *acquireConnection(bool wait, bool &poolBusy){
 
-    BerValue bindCredentials;
-    bindCredentials.bv_val = (char *)ldapBindPassword;
-    bindCredentials.bv_len = strlen(ldapBindPassword);
-    BerValue *servercredp; // server's credentials
+    std::unique_lock<std::mutex> poolLock(poolMutex);
 
-    if((rc = ldap_sasl_bind_s(ldapHandle, ldapBindUser, LDAP_SASL_SIMPLE, &bindCredentials, NULL, NULL, &servercredp)) != LDAP_SUCCESS){
-        //fprintf(stderr, "LDAP bind error: %s\n", ldap_err2string(rc));
+    while(1){
+        while(!idleConnections.empty()){
+            LDAP *ldapHandle = idleConnections.back();
+            idleConnections.pop_back();
+            if(isConnectionAlive(ldapHandle)){
+                return ldapHandle;
+            }
+            ldap_unbind_ext_s(ldapHandle, NULL, NULL);
+            openConnections--;
+        }
+
+        if(openConnections < ldapConfig.poolSize){
+            break;
+        }
+        if(!wait){
+            poolBusy = true;
+            return NULL;
+        }
+        connectionReleased.wait(poolLock);
+    }
+
+    //connecting takes a full TCP and TLS handshake, other threads can use the pool meanwhile
+    openConnections++;
+    poolLock.unlock();
+
+    LDAP *ldapHandle = connectLDAP();
+    if(ldapHandle == NULL){
+        poolLock.lock();
+        openConnections--;
+        connectionReleased.notify_one();
+    }
+
+    return ldapHandle;
+}
+
+static void releaseConnection(LDAP *ldapHandle, bool healthy){
+
+    if(!healthy){
         ldap_unbind_ext_s(ldapHandle, NULL, NULL);
+    }
+
+    std::lock_guard<std::mutex> poolLock(poolMutex);
+    if(healthy){
+        idleConnections.push_back(ldapHandle);
+    } else {
+        openConnections--;
+    }
+    connectionReleased.notify_one();
+}
+
+static bool isConnectionAlive(LDAP *ldapHandle){
+
+    //an idle connection never has anything to read, unless the server closed it (or sent a notice of disconnection)
+    int socketDescriptor = -1;
+    if(ldap_get_option(ldapHandle, LDAP_OPT_DESC, &socketDescriptor) != LDAP_OPT_SUCCESS || socketDescriptor < 0){
         return false;
-    };
+    }
 
-    ldap_unbind_ext_s(ldapHandle, NULL, NULL);
-    return true;
-}
\ No newline at end of file
+    struct pollfd connection;
+    connection.fd = socketDescriptor;
+    connection.events = POLLIN | POLLRDHUP;
+    connection.revents = 0;
+
+    return poll(&connection, 1, 0) == 0;
+}
+
+static std::string escapeDNValue(const std::string &value){
+
+    //RFC 4514: special characters anywhere, '#' and ' ' at the start and ' ' at the end are escaped with a backslash
+    std::string escaped;
+    for(size_t i = 0; i < value.length(); i++){
+        char c = value[i];
+        if(strchr(",+\"\\<>;=", c) != NULL || (c == '#' && i == 0) || (c == ' ' && (i == 0 || i == value.length() - 1))){
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+static long long now(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000LL + time.tv_nsec / 1000000;
+}
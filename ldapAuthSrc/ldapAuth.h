@@ -1,2 +1,44 @@
+#pragma once
 
-bool LDAPauthenticate(std::string username, std::string password);
+#include <ldap.h>
+#include <string>
+
+//binds are done on a pool of connections that are already connected (and upgraded with StartTLS), so a LOGIN costs one round trip
+//connections are created on demand, each process has its own pool (fork mode: one per client process)
+#define LDAP_DEFAULT_URI "ldap://ldap.technikum-wien.at:389"
+#define LDAP_DEFAULT_DN_TEMPLATE "uid=%s,ou=people,dc=technikum-wien,dc=at" //%s is replaced with the escaped username
+#define LDAP_DEFAULT_POOL_SIZE 8 //max. number of connections per process, more concurrent logins wait for a free one
+#define LDAP_DEFAULT_TIMEOUT 5 //seconds until a bind (or connecting to the LDAP server) fails
+
+struct LDAPConfig {
+    std::string uri = LDAP_DEFAULT_URI;
+    std::string dnTemplate = LDAP_DEFAULT_DN_TEMPLATE;
+    bool startTLS = true; //off only for test servers without TLS
+    int poolSize = LDAP_DEFAULT_POOL_SIZE;
+    int timeout = LDAP_DEFAULT_TIMEOUT;
+};
+
+bool LDAPconfigure(const LDAPConfig &config); //has to be called before the first LDAPauthenticate(), false if the dn template is invalid
+bool LDAPauthenticate(std::string username, std::string password); //blocks until the bind is done, false for wrong credentials, timeout and if the LDAP server is not reachable
+
+//asynchronous bind for event loops: LDAPstartBind() sends the request, LDAPcheckBind() picks up the result once socket is readable
+//a bind that waits for a free pooled connection has socket -1, it is sent by a later LDAPcheckBind()
+#define LDAP_BIND_PENDING 0
+#define LDAP_BIND_SUCCESS 1
+#define LDAP_BIND_FAILED 2 //wrong credentials, timeout or LDAP server not reachable
+#define LDAP_POOL_RETRY_INTERVAL 10 //milliseconds between two attempts to get a pooled connection for a waiting bind
+
+struct LDAPBind {
+    LDAP *handle = NULL; //pooled connection the request was sent on
+    int messageId = -1;
+    int socket = -1; //socket of handle
+    long long deadline = 0; //milliseconds of CLOCK_MONOTONIC
+    int attempt = 0; //a lost connection is replaced once
+    std::string dn;
+    std::string password;
+};
+
+int LDAPstartBind(const std::string &username, const std::string &password, LDAPBind &bind); //never waits for the LDAP server
+int LDAPcheckBind(LDAPBind &bind); //call when socket is readable, periodically while socket is -1 and once the deadline is over
+void LDAPcancelBind(LDAPBind &bind); //abandons a pending bind, e.g. when the client disconnected
+int LDAPnextCheck(const LDAPBind &bind); //milliseconds until LDAPcheckBind() has to be called even if socket is not readable
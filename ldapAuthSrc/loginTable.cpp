@@ -0,0 +1,240 @@
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <atomic>
+#include "loginTable.h"
+#include "../logSrc/log.h"
+
+struct LoginTableEntry {
+    uint32_t ip; //network byte order, 0 if the entry is unused
+    uint32_t failedAttempts;
+    int64_t lastFailedAttempt; //seconds since epoch, like blacklistedUntil so a snapshot stays valid after a restart
+    int64_t blacklistedUntil;
+};
+
+struct LoginTableStripe {
+    std::atomic<bool> locked;
+    LoginTableEntry entries[LOGIN_TABLE_STRIPE_SIZE];
+};
+
+static_assert(std::atomic<bool>::is_always_lock_free, "spinlocks in shared memory have to be lock-free");
+
+#define LOGIN_TABLE_PROBES 16 //entries of a stripe that are searched for an ip, starting at its hash
+
+static LoginTableStripe *loginTable = NULL; //shared mapping of LOGIN_TABLE_STRIPES stripes
+static LoginPolicy loginPolicy;
+
+static bool parseIP(const std::string &clientIP, uint32_t &ip);
+static LoginTableStripe &stripeOf(uint32_t ip, uint32_t &start); //start: first entry to probe
+static void lockStripe(LoginTableStripe &stripe);
+static void unlockStripe(LoginTableStripe &stripe);
+static LoginTableEntry *findEntry(LoginTableStripe &stripe, uint32_t start, uint32_t ip, bool create, int64_t now); //stripe must be locked
+static bool isExpired(const LoginTableEntry &entry, int64_t now);
+static int retention(const LoginTableEntry &entry, int64_t now); //0 unused or expired, 1 counting failed attempts, 2 blacklisted
+
+void initLoginTable(const LoginPolicy &policy){
+
+    loginPolicy = policy;
+
+    //anonymous shared mapping, inherited by every process forked afterwards
+    void *mapping = mmap(NULL, LOGIN_TABLE_STRIPES * sizeof(LoginTableStripe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mapping == MAP_FAILED){
+        logErrno("mmap login table");
+        exit(EXIT_FAILURE);
+    }
+
+    loginTable = (LoginTableStripe *)mapping; //zero-filled: all stripes unlocked, all entries unused
+}
+
+int blacklistTimeLeft(const std::string &clientIP){
+
+    uint32_t ip;
+    if(!parseIP(clientIP, ip)){
+        return 0;
+    }
+
+    int64_t now = time(NULL);
+    uint32_t start;
+    LoginTableStripe &stripe = stripeOf(ip, start);
+    lockStripe(stripe);
+    LoginTableEntry *entry = findEntry(stripe, start, ip, false, now);
+    int64_t timeLeft = entry != NULL ? entry->blacklistedUntil - now : 0;
+    unlockStripe(stripe);
+
+    return timeLeft > 0 ? (int)timeLeft : 0;
+}
+
+bool recordFailedLogin(const std::string &clientIP){
+
+    uint32_t ip;
+    if(!parseIP(clientIP, ip)){
+        return false;
+    }
+
+    int64_t now = time(NULL);
+    uint32_t start;
+    LoginTableStripe &stripe = stripeOf(ip, start);
+    lockStripe(stripe);
+    LoginTableEntry *entry = findEntry(stripe, start, ip, true, now);
+
+    bool blacklisted = false;
+    if(entry->lastFailedAttempt + loginPolicy.failedAttemptTime <= now){
+        entry->failedAttempts = 0; //earlier attempts are forgotten
+    }
+    entry->lastFailedAttempt = now;
+    if(++entry->failedAttempts > (uint32_t)loginPolicy.maxFailedAttempts){
+        entry->failedAttempts = 0;
+        entry->blacklistedUntil = now + loginPolicy.blacklistTime;
+        blacklisted = true;
+    }
+
+    unlockStripe(stripe);
+
+    return blacklisted;
+}
+
+bool saveLoginTable(const std::string &path){
+
+    std::string temporary = path + ".tmp";
+    FILE *snapshot = fopen(temporary.c_str(), "w");
+    if(snapshot == NULL){
+        logErrno("fopen login table snapshot");
+        return false;
+    }
+
+    //entries are copied stripe by stripe, so the lock is not held during file i/o
+    int64_t now = time(NULL);
+    LoginTableEntry entries[LOGIN_TABLE_STRIPE_SIZE];
+    for(int i = 0; i < LOGIN_TABLE_STRIPES; i++){
+        lockStripe(loginTable[i]);
+        memcpy(entries, loginTable[i].entries, sizeof(entries));
+        unlockStripe(loginTable[i]);
+
+        for(const LoginTableEntry &entry : entries){
+            if(entry.ip == 0 || isExpired(entry, now)){
+                continue;
+            }
+            char ipString[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &entry.ip, ipString, sizeof(ipString));
+            fprintf(snapshot, "%s %u %lld %lld\n", ipString, entry.failedAttempts, (long long)entry.lastFailedAttempt, (long long)entry.blacklistedUntil);
+        }
+    }
+
+    if(fclose(snapshot) != 0 || rename(temporary.c_str(), path.c_str()) != 0){
+        logErrno("write login table snapshot");
+        remove(temporary.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void loadLoginTable(const std::string &path){
+
+    FILE *snapshot = fopen(path.c_str(), "r");
+    if(snapshot == NULL){
+        return;
+    }
+
+    int64_t now = time(NULL);
+    char ipString[INET_ADDRSTRLEN];
+    unsigned int failedAttempts;
+    long long lastFailedAttempt;
+    long long blacklistedUntil;
+    while(fscanf(snapshot, "%15s %u %lld %lld", ipString, &failedAttempts, &lastFailedAttempt, &blacklistedUntil) == 4){
+        uint32_t ip;
+        if(!parseIP(ipString, ip)){
+            continue;
+        }
+
+        LoginTableEntry restored = {ip, failedAttempts, lastFailedAttempt, blacklistedUntil};
+        if(isExpired(restored, now)){
+            continue;
+        }
+
+        uint32_t start;
+        LoginTableStripe &stripe = stripeOf(ip, start);
+        lockStripe(stripe);
+        *findEntry(stripe, start, ip, true, now) = restored;
+        unlockStripe(stripe);
+    }
+
+    fclose(snapshot);
+}
+
+static bool parseIP(const std::string &clientIP, uint32_t &ip){
+    return inet_pton(AF_INET, clientIP.c_str(), &ip) == 1 && ip != 0;
+}
+
+static LoginTableStripe &stripeOf(uint32_t ip, uint32_t &start){
+
+    //all bits are mixed (finalizer of MurmurHash3), addresses of one network only differ in their last bytes
+    uint32_t hash = ip;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+
+    //the high bits select the stripe and the low bits the first entry
+    start = hash % LOGIN_TABLE_STRIPE_SIZE;
+    return loginTable[(hash >> 16) % LOGIN_TABLE_STRIPES];
+}
+
+static void lockStripe(LoginTableStripe &stripe){
+
+    //critical sections are a few dozen instructions without system calls, so spinning is cheaper than sleeping
+    while(stripe.locked.exchange(true, std::memory_order_acquire)){
+        while(stripe.locked.load(std::memory_order_relaxed)){
+            sched_yield();
+        }
+    }
+}
+
+static void unlockStripe(LoginTableStripe &stripe){
+    stripe.locked.store(false, std::memory_order_release);
+}
+
+static LoginTableEntry *findEntry(LoginTableStripe &stripe, uint32_t start, uint32_t ip, bool create, int64_t now){
+
+    //a new ip takes the probed entry that is least worth keeping: unused or expired, else not blacklisted, else the oldest one
+    LoginTableEntry *replaceable = NULL;
+    for(int i = 0; i < LOGIN_TABLE_PROBES; i++){
+        LoginTableEntry &entry = stripe.entries[(start + i) % LOGIN_TABLE_STRIPE_SIZE];
+        if(entry.ip == ip){
+            return &entry;
+        }
+
+        if(replaceable == NULL || retention(entry, now) < retention(*replaceable, now)
+            || (retention(entry, now) == retention(*replaceable, now) && entry.lastFailedAttempt < replaceable->lastFailedAttempt)){
+            replaceable = &entry;
+        }
+    }
+
+    if(!create){
+        return NULL;
+    }
+
+    replaceable->ip = ip;
+    replaceable->failedAttempts = 0;
+    replaceable->lastFailedAttempt = 0;
+    replaceable->blacklistedUntil = 0;
+    return replaceable;
+}
+
+static bool isExpired(const LoginTableEntry &entry, int64_t now){
+    return entry.blacklistedUntil <= now && entry.lastFailedAttempt + loginPolicy.failedAttemptTime <= now;
+}
+
+static int retention(const LoginTableEntry &entry, int64_t now){
+    if(entry.ip == 0 || isExpired(entry, now)){
+        return 0;
+    }
+    return entry.blacklistedUntil > now ? 2 : 1;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+
+//failed login attempts and blacklisted ips are kept in a fixed-size hash table in shared memory
+//the table is created before the server forks, so every client process and worker thread sees the same counters
+//it is split into stripes with their own spinlock, an update only touches one stripe and never does any file i/o
+#define LOGIN_TABLE_STRIPES 64
+#define LOGIN_TABLE_STRIPE_SIZE 256 //entries per stripe, an ip is kept in one of the entries of its stripe
+#define LOGIN_TABLE_SNAPSHOT_FILE "loginTable" //in the data directory, see saveLoginTable()
+
+struct LoginPolicy {
+    int maxFailedAttempts; //more failed attempts blacklist the ip
+    int failedAttemptTime; //seconds after the last failed attempt until the counter is forgotten
+    int blacklistTime; //seconds an ip stays blacklisted
+};
+
+void initLoginTable(const LoginPolicy &policy); //has to be called before the server forks
+int blacklistTimeLeft(const std::string &clientIP); //seconds the ip is still blacklisted, 0 if it is not
+bool recordFailedLogin(const std::string &clientIP); //counts a failed attempt, true if the ip was blacklisted because of it
+
+//snapshot of the table as text, one line per ip: <ip> <failed attempts> <time of last failed attempt> <blacklisted until>
+bool saveLoginTable(const std::string &path); //replaces the file atomically
+void loadLoginTable(const std::string &path); //restores entries that did not expire yet, a missing file is ok
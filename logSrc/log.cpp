@@ -0,0 +1,240 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include "log.h"
+
+int logLevel = LOG_LEVEL_INFO;
+
+struct LogRecord {
+    long long time; //microseconds since epoch
+    int level;
+    char text[LOG_RECORD_SIZE];
+};
+
+//single producer (the thread it belongs to), single consumer (whoever holds drainMutex)
+struct LogRing {
+    std::atomic<uint32_t> head{0}; //next record the thread writes, only it changes head
+    std::atomic<uint32_t> tail{0}; //next record that is read, only the consumer changes tail
+    std::atomic<uint64_t> dropped{0}; //records lost since the last drain (ring full or rate limit)
+    pid_t process;
+    pid_t thread;
+
+    //rate limit, only used by the thread itself
+    long long windowStart = 0; //second of CLOCK_MONOTONIC_COARSE
+    int windowRecords = 0;
+
+    LogRecord records[LOG_RING_SIZE];
+};
+
+static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0, "LOG_RING_SIZE has to be a power of two");
+
+static const char *levelNames[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+static int rateLimit = LOG_DEFAULT_RATE_LIMIT;
+
+//never freed: threads can still log while exit() runs the destructors of static objects
+static std::mutex *ringsMutex = new std::mutex(); //guards rings, only taken when a thread logs for the first time
+static std::vector<LogRing *> *rings = new std::vector<LogRing *>();
+static std::mutex *drainMutex = new std::mutex(); //one consumer at a time: writer thread or flushLogger()
+static thread_local LogRing *threadRing = NULL;
+
+static LogRing *registerThread();
+static void writerLoop();
+static void drainRings();
+static void formatRecord(std::string &output, const LogRing &ring, const LogRecord &record);
+static void formatPrefix(std::string &output, const LogRing &ring, long long time, int level);
+static void writeOutput(std::string &output);
+
+//fork() only copies the calling thread, both locks are taken around it so the child never gets them in a locked state
+static void prepareFork();
+static void afterFork();
+
+void initLogger(int level, int limit){
+
+    logLevel = level;
+    rateLimit = limit;
+
+    pthread_atfork(prepareFork, afterFork, afterFork);
+    atexit(flushLogger);
+
+    std::thread(writerLoop).detach();
+}
+
+void restartLoggerAfterFork(){
+
+    //rings of the parent were copied with their records, the parent writes those, the child starts empty
+    rings = new std::vector<LogRing *>();
+    threadRing = NULL;
+
+    std::thread(writerLoop).detach();
+}
+
+void flushLogger(){
+    drainRings();
+}
+
+int parseLogLevel(const char *name){
+    for(int level = LOG_LEVEL_ERROR; level <= LOG_LEVEL_DEBUG; level++){
+        if(strcasecmp(name, levelNames[level]) == 0){
+            return level;
+        }
+    }
+    return -1;
+}
+
+void logWrite(int level, const char *format, ...){
+
+    LogRing *ring = threadRing != NULL ? threadRing : registerThread();
+
+    if(rateLimit > 0){
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        if(now.tv_sec != ring->windowStart){
+            ring->windowStart = now.tv_sec;
+            ring->windowRecords = 0;
+        }
+        if(++ring->windowRecords > rateLimit){
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    if(head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_SIZE){
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    LogRecord &record = ring->records[head & (LOG_RING_SIZE - 1)];
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.time = (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    record.level = level;
+
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(record.text, LOG_RECORD_SIZE, format, arguments);
+    va_end(arguments);
+
+    //the record is complete before the consumer can see it
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+static LogRing *registerThread(){
+
+    LogRing *ring = new LogRing();
+    ring->process = getpid();
+    ring->thread = gettid();
+
+    std::lock_guard<std::mutex> guard(*ringsMutex);
+    rings->push_back(ring);
+    threadRing = ring;
+
+    return ring;
+}
+
+static void writerLoop(){
+    while(1){
+        std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_INTERVAL));
+        drainRings();
+    }
+}
+
+static void drainRings(){
+
+    std::lock_guard<std::mutex> drainGuard(*drainMutex);
+
+    std::vector<LogRing *> currentRings;
+    {
+        std::lock_guard<std::mutex> guard(*ringsMutex);
+        currentRings = *rings;
+    }
+
+    std::string output;
+    for(LogRing *ring : currentRings){
+
+        uint32_t head = ring->head.load(std::memory_order_acquire);
+        uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+        for(; tail != head; tail++){
+            formatRecord(output, *ring, ring->records[tail & (LOG_RING_SIZE - 1)]);
+        }
+        //the thread may reuse the slots as soon as tail moves on, they were copied into output already
+        ring->tail.store(tail, std::memory_order_release);
+
+        uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+        if(dropped > 0){
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            formatPrefix(output, *ring, (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000, LOG_LEVEL_WARN);
+            output += std::to_string(dropped) + " log records dropped (ring full or rate limit)\n";
+        }
+
+        if(output.length() > 64 * 1024){
+            writeOutput(output);
+        }
+    }
+
+    writeOutput(output);
+}
+
+static void formatRecord(std::string &output, const LogRing &ring, const LogRecord &record){
+    formatPrefix(output, ring, record.time, record.level);
+    output.append(record.text, strnlen(record.text, LOG_RECORD_SIZE));
+    output += '\n';
+}
+
+static void formatPrefix(std::string &output, const LogRing &ring, long long time, int level){
+
+    //2026-10-17T12:00:00.123456Z INFO  [process:thread] message
+    time_t seconds = time / 1000000;
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+
+    char prefix[96];
+    size_t length = strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(&prefix[length], sizeof(prefix) - length, ".%06dZ %-5s [%d:%d] ", (int)(time % 1000000),
+        levelNames[level], (int)ring.process, (int)ring.thread);
+
+    output += prefix;
+}
+
+static void writeOutput(std::string &output){
+
+    size_t index = 0;
+    while(index < output.length()){
+        ssize_t bytesWritten = write(STDOUT_FILENO, &output[index], output.length() - index);
+        if(bytesWritten == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            break; //nowhere left to report it
+        }
+        index += bytesWritten;
+    }
+
+    output.clear();
+}
+
+static void prepareFork(){
+    drainMutex->lock();
+    ringsMutex->lock();
+}
+
+static void afterFork(){
+    ringsMutex->unlock();
+    drainMutex->unlock();
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <errno.h>
+#include <string.h>
+
+//log records are not written by the thread that logs them: every thread has its own ring buffer that only it writes
+//to and only the writer thread reads from (lock-free, no system call), the writer thread drains all rings every
+//LOG_FLUSH_INTERVAL ms and writes the records to stdout in one write() per batch
+//if a ring is full or a thread logs more than its rate limit, records are dropped and the writer reports how many
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2 //default
+#define LOG_LEVEL_DEBUG 3
+
+#define LOG_RING_SIZE 512 //records per thread, power of two
+#define LOG_RECORD_SIZE 240 //max. length of a message, longer ones are cut
+#define LOG_FLUSH_INTERVAL 10 //milliseconds
+#define LOG_DEFAULT_RATE_LIMIT 1000 //records per second and thread
+
+extern int logLevel; //records above this level are skipped before their arguments are evaluated
+
+//starts the writer thread, flushes at exit(), level is one of LOG_LEVEL_*, rateLimit 0 = unlimited
+void initLogger(int level, int rateLimit);
+void restartLoggerAfterFork(); //has to be called in a forked child, threads (and the writer) do not survive fork()
+void flushLogger(); //writes everything that was logged so far, blocks until it is written
+int parseLogLevel(const char *name); //"error", "warn", "info" or "debug", -1 if unknown
+
+void logWrite(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+//formatting only happens if the level is enabled
+#define logError(...) do{ if(logLevel >= LOG_LEVEL_ERROR) logWrite(LOG_LEVEL_ERROR, __VA_ARGS__); }while(0)
+#define logWarn(...) do{ if(logLevel >= LOG_LEVEL_WARN) logWrite(LOG_LEVEL_WARN, __VA_ARGS__); }while(0)
+#define logInfo(...) do{ if(logLevel >= LOG_LEVEL_INFO) logWrite(LOG_LEVEL_INFO, __VA_ARGS__); }while(0)
+#define logDebug(...) do{ if(logLevel >= LOG_LEVEL_DEBUG) logWrite(LOG_LEVEL_DEBUG, __VA_ARGS__); }while(0)
+
+//replacement for perror()
+#define logErrno(message) logError("%s: %s", message, strerror(errno))
@@ -0,0 +1,331 @@
+#include <sys/mman.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <string>
+#include <atomic>
+#include <algorithm>
+#include "metrics.h"
+#include "../protocolSrc/parser.h"
+#include "../logSrc/log.h"
+
+struct MetricsHistogram {
+    std::atomic<uint64_t> counts[METRICS_BUCKETS];
+    std::atomic<uint64_t> sum; //microseconds
+};
+
+//one shard per core (modulo METRICS_SHARDS), aligned so two shards never share a cache line
+struct alignas(64) MetricsShard {
+    std::atomic<uint64_t> requests[METRICS_COMMANDS];
+    std::atomic<uint64_t> failedRequests[METRICS_COMMANDS];
+    std::atomic<uint64_t> bytesReceived;
+    std::atomic<uint64_t> bytesSent;
+    std::atomic<uint64_t> connections;
+    std::atomic<uint64_t> closedConnections;
+    MetricsHistogram commandLatency[METRICS_COMMANDS];
+    MetricsHistogram phaseLatency[METRICS_PHASES];
+};
+
+struct Metrics {
+    MetricsShard shards[METRICS_SHARDS];
+    int workerThreads;
+    long long startTime; //metricsClock() when the server started
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "counters in shared memory have to be lock-free");
+
+static Metrics *metrics = NULL; //shared mapping, NULL if metrics are off
+
+//QUIT closes the connection without a response and is not counted
+static const char *commandNames[METRICS_COMMANDS] = {NULL, "send", "list", "read", "del", NULL, "unknown", "login", "stats", "search"};
+static const char *phaseNames[METRICS_PHASES] = {"parse", "lock_wait", "storage", "send"};
+
+//bucket bounds of the exported histograms in microseconds, the fine buckets are counted by their upper end
+static const long long exportBuckets[] = {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+
+static MetricsShard &currentShard();
+static void record(MetricsHistogram &histogram, long long microseconds);
+static size_t bucketOf(uint64_t value);
+static uint64_t highestValueOf(size_t bucket);
+
+//sum of a histogram over all shards
+struct HistogramSnapshot {
+    uint64_t counts[METRICS_BUCKETS] = {};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+
+    void add(const MetricsHistogram &histogram);
+    uint64_t percentile(double percent) const;
+};
+
+static void formatHistogram(std::string &text, const char *name, const char *label, const char *value, const HistogramSnapshot &histogram);
+static void formatQuantiles(std::string &text, const char *name, const char *label, const char *value, const HistogramSnapshot &histogram);
+static void appendLine(std::string &text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+void initMetrics(int workerThreads){
+
+    //anonymous shared mapping, inherited by every process forked afterwards
+    void *mapping = mmap(NULL, sizeof(Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mapping == MAP_FAILED){
+        logErrno("mmap metrics");
+        return; //the server works without metrics
+    }
+
+    metrics = (Metrics *)mapping; //zero-filled: all counters are 0
+    metrics->workerThreads = workerThreads;
+    metrics->startTime = metricsClock();
+}
+
+long long metricsClock(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (long long)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+void countRequest(int command, bool failed, long long microseconds){
+
+    if(metrics == NULL){
+        return;
+    }
+
+    if(command < 1 || command >= METRICS_COMMANDS){
+        command = ERROR;
+    }
+
+    MetricsShard &shard = currentShard();
+    shard.requests[command].fetch_add(1, std::memory_order_relaxed);
+    if(failed){
+        shard.failedRequests[command].fetch_add(1, std::memory_order_relaxed);
+    }
+    record(shard.commandLatency[command], microseconds);
+}
+
+void countPhase(int phase, long long microseconds){
+    if(metrics != NULL){
+        record(currentShard().phaseLatency[phase], microseconds);
+    }
+}
+
+void countBytesReceived(size_t bytes){
+    if(metrics != NULL){
+        currentShard().bytesReceived.fetch_add(bytes, std::memory_order_relaxed);
+    }
+}
+
+void countBytesSent(size_t bytes){
+    if(metrics != NULL){
+        currentShard().bytesSent.fetch_add(bytes, std::memory_order_relaxed);
+    }
+}
+
+//open connections are the difference of both counters, so each one stays a plain counter of its shard
+void countConnectionOpened(){
+    if(metrics != NULL){
+        currentShard().connections.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void countConnectionClosed(){
+    if(metrics != NULL){
+        currentShard().closedConnections.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+std::string formatMetrics(bool forkMode){
+
+    std::string text;
+    if(metrics == NULL){
+        return text;
+    }
+
+    //counters are read one by one while others keep counting, so the sums are not one consistent snapshot,
+    //every single value is correct though
+    uint64_t requests[METRICS_COMMANDS] = {};
+    uint64_t failedRequests[METRICS_COMMANDS] = {};
+    uint64_t bytesReceived = 0;
+    uint64_t bytesSent = 0;
+    uint64_t connections = 0;
+    uint64_t closedConnections = 0;
+    HistogramSnapshot commandLatency[METRICS_COMMANDS];
+    HistogramSnapshot phaseLatency[METRICS_PHASES];
+
+    for(auto const &shard : metrics->shards){
+        for(int command = 1; command < METRICS_COMMANDS; command++){
+            requests[command] += shard.requests[command].load(std::memory_order_relaxed);
+            failedRequests[command] += shard.failedRequests[command].load(std::memory_order_relaxed);
+            commandLatency[command].add(shard.commandLatency[command]);
+        }
+        for(int phase = 0; phase < METRICS_PHASES; phase++){
+            phaseLatency[phase].add(shard.phaseLatency[phase]);
+        }
+        bytesReceived += shard.bytesReceived.load(std::memory_order_relaxed);
+        bytesSent += shard.bytesSent.load(std::memory_order_relaxed);
+        connections += shard.connections.load(std::memory_order_relaxed);
+        closedConnections += shard.closedConnections.load(std::memory_order_relaxed);
+    }
+    long long activeConnections = (long long)connections - (long long)closedConnections;
+    if(activeConnections < 0){
+        activeConnections = 0;
+    }
+
+    appendLine(text, "# HELP twmailer_requests_total Requests handled, by command.\n# TYPE twmailer_requests_total counter\n");
+    for(int command = 1; command < METRICS_COMMANDS; command++){
+        if(commandNames[command] == NULL){
+            continue;
+        }
+        appendLine(text, "twmailer_requests_total{command=\"%s\"} %lu\n", commandNames[command], requests[command]);
+    }
+
+    appendLine(text, "# HELP twmailer_request_errors_total Requests answered with ERR, by command.\n# TYPE twmailer_request_errors_total counter\n");
+    for(int command = 1; command < METRICS_COMMANDS; command++){
+        if(commandNames[command] == NULL){
+            continue;
+        }
+        appendLine(text, "twmailer_request_errors_total{command=\"%s\"} %lu\n", commandNames[command], failedRequests[command]);
+    }
+
+    appendLine(text, "# HELP twmailer_received_bytes_total Bytes received from clients.\n# TYPE twmailer_received_bytes_total counter\ntwmailer_received_bytes_total %lu\n", bytesReceived);
+    appendLine(text, "# HELP twmailer_sent_bytes_total Bytes sent to clients.\n# TYPE twmailer_sent_bytes_total counter\ntwmailer_sent_bytes_total %lu\n", bytesSent);
+    appendLine(text, "# HELP twmailer_connections_total Accepted connections.\n# TYPE twmailer_connections_total counter\ntwmailer_connections_total %lu\n", connections);
+    appendLine(text, "# HELP twmailer_active_connections Open connections.\n# TYPE twmailer_active_connections gauge\ntwmailer_active_connections %lld\n", activeConnections);
+
+    //fork mode has a child process per connection, epoll mode a fixed number of worker threads in one process
+    appendLine(text, "# HELP twmailer_processes Server processes.\n# TYPE twmailer_processes gauge\ntwmailer_processes %lld\n", forkMode ? activeConnections + 1 : 1);
+    appendLine(text, "# HELP twmailer_worker_threads Event loop threads (epoll mode).\n# TYPE twmailer_worker_threads gauge\ntwmailer_worker_threads %d\n", forkMode ? 0 : metrics->workerThreads);
+    appendLine(text, "# HELP twmailer_uptime_seconds Seconds since the server started.\n# TYPE twmailer_uptime_seconds gauge\ntwmailer_uptime_seconds %lld\n", (metricsClock() - metrics->startTime) / 1000000);
+
+    appendLine(text, "# HELP twmailer_request_duration_seconds Time from a complete request to its response, by command.\n# TYPE twmailer_request_duration_seconds histogram\n");
+    for(int command = 1; command < METRICS_COMMANDS; command++){
+        if(commandNames[command] == NULL){
+            continue;
+        }
+        formatHistogram(text, "twmailer_request_duration_seconds", "command", commandNames[command], commandLatency[command]);
+    }
+    appendLine(text, "# HELP twmailer_request_duration_quantile_seconds Percentiles of twmailer_request_duration_seconds.\n# TYPE twmailer_request_duration_quantile_seconds gauge\n");
+    for(int command = 1; command < METRICS_COMMANDS; command++){
+        if(commandNames[command] == NULL){
+            continue;
+        }
+        formatQuantiles(text, "twmailer_request_duration_quantile_seconds", "command", commandNames[command], commandLatency[command]);
+    }
+
+    appendLine(text, "# HELP twmailer_phase_duration_seconds Time spent in one phase of handling requests.\n# TYPE twmailer_phase_duration_seconds histogram\n");
+    for(int phase = 0; phase < METRICS_PHASES; phase++){
+        formatHistogram(text, "twmailer_phase_duration_seconds", "phase", phaseNames[phase], phaseLatency[phase]);
+    }
+    appendLine(text, "# HELP twmailer_phase_duration_quantile_seconds Percentiles of twmailer_phase_duration_seconds.\n# TYPE twmailer_phase_duration_quantile_seconds gauge\n");
+    for(int phase = 0; phase < METRICS_PHASES; phase++){
+        formatQuantiles(text, "twmailer_phase_duration_quantile_seconds", "phase", phaseNames[phase], phaseLatency[phase]);
+    }
+
+    return text;
+}
+
+static MetricsShard &currentShard(){
+
+    //sched_getcpu() is a vDSO call, a thread that moved to another core meanwhile only costs a shared cache line
+    int cpu = sched_getcpu();
+    if(cpu < 0){
+        cpu = 0;
+    }
+    return metrics->shards[cpu % METRICS_SHARDS];
+}
+
+static void record(MetricsHistogram &histogram, long long microseconds){
+
+    if(microseconds < 0){
+        microseconds = 0;
+    }
+
+    histogram.counts[bucketOf(microseconds)].fetch_add(1, std::memory_order_relaxed);
+    histogram.sum.fetch_add(microseconds, std::memory_order_relaxed);
+}
+
+static size_t bucketOf(uint64_t value){
+
+    if(value < METRICS_SUB_BUCKETS){
+        return value;
+    }
+
+    //shift so that value >> shift is in [16, 32), the shift selects the power of two and the rest the bucket in it
+    int shift = std::max(63 - __builtin_clzll(value) - 4, 0);
+    size_t bucket = METRICS_SUB_BUCKETS * shift + (value >> shift);
+    return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+static uint64_t highestValueOf(size_t bucket){
+
+    if(bucket < 2 * METRICS_SUB_BUCKETS){
+        return bucket;
+    }
+
+    int shift = (int)(bucket / METRICS_SUB_BUCKETS) - 1;
+    uint64_t subBucket = bucket % METRICS_SUB_BUCKETS + METRICS_SUB_BUCKETS;
+    return ((subBucket + 1) << shift) - 1;
+}
+
+void HistogramSnapshot::add(const MetricsHistogram &histogram){
+    for(size_t bucket = 0; bucket < METRICS_BUCKETS; bucket++){
+        uint64_t count = histogram.counts[bucket].load(std::memory_order_relaxed);
+        counts[bucket] += count;
+        total += count;
+    }
+    sum += histogram.sum.load(std::memory_order_relaxed);
+}
+
+uint64_t HistogramSnapshot::percentile(double percent) const{
+
+    if(total == 0){
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percent / 100.0 * total + 0.5);
+    if(rank < 1){
+        rank = 1;
+    }
+
+    uint64_t cumulative = 0;
+    for(size_t bucket = 0; bucket < METRICS_BUCKETS; bucket++){
+        cumulative += counts[bucket];
+        if(cumulative >= rank){
+            return highestValueOf(bucket);
+        }
+    }
+    return highestValueOf(METRICS_BUCKETS - 1);
+}
+
+static void formatHistogram(std::string &text, const char *name, const char *label, const char *value, const HistogramSnapshot &histogram){
+
+    uint64_t cumulative = 0;
+    size_t bucket = 0;
+    for(long long bound : exportBuckets){
+        while(bucket < METRICS_BUCKETS && highestValueOf(bucket) <= (uint64_t)bound){
+            cumulative += histogram.counts[bucket++];
+        }
+        appendLine(text, "%s_bucket{%s=\"%s\",le=\"%g\"} %lu\n", name, label, value, bound / 1e6, cumulative);
+    }
+    appendLine(text, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n", name, label, value, histogram.total);
+    appendLine(text, "%s_sum{%s=\"%s\"} %g\n", name, label, value, histogram.sum / 1e6);
+    appendLine(text, "%s_count{%s=\"%s\"} %lu\n", name, label, value, histogram.total);
+}
+
+static void formatQuantiles(std::string &text, const char *name, const char *label, const char *value, const HistogramSnapshot &histogram){
+    appendLine(text, "%s{%s=\"%s\",quantile=\"0.5\"} %g\n", name, label, value, histogram.percentile(50) / 1e6);
+    appendLine(text, "%s{%s=\"%s\",quantile=\"0.99\"} %g\n", name, label, value, histogram.percentile(99) / 1e6);
+    appendLine(text, "%s{%s=\"%s\",quantile=\"0.999\"} %g\n", name, label, value, histogram.percentile(99.9) / 1e6);
+}
+
+static void appendLine(std::string &text, const char *format, ...){
+
+    char line[512];
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+
+    if(length > 0){
+        text.append(line, std::min((size_t)length, sizeof(line) - 1));
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+//counters and latency histograms of the server, kept in shared memory so that the child processes of fork mode and
+//the workers of epoll mode all count into the same place; every process or thread adds to the shard of the core it
+//runs on with relaxed atomics, so counting never takes a lock and hardly ever shares a cache line with another core
+//the shards are only summed up when the metrics are read (STATS command, only from local clients)
+#define METRICS_SHARDS 16
+
+//histograms are log-linear like HDR histograms: every power of two of microseconds is split into
+//METRICS_SUB_BUCKETS buckets, so a recorded latency is off by less than 1/16, from 1 us up to about 2^36 us (19 hours)
+#define METRICS_SUB_BUCKETS 16
+#define METRICS_BUCKETS (METRICS_SUB_BUCKETS * 33)
+
+//commands are counted by their number from protocolSrc/parser.h, unknown commands as ERROR
+#define METRICS_COMMANDS 10
+
+//parts of handling a request that are timed on their own, over all commands
+#define METRICS_PHASE_PARSE 0 //receiving and framing a request until it is complete, see receiveData()
+#define METRICS_PHASE_LOCK_WAIT 1 //waiting for a mailbox (or other) lock, see lock()
+#define METRICS_PHASE_STORAGE 2 //calls into the storage backend (file system), including its lock waits
+#define METRICS_PHASE_SEND 3 //writing a response to the socket
+#define METRICS_PHASES 4
+
+void initMetrics(int workerThreads); //has to be called before the server forks or starts workers, without it nothing is counted
+
+long long metricsClock(); //microseconds of CLOCK_MONOTONIC, durations below are differences of it
+
+void countRequest(int command, bool failed, long long microseconds); //one handled request, failed if it was answered with ERR
+void countPhase(int phase, long long microseconds); //time spent in one phase of handling a request
+void countBytesReceived(size_t bytes);
+void countBytesSent(size_t bytes);
+void countConnectionOpened();
+void countConnectionClosed();
+
+//all metrics in the Prometheus text format: counters, gauges, and per histogram cumulative buckets from 50 us to 10 s
+//plus the 50th, 99th and 99.9th percentile as a separate gauge
+std::string formatMetrics(bool forkMode);
@@ -0,0 +1,17 @@
+#pragma once
+
+//every message is sent as one or more frames: 4 byte length (network byte order), followed by that many bytes
+//if FRAME_MORE_CHUNKS is set in the length, the message continues in the next frame (chunked message),
+//so large messages can be sent and received in fixed-size pieces; the last frame of a message never has it set
+//if FRAME_TAGGED is set, a 4 byte request-id (network byte order) follows the length, the response to a tagged
+//request is tagged with the same id; clients can then send many requests without waiting for each response
+//(pipelining), the server still answers them in order. the id of the first tagged frame of a message counts
+
+#define FRAME_MORE_CHUNKS 0x80000000u
+#define FRAME_TAGGED 0x40000000u
+#define FRAME_LENGTH_MASK 0x3fffffffu //max. length of one frame and of a whole message
+
+#define FRAME_HEADER_SIZE 4
+#define FRAME_TAGGED_HEADER_SIZE 8
+
+#define FRAME_CHUNK_SIZE (64 * 1024) //size of the chunks the client splits large messages into
@@ -0,0 +1,175 @@
+#include <string_view>
+#include <vector>
+#include "parser.h"
+
+//command names are looked up in a table that is built at compile time
+struct CommandName {
+    std::string_view name;
+    int command;
+};
+
+static constexpr CommandName commandTable[] = {
+    {"SEND", SEND},
+    {"LIST", LIST},
+    {"READ", READ},
+    {"DEL", DEL},
+    {"QUIT", QUIT},
+    {"LOGIN", LOGIN},
+    {"STATS", STATS},
+    {"SEARCH", SEARCH},
+};
+
+static constexpr int lookupCommand(std::string_view name){
+    for(auto const &entry : commandTable){
+        if(entry.name == name){
+            return entry.command;
+        }
+    }
+    return ERROR;
+}
+
+static_assert(lookupCommand("LOGIN") == LOGIN && lookupCommand("LIST ") == ERROR, "command table is broken");
+
+int parseCommand(std::string_view name){
+    return lookupCommand(name);
+}
+
+bool RequestReader::nextLine(std::string_view &line){
+
+    if(rest.empty()){
+        line = std::string_view();
+        return false;
+    }
+
+    size_t end = rest.find('\n');
+    if(end == std::string_view::npos){
+        line = rest;
+        rest = std::string_view();
+        return true;
+    }
+
+    line = rest.substr(0, end);
+    rest.remove_prefix(end + 1);
+    return true;
+}
+
+bool isValidUsername(std::string_view username){
+
+    if(username.empty() || username.length() > 8){
+        return false;
+    }
+
+    for(char c : username){
+        if((c < 'a' || c > 'z') && (c < '0' || c > '9')){
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool isValidSubject(std::string_view subject){
+
+    if(subject.length() > 80){
+        return false;
+    }
+
+    //same as the former regex ".{0,80}": '.' matches anything but line breaks
+    for(char c : subject){
+        if(c == '\n' || c == '\r'){
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool parseMessageId(std::string_view text, int &id){
+
+    if(text.empty() || text.length() > 9){ //max. 9 digits, so the id always fits into an int
+        return false;
+    }
+
+    id = 0;
+    for(char c : text){
+        if(c < '0' || c > '9'){
+            return false;
+        }
+        id = id * 10 + (c - '0');
+    }
+
+    return true;
+}
+
+bool isIdList(std::string_view text){
+    return text.find_first_of(",-") != std::string_view::npos;
+}
+
+bool parseMessageIdList(std::string_view text, std::vector<int> &ids){
+
+    std::vector<std::string_view> items;
+    if(!splitList(text, items)){
+        return false;
+    }
+
+    ids.clear();
+    for(auto item : items){
+        size_t dash = item.find('-');
+        int first, last;
+        if(dash == std::string_view::npos){
+            if(!parseMessageId(item, first)){
+                return false;
+            }
+            last = first;
+        } else if(!parseMessageId(item.substr(0, dash), first) || !parseMessageId(item.substr(dash + 1), last) || first > last){
+            return false;
+        }
+
+        if(ids.size() + (last - first) >= BATCH_MAX_ITEMS){
+            return false;
+        }
+        for(int id = first; id <= last; id++){
+            ids.push_back(id);
+        }
+    }
+
+    return true;
+}
+
+bool splitList(std::string_view text, std::vector<std::string_view> &items){
+
+    items.clear();
+
+    while(1){
+        if(items.size() == BATCH_MAX_ITEMS){
+            return false;
+        }
+
+        size_t comma = text.find(',');
+        items.push_back(text.substr(0, comma));
+        if(comma == std::string_view::npos){
+            return true;
+        }
+        text.remove_prefix(comma + 1);
+    }
+}
+
+bool parseListRange(std::string_view text, ListRange &range){
+
+    range = ListRange();
+    if(text.empty()){
+        return true;
+    }
+
+    if(text.substr(0, 6) == "SINCE "){
+        range.since = true;
+        text.remove_prefix(6);
+    }
+
+    size_t comma = text.find(',');
+    if(!parseMessageId(text.substr(0, comma), range.start)){
+        return false;
+    }
+
+    return comma == std::string_view::npos || parseMessageId(text.substr(comma + 1), range.limit);
+}
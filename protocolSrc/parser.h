@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+//requests are parsed in place: nothing is copied out of the receive buffer and no memory is allocated,
+//all views returned here point into the request and are only valid as long as it is
+
+//--- Commands ---
+
+#define SEND 1
+#define LIST 2
+#define READ 3
+#define DEL 4
+#define QUIT 5
+#define ERROR 6
+#define LOGIN 7
+#define STATS 8
+#define SEARCH 9
+
+int parseCommand(std::string_view name); //command of the first line of a request, ERROR if unknown
+
+//--- Lines ---
+
+//reads a request line by line, like std::getline() on an istringstream of the request
+struct RequestReader {
+    std::string_view rest; //part of the request that was not read yet
+
+    bool nextLine(std::string_view &line); //next line without '\n', false (and empty line) if nothing is left
+};
+
+//--- Validation ---
+
+bool isValidUsername(std::string_view username); //1 to 8 chars, only a-z and 0-9
+bool isValidSubject(std::string_view subject); //max. 80 chars, no line breaks
+bool parseMessageId(std::string_view text, int &id); //1 to 9 digits, nothing else
+
+//--- Batches ---
+
+#define BATCH_MAX_ITEMS 100 //max. number of message-ids or receivers in one request
+
+bool isIdList(std::string_view text); //true if text is more than one message-id ("1,3,5-9"), READ and DEL then answer per message
+bool parseMessageIdList(std::string_view text, std::vector<int> &ids); //ids in the given order, false on syntax errors or more than BATCH_MAX_ITEMS ids
+bool splitList(std::string_view text, std::vector<std::string_view> &items); //comma-separated items, false if there are more than BATCH_MAX_ITEMS
+
+//--- Paging ---
+
+//LIST takes an optional line that selects a part of the mailbox, entries are always in order of message-id
+//  <offset>[,<limit>]      entries from position <offset> on (starting at 0)
+//  SINCE <id>[,<limit>]    entries with a higher message-id, ids are never reused so the highest id a client has seen is its cursor
+#define LIST_NO_LIMIT -1
+
+struct ListRange {
+    bool since = false; //start is a message-id instead of a position
+    int start = 0;
+    int limit = LIST_NO_LIMIT;
+};
+
+bool parseListRange(std::string_view text, ListRange &range); //an empty line selects the whole mailbox
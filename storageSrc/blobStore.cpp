@@ -0,0 +1,301 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <openssl/evp.h>
+#include "blobStore.h"
+#include "fileBatch.h"
+#include "../logSrc/log.h"
+#include "lock.h"
+
+namespace fs = std::filesystem;
+
+#define HASH_BLOCK_SIZE 65536 //bytes read at once when hashing a file
+
+static std::string blobLock(const std::string &hash){
+    return "blob-" + hash.substr(0, 1);
+}
+
+static bool isBlobName(const std::string &name){
+    if(name.length() != 64){
+        return false;
+    }
+    for(char c : name){
+        if(!isxdigit((unsigned char)c)){
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::string hexDigest(EVP_MD_CTX *context){
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLength = 0;
+    if(EVP_DigestFinal_ex(context, digest, &digestLength) != 1){
+        return "";
+    }
+
+    static const char hexDigits[] = "0123456789abcdef";
+    std::string hash;
+    for(unsigned int i = 0; i < digestLength; i++){
+        hash += hexDigits[digest[i] >> 4];
+        hash += hexDigits[digest[i] & 0xf];
+    }
+    return hash;
+}
+
+std::string hashMessage(std::string_view message){
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    std::string hash;
+    if(context != NULL && EVP_DigestInit_ex(context, EVP_sha256(), NULL) == 1 && EVP_DigestUpdate(context, message.data(), message.length()) == 1){
+        hash = hexDigest(context);
+    }
+    EVP_MD_CTX_free(context);
+    return hash;
+}
+
+std::string hashFile(int file){
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    if(context == NULL || EVP_DigestInit_ex(context, EVP_sha256(), NULL) != 1){
+        EVP_MD_CTX_free(context);
+        return "";
+    }
+
+    char buffer[HASH_BLOCK_SIZE];
+    off_t offset = 0;
+    ssize_t size;
+    while((size = pread(file, buffer, sizeof(buffer), offset)) > 0){
+        EVP_DigestUpdate(context, buffer, size);
+        offset += size;
+    }
+
+    std::string hash = size == 0 ? hexDigest(context) : "";
+    EVP_MD_CTX_free(context);
+    return hash;
+}
+
+BlobStore::BlobStore(const std::string &dataDirectory){
+    blobsDirectory = fs::path(dataDirectory) / BLOB_DIRECTORY;
+    create_directory(blobsDirectory); //ok to use even if directory already exists
+}
+
+bool BlobStore::linkMessage(std::string_view message, std::string &hash, const fs::path &entry){
+
+    hash = hashMessage(message);
+    if(hash.empty()){
+        return false;
+    }
+
+    int lockFile = lock(blobLock(hash), LOCK_EX);
+    if(lockFile == -1){
+        return false;
+    }
+    bool linked = linkBlob(hash, entry, "", message);
+    unlock(lockFile);
+
+    return linked;
+}
+
+bool BlobStore::linkFile(const std::string &path, int file, std::string &hash, const fs::path &entry){
+
+    //a staged message is committed once per receiver, it is only hashed for the first one
+    if(hash.empty()){
+        hash = hashFile(file);
+        if(hash.empty()){
+            return false;
+        }
+    }
+
+    int lockFile = lock(blobLock(hash), LOCK_EX);
+    if(lockFile == -1){
+        return false;
+    }
+    bool linked = linkBlob(hash, entry, path, "");
+    unlock(lockFile);
+
+    return linked;
+}
+
+bool BlobStore::linkBlob(const std::string &hash, const fs::path &entry, const std::string &source, std::string_view message){
+
+    std::string blob = (blobsDirectory / hash).string();
+
+    //same content already stored -> only one more reference
+    if(link(blob.c_str(), entry.string().c_str()) == 0){
+        return true;
+    }
+    if(errno != ENOENT){
+        logErrno("link blob");
+        return false;
+    }
+
+    if(!source.empty()){
+        //staged file has the final content and is on the same filesystem, it becomes the blob
+        if(link(source.c_str(), blob.c_str()) == -1){
+            logErrno("link staged message");
+            return false;
+        }
+    }
+    else{
+        //written under a temporary name, so a blob never exists with partial content
+        std::string temporary = blob + ".tmp";
+        int blobFile = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(blobFile == -1){
+            logErrno("open blob");
+            return false;
+        }
+
+        size_t written = 0;
+        while(written < message.length()){
+            ssize_t size = write(blobFile, message.data() + written, message.length() - written);
+            if(size == -1){
+                if(errno == EINTR){
+                    continue;
+                }
+                break;
+            }
+            written += size;
+        }
+
+        if(close(blobFile) == -1 || written < message.length() || rename(temporary.c_str(), blob.c_str()) == -1){
+            logErrno("write blob");
+            unlink(temporary.c_str());
+            return false;
+        }
+    }
+
+    if(link(blob.c_str(), entry.string().c_str()) == -1){
+        logErrno("link blob");
+        unlink(blob.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool BlobStore::unlinkEntry(const fs::path &entry, const std::string &hash){
+
+    struct stat entryStat;
+    if(stat(entry.string().c_str(), &entryStat) == -1){
+        return false;
+    }
+
+    //more than entry and blob name -> other mailboxes still reference the blob
+    //a single link is a message from before deduplication without a blob
+    if(entryStat.st_nlink != 2){
+        return unlink(entry.string().c_str()) == 0;
+    }
+
+    //a wrong hash only leaves the blob for collectGarbage(), the blob has to be the same file as the entry
+    std::string contentHash = hash;
+    if(contentHash.empty()){
+        int entryFile = ::open(entry.string().c_str(), O_RDONLY | O_CLOEXEC);
+        contentHash = entryFile == -1 ? "" : hashFile(entryFile);
+        if(entryFile != -1){
+            close(entryFile);
+        }
+    }
+    if(contentHash.empty()){
+        return unlink(entry.string().c_str()) == 0;
+    }
+
+    std::string blob = (blobsDirectory / contentHash).string();
+
+    //link count is checked again under the lock, a SEND may have added a reference in the meantime
+    int lockFile = lock(blobLock(contentHash), LOCK_EX);
+    if(lockFile == -1){
+        //the message is deleted anyway, a blob left without references is removed by the next collectGarbage()
+        return unlink(entry.string().c_str()) == 0;
+    }
+
+    bool removed = unlink(entry.string().c_str()) == 0;
+
+    struct stat blobStat;
+    if(removed && stat(blob.c_str(), &blobStat) == 0 && blobStat.st_ino == entryStat.st_ino && blobStat.st_dev == entryStat.st_dev && blobStat.st_nlink == 1){
+        unlink(blob.c_str());
+    }
+
+    unlock(lockFile);
+
+    return removed;
+}
+
+void BlobStore::unlinkEntries(const std::vector<fs::path> &entries, const std::vector<std::string> &hashes){
+
+    std::vector<int> found(entries.size());
+    std::vector<int> unlinked(entries.size());
+    std::vector<struct statx> entryStats(entries.size());
+
+    FileBatch batch;
+    for(size_t i = 0; i < entries.size(); i++){
+        batch.stat(entries[i].string(), entryStats[i], found[i]);
+    }
+    batch.run();
+
+    //entries whose blob stays referenced (or that have none) are only unlinked, all in one batch
+    //the last reference of a blob needs the hash and the blob lock, that goes through unlinkEntry()
+    for(size_t i = 0; i < entries.size(); i++){
+        if(found[i] == 0 && entryStats[i].stx_nlink != 2){
+            batch.unlink(entries[i].string(), unlinked[i]);
+        }
+        else if(found[i] == 0){
+            unlinkEntry(entries[i], hashes[i]);
+        }
+    }
+    batch.run();
+}
+
+void BlobStore::collectGarbage(){
+
+    //the link counts are read without locks, in batches of the ring size; only candidates (no reference left, or a
+    //temporary file) take the stripe lock and are checked again, so SENDs and DELs of other blobs are not held up
+    std::vector<std::string> names;
+    std::error_code error;
+    for(auto const &blob : fs::directory_iterator(blobsDirectory, error)){
+        names.push_back(blob.path().filename().string());
+    }
+
+    std::vector<int> found(FILE_BATCH_RING_SIZE);
+    std::vector<struct statx> blobStats(FILE_BATCH_RING_SIZE);
+    FileBatch batch;
+    for(size_t first = 0; first < names.size(); first += FILE_BATCH_RING_SIZE){
+        size_t count = std::min(names.size() - first, (size_t)FILE_BATCH_RING_SIZE);
+
+        for(size_t i = 0; i < count; i++){
+            if(isBlobName(names[first + i])){
+                batch.stat((blobsDirectory / names[first + i]).string(), blobStats[i], found[i]);
+            }
+        }
+        batch.run();
+
+        for(size_t i = 0; i < count; i++){
+            const std::string &name = names[first + i];
+            if(isBlobName(name) && (found[i] != 0 || blobStats[i].stx_nlink != 1)){
+                continue;
+            }
+
+            std::string blob = (blobsDirectory / name).string();
+            int lockFile = lock(blobLock(name), LOCK_EX);
+            if(lockFile == -1){
+                continue; //checked again by the next run
+            }
+
+            struct stat blobStat;
+            if(!isBlobName(name)){
+                unlink(blob.c_str()); //temporary file of an interrupted SEND
+            }
+            else if(stat(blob.c_str(), &blobStat) == 0 && blobStat.st_nlink == 1){
+                unlink(blob.c_str());
+            }
+
+            unlock(lockFile);
+        }
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+
+//message bodies of the directory backend are stored once under blobs/<sha-256 of the content>
+//mailbox entries are hard links to a blob, so READ opens them like plain files and a message sent to many receivers exists once on disk
+//the link count of a blob is its reference count: a blob whose only link is its own name is not used by any mailbox
+//creating, linking and freeing blobs is locked in 16 stripes (blob-<first hex digit of the name>)
+#define BLOB_DIRECTORY "blobs"
+
+class BlobStore {
+public:
+    BlobStore(const std::string &dataDirectory);
+
+    bool linkMessage(std::string_view message, std::string &hash, const std::filesystem::path &entry); //stores message if it is new and links it to entry, returns its hash
+    bool linkFile(const std::string &path, int file, std::string &hash, const std::filesystem::path &entry); //same for a staged file, hash caches the content hash between calls
+    //hash is the content hash of the entry if it is known (e.g. from the mailbox index), otherwise the file is hashed again
+    bool unlinkEntry(const std::filesystem::path &entry, const std::string &hash = ""); //removes a mailbox entry, frees its blob if this was the last reference
+    void unlinkEntries(const std::vector<std::filesystem::path> &entries, const std::vector<std::string> &hashes); //same for many entries, stats and unlinks them in batches
+    void collectGarbage(); //frees blobs without references, e.g. left behind by a crash or two concurrent DELs, only locks the ones it frees
+
+private:
+    std::filesystem::path blobsDirectory;
+
+    bool linkBlob(const std::string &hash, const std::filesystem::path &entry, const std::string &source, std::string_view message); //blob stripe must be locked
+};
+
+std::string hashMessage(std::string_view message); //hex sha-256 of message, empty on error
+std::string hashFile(int file); //hex sha-256 of a whole file, empty on error
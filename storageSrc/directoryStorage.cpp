@@ -0,0 +1,368 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include "directoryStorage.h"
+#include "mailboxIndex.h"
+#include "searchIndex.h"
+#include "fileBatch.h"
+#include "lock.h"
+#include "../logSrc/log.h"
+
+namespace fs = std::filesystem;
+
+DirectoryStorage::DirectoryStorage(const std::string &dataDirectory) : Storage(dataDirectory), blobs(dataDirectory){
+    messagesDirectory = fs::path(dataDirectory) / "messages";
+    create_directory(messagesDirectory); //ok to use even if directory already exists
+}
+
+int DirectoryStorage::deliver(const std::string &receiver, const std::string &sender, const std::string &subject, std::string_view message){
+
+    fs::path mailbox = messagesDirectory / receiver;
+    std::string terms = messageTerms(message);
+
+    int lockFile = lock(mailboxLock(receiver), LOCK_EX);
+    if(lockFile == -1){
+        return -1;
+    }
+
+    create_directory(mailbox); //ok to use even if directory already exists
+
+    IndexEntry entry;
+    entry.id = nextMessageId(mailbox);
+
+    if(!blobs.linkMessage(message, entry.hash, mailbox / std::to_string(entry.id))){
+        unlock(lockFile);
+        return -1;
+    }
+
+    entry.size = (long)message.length();
+    entry.timestamp = (long)time(NULL);
+    entry.sender = sender;
+    entry.subject = subject;
+    appendIndexRecord(mailbox, entry);
+    appendSearchRecord(mailbox, entry.id, terms);
+
+    unlock(lockFile);
+
+    return entry.id;
+}
+
+int DirectoryStorage::commit(StagedMessage &message, const std::string &receiver){
+
+    fs::path mailbox = messagesDirectory / receiver;
+    if(message.searchTerms.empty()){
+        message.searchTerms = messageFileTerms(message.file, 0, message.length);
+    }
+
+    int lockFile = lock(mailboxLock(receiver), LOCK_EX);
+    if(lockFile == -1){
+        return -1;
+    }
+
+    create_directory(mailbox); //ok to use even if directory already exists
+
+    IndexEntry entry;
+    entry.id = nextMessageId(mailbox);
+
+    //the staged file already has the final content, it becomes the blob or is dropped if the same content is already stored
+    if(!blobs.linkFile(message.path, message.file, message.contentHash, mailbox / std::to_string(entry.id))){
+        unlock(lockFile);
+        return -1;
+    }
+
+    entry.size = (long)message.length;
+    entry.timestamp = (long)time(NULL);
+    entry.sender = message.sender;
+    entry.subject = message.subject;
+    entry.hash = message.contentHash;
+    appendIndexRecord(mailbox, entry);
+    appendSearchRecord(mailbox, entry.id, message.searchTerms);
+
+    unlock(lockFile);
+
+    return entry.id;
+}
+
+bool DirectoryStorage::list(const std::string &username, std::vector<IndexEntry> &entries){
+
+    fs::path mailbox = messagesDirectory / username;
+
+    return loadIndex(mailbox, username, entries, [this, &mailbox](){ rebuildIndex(mailbox); });
+}
+
+void DirectoryStorage::openMessages(const std::string &username, const std::vector<int> &ids, std::vector<MessageFile> &files){
+
+    fs::path mailbox = messagesDirectory / username;
+
+    files.assign(ids.size(), MessageFile());
+    std::vector<int> opened(ids.size());
+    std::vector<int> statted(ids.size());
+    std::vector<struct statx> emailStats(ids.size());
+
+    //all files of the batch are opened and their sizes read with one submission
+    FileBatch batch;
+    for(size_t i = 0; i < ids.size(); i++){
+        std::string path = (mailbox / std::to_string(ids[i])).string();
+        batch.open(path, O_RDONLY | O_CLOEXEC, opened[i]);
+        batch.stat(path, emailStats[i], statted[i]);
+    }
+
+    int lockFile = lock(mailboxLock(username), LOCK_SH);
+    if(lockFile == -1){
+        return; //queued operations are dropped with the batch, no file is opened
+    }
+    batch.run();
+    unlock(lockFile);
+
+    for(size_t i = 0; i < ids.size(); i++){
+        if(opened[i] < 0 || statted[i] < 0){
+            if(opened[i] >= 0){
+                batch.close(opened[i]);
+            }
+            continue;
+        }
+
+        files[i].file = opened[i];
+        files[i].offset = 0;
+        files[i].length = (long)emailStats[i].stx_size;
+    }
+
+    batch.run();
+}
+
+void DirectoryStorage::removeMessages(const std::string &username, const std::vector<int> &ids, std::vector<bool> &removed){
+
+    fs::path mailbox = messagesDirectory / username;
+
+    removed.assign(ids.size(), false);
+    std::vector<int> deleted;
+    std::vector<int> lookups; //large messages that are the last reference of their blob, see INDEX_HASH_LOOKUP_SIZE
+    std::vector<int> found(ids.size());
+    std::vector<struct statx> emailStats(ids.size());
+
+    int lockFile = lock(mailboxLock(username), LOCK_EX);
+    if(lockFile == -1){
+        return;
+    }
+
+    FileBatch batch;
+    for(size_t i = 0; i < ids.size(); i++){
+        batch.stat((mailbox / std::to_string(ids[i])).string(), emailStats[i], found[i]);
+    }
+    batch.run();
+
+    for(size_t i = 0; i < ids.size(); i++){
+        //the same id twice in one batch is only deleted once
+        if(std::find(deleted.begin(), deleted.end(), ids[i]) != deleted.end()){
+            removed[i] = true;
+            continue;
+        }
+        if(found[i] == 0){
+            removed[i] = true;
+            deleted.push_back(ids[i]);
+            if(emailStats[i].stx_nlink == 2 && emailStats[i].stx_size > INDEX_HASH_LOOKUP_SIZE){
+                lookups.push_back(ids[i]);
+            }
+        }
+    }
+
+    //the blob store hashes the other last references itself, and those whose hash the index does not have
+    std::vector<std::string> lookupHashes;
+    if(!lookups.empty()){
+        readIndexHashes(mailbox, lookups, lookupHashes);
+    }
+
+    //index first, like a single DEL: a crash in between leaves files that LIST does not show instead of entries without a file
+    appendIndexDeletions(mailbox, deleted);
+    appendSearchDeletions(mailbox, deleted);
+    std::vector<fs::path> entries;
+    std::vector<std::string> hashes;
+    for(int id : deleted){
+        entries.push_back(mailbox / std::to_string(id));
+        auto lookup = std::find(lookups.begin(), lookups.end(), id);
+        hashes.push_back(lookup != lookups.end() ? lookupHashes[lookup - lookups.begin()] : "");
+    }
+    blobs.unlinkEntries(entries, hashes);
+
+    unlock(lockFile);
+}
+
+bool DirectoryStorage::search(const std::string &username, const std::vector<std::string> &terms, std::vector<int> &ids){
+
+    fs::path mailbox = messagesDirectory / username;
+
+    return searchMailbox(mailbox, username, terms, ids, [&mailbox](const MessageVisitor &visit){
+        for (auto const &email : fs::directory_iterator(mailbox)){
+            std::string filename = email.path().filename().string();
+            if(!isMessageId(filename)){
+                continue;
+            }
+
+            int emailFile = ::open(email.path().string().c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat emailStat;
+            if(emailFile != -1 && fstat(emailFile, &emailStat) == 0){
+                visit(std::stoi(filename), emailFile, 0, emailStat.st_size);
+            }
+            if(emailFile != -1){
+                close(emailFile);
+            }
+        }
+    });
+}
+
+void DirectoryStorage::compact(){
+    blobs.collectGarbage();
+}
+
+int DirectoryStorage::nextMessageId(const fs::path &mailbox){
+
+    int messageId = readSequence(mailbox);
+    if(messageId != -1){
+        messageId++;
+    }
+
+    //counter is missing, unreadable or behind the mailbox (e.g. lost after a crash) -> rebuild it from the directory
+    if(messageId == -1 || fs::exists(mailbox / std::to_string(messageId))){
+        messageId = highestMessageId(mailbox) + 1;
+    }
+
+    writeSequence(mailbox, messageId);
+
+    return messageId;
+}
+
+int DirectoryStorage::highestMessageId(const fs::path &mailbox){
+
+    int highestMessageId = 0;
+    for (auto const &email : fs::directory_iterator(mailbox)){
+        std::string filename = email.path().filename().string();
+        if(isMessageId(filename) && std::stoi(filename) > highestMessageId){
+            highestMessageId = std::stoi(filename);
+        }
+    }
+
+    return highestMessageId;
+}
+
+//index entry of a message file with system calls, used when a batched read of it failed
+static bool readIndexEntry(const fs::path &email, IndexEntry &entry){
+
+    struct stat emailStat;
+    if(stat(email.string().c_str(), &emailStat) != 0){
+        return false;
+    }
+
+    std::ifstream emailFile(email.string());
+    if(!emailFile){
+        return false;
+    }
+
+    entry.size = (long)emailStat.st_size;
+    entry.timestamp = (long)emailStat.st_mtime;
+
+    std::string receiver;
+    getline(emailFile, entry.sender);
+    getline(emailFile, receiver);
+    getline(emailFile, entry.subject);
+
+    return !emailFile.bad();
+}
+
+void DirectoryStorage::rebuildIndex(const fs::path &mailbox){
+
+    std::vector<IndexEntry> entries;
+
+    for (auto const &email : fs::directory_iterator(mailbox)){
+        std::string filename = email.path().filename().string();
+        if(isMessageId(filename)){
+            IndexEntry entry;
+            entry.id = std::stoi(filename);
+            entries.push_back(entry);
+        }
+    }
+
+    //the headers are read in chunks of three submissions each (open and stat, read, close) instead of one file after
+    //another; a chunk is small enough for the ring and keeps only a few files open, so large mailboxes stay below the fd limit
+    std::vector<int> opened(FILE_BATCH_RING_SIZE);
+    std::vector<int> statted(FILE_BATCH_RING_SIZE);
+    std::vector<int> readSizes(FILE_BATCH_RING_SIZE);
+    std::vector<struct statx> emailStats(FILE_BATCH_RING_SIZE);
+    std::vector<char> headers(FILE_BATCH_RING_SIZE * INDEX_REBUILD_READ_SIZE);
+
+    FileBatch batch;
+    for(size_t first = 0; first < entries.size(); first += FILE_BATCH_RING_SIZE){
+        size_t count = std::min(entries.size() - first, (size_t)FILE_BATCH_RING_SIZE);
+
+        for(size_t i = 0; i < count; i++){
+            std::string path = (mailbox / std::to_string(entries[first + i].id)).string();
+            readSizes[i] = -EBADF;
+            batch.open(path, O_RDONLY | O_CLOEXEC, opened[i]);
+            batch.stat(path, emailStats[i], statted[i]);
+        }
+        batch.run();
+
+        for(size_t i = 0; i < count; i++){
+            if(opened[i] >= 0){
+                batch.read(opened[i], &headers[i * INDEX_REBUILD_READ_SIZE], INDEX_REBUILD_READ_SIZE, 0, readSizes[i]);
+            }
+        }
+        batch.run();
+
+        for(size_t i = 0; i < count; i++){
+            if(opened[i] >= 0){
+                batch.close(opened[i]);
+            }
+        }
+        batch.run();
+
+        for(size_t i = 0; i < count; i++){
+            IndexEntry &entry = entries[first + i];
+
+            //"<sender>\n<receivers>\n<subject>\n..."
+            std::string_view header(&headers[i * INDEX_REBUILD_READ_SIZE], readSizes[i] > 0 ? readSizes[i] : 0);
+            std::string_view lines[3];
+            bool complete = true;
+            for(std::string_view &line : lines){
+                size_t end = header.find('\n');
+                complete = end != std::string_view::npos;
+                line = header.substr(0, end);
+                header = complete ? header.substr(end + 1) : std::string_view();
+            }
+
+            //a failed operation or a receiver list longer than the read size -> read the file the slow way,
+            //an entry with empty fields must not end up in the index
+            if(statted[i] != 0 || readSizes[i] < 0 || (!complete && readSizes[i] == INDEX_REBUILD_READ_SIZE)){
+                if(!readIndexEntry(mailbox / std::to_string(entry.id), entry)){
+                    logError("Rebuilding index of %s failed, message %d is unreadable", mailbox.string().c_str(), entry.id);
+                    return;
+                }
+                continue;
+            }
+
+            entry.size = (long)emailStats[i].stx_size;
+            entry.timestamp = (long)emailStats[i].stx_mtime.tv_sec;
+            entry.sender = std::string(lines[0]);
+            entry.subject = std::string(lines[2]);
+        }
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const IndexEntry &a, const IndexEntry &b){ return a.id < b.id; });
+
+    //the index has to cover everything the counter handed out, a missing counter is recreated here
+    int lastId = readSequence(mailbox);
+    if(lastId == -1){
+        lastId = entries.empty() ? 0 : entries.back().id;
+        writeSequence(mailbox, lastId);
+    }
+
+    writeIndex(mailbox, entries, lastId);
+}
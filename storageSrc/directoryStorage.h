@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+#include "storage.h"
+#include "blobStore.h"
+
+#define INDEX_REBUILD_READ_SIZE 4096 //bytes read from the start of each message to rebuild the index, enough for sender, receivers and subject
+#define INDEX_HASH_LOOKUP_SIZE (64 * 1024) //DEL takes the hash of larger messages from the index, smaller ones are hashed faster than the index is read
+
+//default backend: one file per message under messages/<user>/<id>, plus counter and index files in each mailbox
+//message files are hard links into the blob store, so identical messages (e.g. one SEND to many receivers) are stored once
+class DirectoryStorage : public Storage {
+public:
+    DirectoryStorage(const std::string &dataDirectory);
+
+    int deliver(const std::string &receiver, const std::string &sender, const std::string &subject, std::string_view message) override;
+    int commit(StagedMessage &message, const std::string &receiver) override;
+    bool list(const std::string &username, std::vector<IndexEntry> &entries) override;
+    void openMessages(const std::string &username, const std::vector<int> &ids, std::vector<MessageFile> &files) override;
+    void removeMessages(const std::string &username, const std::vector<int> &ids, std::vector<bool> &removed) override;
+    bool search(const std::string &username, const std::vector<std::string> &terms, std::vector<int> &ids) override;
+    void compact() override;
+
+private:
+    std::filesystem::path messagesDirectory;
+    BlobStore blobs;
+
+    int nextMessageId(const std::filesystem::path &mailbox); //advances the mailbox counter and returns the new message-id, mailbox must be locked exclusively
+    int highestMessageId(const std::filesystem::path &mailbox); //scans mailbox for the highest message-id, used to rebuild the counter
+    void rebuildIndex(const std::filesystem::path &mailbox); //creates the index from the message files, mailbox must be locked exclusively
+};
@@ -0,0 +1,205 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "fileBatch.h"
+#include "../logSrc/log.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define OPERATION_OPEN 1
+#define OPERATION_STAT 2
+#define OPERATION_READ 3
+#define OPERATION_CLOSE 4
+#define OPERATION_UNLINK 5
+
+void FileBatch::open(const std::string &path, int flags, int &result){
+    operations.push_back(Operation{OPERATION_OPEN, path, -1, flags, NULL, 0, 0, NULL, &result});
+}
+
+void FileBatch::stat(const std::string &path, struct statx &status, int &result){
+    operations.push_back(Operation{OPERATION_STAT, path, -1, 0, NULL, 0, 0, &status, &result});
+}
+
+void FileBatch::read(int file, char *buffer, size_t length, off_t offset, int &result){
+    operations.push_back(Operation{OPERATION_READ, "", file, 0, buffer, length, offset, NULL, &result});
+}
+
+void FileBatch::close(int file){
+    operations.push_back(Operation{OPERATION_CLOSE, "", file, 0, NULL, 0, 0, NULL, NULL});
+}
+
+void FileBatch::unlink(const std::string &path, int &result){
+    operations.push_back(Operation{OPERATION_UNLINK, path, -1, 0, NULL, 0, 0, NULL, &result});
+}
+
+void FileBatch::runWithSystemCalls(size_t first){
+
+    for(size_t i = first; i < operations.size(); i++){
+        Operation &operation = operations[i];
+        int result = -1;
+
+        switch(operation.type){
+            case OPERATION_OPEN:
+                result = ::open(operation.path.c_str(), operation.flags);
+                break;
+            case OPERATION_STAT:
+                result = statx(AT_FDCWD, operation.path.c_str(), 0, STATX_BASIC_STATS, operation.status);
+                break;
+            case OPERATION_READ:
+                do{
+                    result = pread(operation.file, operation.buffer, operation.length, operation.offset);
+                } while(result == -1 && errno == EINTR);
+                break;
+            case OPERATION_CLOSE:
+                result = ::close(operation.file);
+                break;
+            case OPERATION_UNLINK:
+                result = ::unlink(operation.path.c_str());
+                break;
+        }
+
+        if(operation.result != NULL){
+            *operation.result = result == -1 ? -errno : result;
+        }
+    }
+}
+
+#ifdef HAVE_LIBURING
+
+//ring of the calling thread, created on first use; a forked child inherits the rings of its parent's thread
+//but must not share them (completions could end up in the wrong process), so it creates its own
+struct ThreadRing {
+    struct io_uring ring;
+    pid_t process = 0;
+    bool available = false;
+
+    ~ThreadRing(){
+        if(available && process == getpid()){
+            io_uring_queue_exit(&ring);
+        }
+    }
+};
+
+static thread_local ThreadRing threadRing;
+
+static struct io_uring *getRing(){
+
+    if(threadRing.process != getpid()){
+        if(threadRing.available){
+            io_uring_queue_exit(&threadRing.ring); //only the copy of this process, the parent keeps its ring
+        }
+        threadRing.process = getpid();
+
+        int result = io_uring_queue_init(FILE_BATCH_RING_SIZE, &threadRing.ring, 0);
+        threadRing.available = result == 0;
+        if(result != 0){
+            logWarn("io_uring not available (%s), file operations use system calls", strerror(-result));
+        }
+    }
+
+    return threadRing.available ? &threadRing.ring : NULL;
+}
+
+static void prepare(struct io_uring_sqe *entry, void *operation, int type, const char *path, int file, int flags,
+    char *buffer, size_t length, off_t offset, struct statx *status){
+
+    switch(type){
+        case OPERATION_OPEN:
+            io_uring_prep_openat(entry, AT_FDCWD, path, flags, 0);
+            break;
+        case OPERATION_STAT:
+            io_uring_prep_statx(entry, AT_FDCWD, path, 0, STATX_BASIC_STATS, status);
+            break;
+        case OPERATION_READ:
+            io_uring_prep_read(entry, file, buffer, length, offset);
+            break;
+        case OPERATION_CLOSE:
+            io_uring_prep_close(entry, file);
+            break;
+        case OPERATION_UNLINK:
+            io_uring_prep_unlinkat(entry, AT_FDCWD, path, 0);
+            break;
+    }
+
+    io_uring_sqe_set_data(entry, operation);
+}
+
+void FileBatch::run(){
+
+    struct io_uring *ring = operations.size() >= FILE_BATCH_RING_MINIMUM ? getRing() : NULL;
+    if(ring == NULL){
+        runWithSystemCalls(0);
+        operations.clear();
+        return;
+    }
+
+    //at most FILE_BATCH_RING_SIZE operations are in flight, so the completion queue can never overflow
+    size_t submitted = 0;
+    size_t completed = 0;
+    while(completed < operations.size()){
+
+        while(submitted < operations.size() && submitted - completed < FILE_BATCH_RING_SIZE){
+            struct io_uring_sqe *entry = io_uring_get_sqe(ring);
+            if(entry == NULL){
+                break;
+            }
+            Operation &operation = operations[submitted];
+            if(operation.result != NULL){
+                *operation.result = -EIO; //stays if the ring breaks before the completion arrives
+            }
+            prepare(entry, &operation, operation.type, operation.path.c_str(), operation.file, operation.flags,
+                operation.buffer, operation.length, operation.offset, operation.status);
+            submitted++;
+        }
+
+        int result = io_uring_submit_and_wait(ring, 1);
+        if(result < 0 && result != -EINTR && result != -EAGAIN && result != -EBUSY){
+            //the ring is broken, closing it cancels what is still in flight, those operations keep -EIO
+            //and the ones that were not submitted yet run with system calls, this thread does not use io_uring again
+            logError("io_uring_submit_and_wait: %s", strerror(-result));
+            io_uring_queue_exit(ring);
+            threadRing.available = false;
+            runWithSystemCalls(submitted);
+            break;
+        }
+
+        struct io_uring_cqe *completion;
+        unsigned head;
+        unsigned count = 0;
+        io_uring_for_each_cqe(ring, head, completion){
+            Operation *operation = (Operation *)io_uring_cqe_get_data(completion);
+            if(operation->result != NULL){
+                *operation->result = completion->res;
+            }
+            count++;
+        }
+        io_uring_cq_advance(ring, count);
+        completed += count;
+    }
+
+    operations.clear();
+}
+
+const char *fileBatchMethod(){
+    return getRing() != NULL ? "io_uring" : "system calls";
+}
+
+#else
+
+void FileBatch::run(){
+    runWithSystemCalls(0);
+    operations.clear();
+}
+
+const char *fileBatchMethod(){
+    return "system calls";
+}
+
+#endif
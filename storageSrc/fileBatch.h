@@ -0,0 +1,48 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string>
+#include <vector>
+
+//file operations that are queued and then run together, e.g. opening every message of a batch READ
+//built with liburing (HAVE_LIBURING, see Makefile) a batch goes to the kernel as one io_uring submission and its
+//operations run concurrently; without liburing, or if the kernel does not allow io_uring, they run one after
+//another with the usual system calls, the results are the same
+//every thread has its own ring, so batches of different connections (worker threads, client processes) never wait for each other
+#define FILE_BATCH_RING_SIZE 64 //submission queue entries of each ring, larger batches are submitted in parts
+#define FILE_BATCH_RING_MINIMUM 8 //smaller batches (e.g. READ of one message) are faster with plain system calls
+
+class FileBatch {
+public:
+    //each operation stores the return value of its system call in result, or -errno if it failed
+    //paths are copied, buffers and results have to stay valid until run() returns
+    void open(const std::string &path, int flags, int &result);
+    void stat(const std::string &path, struct statx &status, int &result);
+    void read(int file, char *buffer, size_t length, off_t offset, int &result); //one read, can return less than length
+    void close(int file);
+    void unlink(const std::string &path, int &result);
+
+    void run(); //runs all queued operations in no particular order and waits until they are done, the batch is empty afterwards
+    bool empty() const { return operations.empty(); }
+
+private:
+    struct Operation {
+        int type;
+        std::string path;
+        int file;
+        int flags;
+        char *buffer;
+        size_t length;
+        off_t offset;
+        struct statx *status;
+        int *result; //NULL if nobody wants it (close)
+    };
+
+    std::vector<Operation> operations;
+
+    void runWithSystemCalls(size_t first); //runs operations from first on synchronously
+};
+
+const char *fileBatchMethod(); //"io_uring" or "system calls", for the log at startup
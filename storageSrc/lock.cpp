@@ -0,0 +1,204 @@
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <unordered_map>
+#include <filesystem>
+#include "lock.h"
+#include "../logSrc/log.h"
+#include "../metricsSrc/metrics.h"
+
+namespace fs = std::filesystem;
+
+static fs::path lockDirectory;
+
+//one open lock file of this process
+//flock() on a shared descriptor does not exclude threads of the same process (and a second LOCK_EX or LOCK_SH
+//would only convert the lock), so threads are excluded from each other by a readers-writer lock first and only
+//the first reader or the writer of the process takes the flock
+struct LockEntry {
+    int file = -1;
+    std::shared_mutex threads;
+    std::mutex readersMutex; //guards readers and the flock of the readers
+    int readers = 0; //threads of this process that hold the lock shared
+    bool exclusive = false; //held exclusively by a thread of this process
+    int users = 0; //threads that hold the lock or wait for it, the entry is not closed while there are any; guarded by the table mutex
+    uint64_t lastUse = 0;
+};
+
+//lock files of one process, a forked child starts its own table: the inherited descriptors share their flocks
+//with the parent, and the parent's mutexes may have been held by another thread at the time of the fork
+struct LockTable {
+    pid_t process;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::unique_ptr<LockEntry>> entries;
+    std::unordered_map<int, LockEntry *> entryOfFile;
+    uint64_t uses = 0;
+
+    LockTable(pid_t process) : process(process) {}
+};
+
+static std::atomic<LockTable *> currentTable(nullptr);
+
+static LockTable *lockTable(){
+
+    pid_t process = getpid();
+    LockTable *table = currentTable.load();
+    while(table == nullptr || table->process != process){
+        //the table of the parent is left as it is, its descriptors stay open (at most LOCK_CACHE_SIZE)
+        LockTable *fresh = new LockTable(process);
+        if(currentTable.compare_exchange_strong(table, fresh)){
+            return fresh;
+        }
+        delete fresh;
+    }
+
+    return table;
+}
+
+//closes the least recently used lock file nobody holds, table has to be locked
+static void evictLockFile(LockTable *table){
+
+    auto oldest = table->entries.end();
+    for(auto it = table->entries.begin(); it != table->entries.end(); ++it){
+        if(it->second->users == 0 && (oldest == table->entries.end() || it->second->lastUse < oldest->second->lastUse)){
+            oldest = it;
+        }
+    }
+    if(oldest == table->entries.end()){
+        return;
+    }
+
+    table->entryOfFile.erase(oldest->second->file);
+    close(oldest->second->file);
+    table->entries.erase(oldest);
+}
+
+static bool flockFile(int file, int operation){
+
+    while(flock(file, operation) != 0){
+        if(errno != EINTR){
+            logErrno("flock");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void initLocks(const std::string &dataDirectory){
+    lockDirectory = fs::path(dataDirectory) / "locks";
+    create_directory(lockDirectory); //ok to use even if directory already exists
+}
+
+int lock(const std::string &name, int operation){
+
+    LockTable *table = lockTable();
+    LockEntry *entry;
+    {
+        std::lock_guard<std::mutex> guard(table->mutex);
+
+        auto it = table->entries.find(name);
+        if(it == table->entries.end()){
+            if(table->entries.size() >= LOCK_CACHE_SIZE){
+                evictLockFile(table);
+            }
+
+            fs::path p = lockDirectory / name;
+            int lockFile = open(p.string().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if(lockFile == -1){
+                logErrno("open lock");
+                return -1;
+            }
+
+            it = table->entries.emplace(name, std::make_unique<LockEntry>()).first;
+            it->second->file = lockFile;
+            table->entryOfFile[lockFile] = it->second.get();
+        }
+
+        entry = it->second.get();
+        entry->users++;
+        entry->lastUse = ++table->uses;
+    }
+
+    long long start = metricsClock();
+    bool locked = true;
+
+    if(operation == LOCK_EX){
+        entry->threads.lock();
+        locked = flockFile(entry->file, LOCK_EX);
+        if(locked){
+            entry->exclusive = true;
+        } else {
+            entry->threads.unlock();
+        }
+    } else {
+        entry->threads.lock_shared();
+        std::lock_guard<std::mutex> guard(entry->readersMutex);
+        if(entry->readers == 0){
+            locked = flockFile(entry->file, LOCK_SH);
+        }
+        if(locked){
+            entry->readers++;
+        } else {
+            entry->threads.unlock_shared();
+        }
+    }
+
+    countPhase(METRICS_PHASE_LOCK_WAIT, metricsClock() - start);
+
+    if(!locked){
+        std::lock_guard<std::mutex> guard(table->mutex);
+        entry->users--;
+        return -1;
+    }
+
+    return entry->file;
+}
+
+void unlock(int lockFile){
+
+    if(lockFile == -1){
+        return;
+    }
+
+    LockTable *table = lockTable();
+    LockEntry *entry;
+    {
+        std::lock_guard<std::mutex> guard(table->mutex);
+        auto it = table->entryOfFile.find(lockFile);
+        if(it == table->entryOfFile.end()){
+            return;
+        }
+        entry = it->second;
+    }
+
+    if(entry->exclusive){
+        entry->exclusive = false;
+        flockFile(entry->file, LOCK_UN);
+        entry->threads.unlock();
+    } else {
+        {
+            std::lock_guard<std::mutex> guard(entry->readersMutex);
+            if(--entry->readers == 0){
+                flockFile(entry->file, LOCK_UN);
+            }
+        }
+        entry->threads.unlock_shared();
+    }
+
+    std::lock_guard<std::mutex> guard(table->mutex);
+    entry->users--;
+}
+
+std::string mailboxLock(const std::string &username){
+    return "mailbox-" + username;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+#include <sys/file.h>
+
+//locks are flock()s on files in <dataDirectory>/locks, one per mailbox plus one for the auth cache (and blob stripes)
+//every process keeps the lock files it uses open (up to LOCK_CACHE_SIZE, the least recently used unheld one is closed
+//then), threads of the same process are excluded from each other by a readers-writer lock in front of the flock
+#define LOCK_CACHE_SIZE 256
+
+void initLocks(const std::string &dataDirectory); //creates lock directory, has to be called before lock()
+int lock(const std::string &name, int operation); //lock <name> with LOCK_SH or LOCK_EX, returns descriptor for unlock(), -1 on error (e.g. out of descriptors)
+void unlock(int lockFile); //unlock descriptor returned by lock(), -1 is ignored
+std::string mailboxLock(const std::string &username); //name of the lock for a mailbox
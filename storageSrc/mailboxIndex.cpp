@@ -0,0 +1,362 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <unordered_map>
+#include "mailboxIndex.h"
+#include "../logSrc/log.h"
+#include "lock.h"
+
+namespace fs = std::filesystem;
+
+int readSequence(const fs::path &mailbox){
+
+    int messageId = -1;
+
+    std::ifstream sequenceRead(mailbox / SEQUENCE_FILE);
+    if(sequenceRead.is_open()){
+        std::string sequenceLine;
+        getline(sequenceRead, sequenceLine);
+        if(isMessageId(sequenceLine)){
+            messageId = std::stoi(sequenceLine);
+        }
+        sequenceRead.close();
+    }
+
+    return messageId;
+}
+
+void writeSequence(const fs::path &mailbox, int messageId){
+
+    //write to temporary file first and rename it, so the counter is always either the old or the new value
+    fs::path temporaryFile = mailbox / SEQUENCE_FILE ".tmp";
+    std::ofstream sequenceWrite(temporaryFile);
+    sequenceWrite << messageId << "\n";
+    sequenceWrite.close();
+    fs::rename(temporaryFile, mailbox / SEQUENCE_FILE);
+}
+
+//hashes are hex sha-256 (blobStore.h), backends without them leave the field empty
+static bool isHashField(const std::string &field){
+    if(!field.empty() && field.length() != 64){
+        return false;
+    }
+    for(char c : field){
+        if(!isxdigit((unsigned char)c)){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool readIndex(const fs::path &mailbox, std::vector<IndexEntry> &entries, int &lastId, int &deletions){
+
+    entries.clear();
+    deletions = 0;
+
+    int indexFile = open((mailbox / INDEX_FILE).string().c_str(), O_RDONLY | O_CLOEXEC);
+    if(indexFile == -1){
+        return false;
+    }
+
+    struct stat indexStat;
+    if(fstat(indexFile, &indexStat) == -1 || indexStat.st_size < INDEX_HEADER_SIZE){
+        close(indexFile);
+        return false;
+    }
+
+    size_t indexSize = indexStat.st_size;
+    void *mapping = mmap(NULL, indexSize, PROT_READ, MAP_PRIVATE, indexFile, 0);
+    close(indexFile); //mapping stays valid
+    if(mapping == MAP_FAILED){
+        logErrno("mmap");
+        return false;
+    }
+
+    const char *data = (const char *)mapping;
+    bool valid = data[0] == '#' && data[indexSize - 1] == '\n'; //a record cut off by a crash makes the index stale
+    size_t position = 1;
+
+    //header
+    std::string field;
+    for(; valid && position < INDEX_HEADER_SIZE - 1; position++){
+        field += data[position];
+    }
+    valid = valid && isMessageId(field) && data[INDEX_HEADER_SIZE - 1] == '\n';
+    if(valid){
+        lastId = std::stoi(field);
+    }
+    position = INDEX_HEADER_SIZE;
+
+    //records, positions of deleted messages are remembered so a deletion is O(1)
+    std::unordered_map<int, size_t> positionOfId;
+    while(valid && position < indexSize){
+
+        const char *lineEnd = (const char *)memchr(&data[position], '\n', indexSize - position);
+        std::string record(&data[position], lineEnd - &data[position]);
+        position = lineEnd - data + 1;
+
+        if(record.length() < 2 || (record[0] != '+' && record[0] != '-')){
+            valid = false;
+            break;
+        }
+
+        if(record[0] == '-'){
+            auto it = positionOfId.find(atoi(record.c_str() + 1));
+            if(it != positionOfId.end()){
+                entries[it->second].id = -1;
+                positionOfId.erase(it);
+            }
+            deletions++;
+            continue;
+        }
+
+        //split first five fields at tabs, the subject may contain tabs itself
+        std::string fields[6];
+        size_t start = 1;
+        for(int i = 0; i < 5; i++){
+            size_t tab = record.find('\t', start);
+            if(tab == std::string::npos){
+                valid = false;
+                break;
+            }
+            fields[i] = record.substr(start, tab - start);
+            start = tab + 1;
+        }
+        //an index of the format without hashes has a sender there, it is rebuilt
+        if(!valid || !isMessageId(fields[0]) || !isHashField(fields[3])){
+            valid = false;
+            break;
+        }
+        fields[5] = record.substr(start);
+
+        IndexEntry entry;
+        entry.id = std::stoi(fields[0]);
+        entry.size = atol(fields[1].c_str());
+        entry.timestamp = atol(fields[2].c_str());
+        entry.hash = fields[3];
+        entry.sender = fields[4];
+        entry.subject = fields[5];
+
+        positionOfId[entry.id] = entries.size();
+        entries.push_back(entry);
+    }
+
+    munmap(mapping, indexSize);
+
+    if(!valid){
+        entries.clear();
+        return false;
+    }
+
+    //remove deleted entries, records are in order of delivery so the list stays sorted by id
+    size_t kept = 0;
+    for(size_t i = 0; i < entries.size(); i++){
+        if(entries[i].id != -1){
+            entries[kept++] = entries[i];
+        }
+    }
+    entries.resize(kept);
+
+    return true;
+}
+
+void writeIndex(const fs::path &mailbox, const std::vector<IndexEntry> &entries, int lastId){
+
+    char header[INDEX_HEADER_SIZE + 1];
+    snprintf(header, sizeof(header), "#%09d\n", lastId);
+
+    fs::path temporaryFile = mailbox / INDEX_FILE ".tmp";
+    std::ofstream indexFile(temporaryFile);
+    indexFile << header;
+    for(auto const &entry : entries){
+        indexFile << "+" << entry.id << "\t" << entry.size << "\t" << entry.timestamp << "\t" << entry.hash << "\t" << entry.sender << "\t" << entry.subject << "\n";
+    }
+    indexFile.close();
+
+    fs::rename(temporaryFile, mailbox / INDEX_FILE);
+}
+
+bool indexIsCurrent(const fs::path &mailbox){
+
+    int indexFile = open((mailbox / INDEX_FILE).string().c_str(), O_RDONLY | O_CLOEXEC);
+    if(indexFile == -1){
+        return false;
+    }
+
+    char header[INDEX_HEADER_SIZE + 1] = {0};
+    bool current = pread(indexFile, header, INDEX_HEADER_SIZE, 0) == INDEX_HEADER_SIZE && header[0] == '#' && atoi(header + 1) == readSequence(mailbox);
+    close(indexFile);
+
+    return current;
+}
+
+void appendIndexRecord(const fs::path &mailbox, const IndexEntry &entry){
+
+    fs::path indexPath = mailbox / INDEX_FILE;
+
+    int indexFile = open(indexPath.string().c_str(), O_RDWR | O_CLOEXEC);
+    if(indexFile == -1){
+        return; //no index yet, LIST will build it
+    }
+
+    //the index may only be extended if it covers every message before this one
+    char header[INDEX_HEADER_SIZE + 1] = {0};
+    if(pread(indexFile, header, INDEX_HEADER_SIZE, 0) != INDEX_HEADER_SIZE || header[0] != '#' || atoi(header + 1) != entry.id - 1){
+        close(indexFile);
+        fs::remove(indexPath);
+        return;
+    }
+
+    std::string record = "+" + std::to_string(entry.id) + "\t" + std::to_string(entry.size) + "\t" + std::to_string(entry.timestamp) + "\t" + entry.hash + "\t" + entry.sender + "\t" + entry.subject + "\n";
+
+    //record first, header last: a crash in between leaves a header behind the counter, which triggers a rebuild
+    off_t end = lseek(indexFile, 0, SEEK_END);
+    snprintf(header, sizeof(header), "#%09d\n", entry.id);
+    if(end == -1 || pwrite(indexFile, record.data(), record.length(), end) != (ssize_t)record.length() || pwrite(indexFile, header, INDEX_HEADER_SIZE, 0) != INDEX_HEADER_SIZE){
+        logErrno("index write");
+        close(indexFile);
+        fs::remove(indexPath);
+        return;
+    }
+
+    close(indexFile);
+}
+
+void appendIndexDeletions(const fs::path &mailbox, const std::vector<int> &ids){
+
+    if(ids.empty()){
+        return;
+    }
+
+    fs::path indexPath = mailbox / INDEX_FILE;
+
+    int indexFile = open(indexPath.string().c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if(indexFile == -1){
+        return; //no index yet, LIST will build it
+    }
+
+    std::string record;
+    for(int id : ids){
+        record += "-" + std::to_string(id) + "\n";
+    }
+    if(write(indexFile, record.data(), record.length()) != (ssize_t)record.length()){
+        logErrno("index write");
+        close(indexFile);
+        fs::remove(indexPath);
+        return;
+    }
+
+    close(indexFile);
+}
+
+bool loadIndex(const fs::path &mailbox, const std::string &username, std::vector<IndexEntry> &entries, const std::function<void()> &rebuild){
+
+    entries.clear();
+
+    int lockFile = lock(mailboxLock(username), LOCK_SH);
+    if(lockFile == -1){
+        return false;
+    }
+
+    if(!fs::exists(mailbox)){
+        unlock(lockFile);
+        return true;
+    }
+
+    int lastId;
+    int deletions;
+
+    //rebuild or compact the index if necessary, this needs the exclusive lock
+    bool indexValid = readIndex(mailbox, entries, lastId, deletions) && lastId == readSequence(mailbox);
+    if(!indexValid || (deletions > INDEX_COMPACT_THRESHOLD && deletions > (int)entries.size())){
+        unlock(lockFile);
+        lockFile = lock(mailboxLock(username), LOCK_EX);
+        if(lockFile == -1){
+            return false;
+        }
+
+        if(!indexValid){
+            logInfo("Rebuilding index of mailbox %s", username.c_str());
+            rebuild();
+        } else if(readIndex(mailbox, entries, lastId, deletions)){
+            writeIndex(mailbox, entries, lastId);
+        }
+
+        if(!readIndex(mailbox, entries, lastId, deletions)){
+            unlock(lockFile);
+            return false;
+        }
+    }
+
+    unlock(lockFile);
+
+    return true;
+}
+
+void readIndexHashes(const fs::path &mailbox, const std::vector<int> &ids, std::vector<std::string> &hashes){
+
+    hashes.assign(ids.size(), "");
+
+    int indexFile = open((mailbox / INDEX_FILE).string().c_str(), O_RDONLY | O_CLOEXEC);
+    if(indexFile == -1){
+        return;
+    }
+
+    struct stat indexStat;
+    if(fstat(indexFile, &indexStat) == -1 || indexStat.st_size < INDEX_HEADER_SIZE){
+        close(indexFile);
+        return;
+    }
+
+    size_t indexSize = indexStat.st_size;
+    void *mapping = mmap(NULL, indexSize, PROT_READ, MAP_PRIVATE, indexFile, 0);
+    close(indexFile); //mapping stays valid
+    if(mapping == MAP_FAILED){
+        logErrno("mmap");
+        return;
+    }
+
+    std::unordered_map<int, size_t> positionOfId;
+    for(size_t i = 0; i < ids.size(); i++){
+        positionOfId[ids[i]] = i;
+    }
+
+    //only the records of the wanted messages are split, the others are skipped line by line
+    const char *data = (const char *)mapping;
+    const char *end = data + indexSize;
+    const char *line = data + INDEX_HEADER_SIZE;
+    while(line < end){
+        const char *lineEnd = (const char *)memchr(line, '\n', end - line);
+        if(lineEnd == NULL){
+            break;
+        }
+
+        auto it = line[0] == '+' ? positionOfId.find(atoi(line + 1)) : positionOfId.end();
+        if(it != positionOfId.end()){
+            //fourth field: +<id>\t<size>\t<timestamp>\t<hash>\t...
+            const char *field = line;
+            for(int i = 0; i < 3 && field != NULL; i++){
+                field = (const char *)memchr(field, '\t', lineEnd - field);
+                field = field != NULL ? field + 1 : NULL;
+            }
+            const char *fieldEnd = field != NULL ? (const char *)memchr(field, '\t', lineEnd - field) : NULL;
+            if(fieldEnd != NULL && isHashField(std::string(field, fieldEnd - field))){
+                hashes[it->second] = std::string(field, fieldEnd - field);
+            }
+        }
+
+        line = lineEnd + 1;
+    }
+
+    munmap(mapping, indexSize);
+}
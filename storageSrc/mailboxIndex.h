@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <functional>
+#include "storage.h"
+
+//message-ids are allocated from a counter file in each mailbox, so SEND does not have to scan the mailbox
+#define SEQUENCE_FILE ".sequence" //last message-id handed out in this mailbox
+
+int readSequence(const std::filesystem::path &mailbox); //returns the last message-id handed out in this mailbox, -1 if the counter is missing
+void writeSequence(const std::filesystem::path &mailbox, int messageId); //replaces the counter atomically
+
+//every mailbox has an index, so LIST only has to read one file instead of opening every message
+//the index is append-only text: a header with the last message-id it covers, then one record per SEND and DEL
+//  #<last message-id, 9 digits>
+//  +<id>\t<size>\t<timestamp>\t<hash>\t<sender>\t<subject>
+//  -<id>
+//if the header does not match the mailbox counter (e.g. after a crash between writing a message and its record)
+//the index is stale and has to be rebuilt by the storage backend
+#define INDEX_FILE ".index"
+#define INDEX_HEADER_SIZE 11 //'#' + 9 digits + '\n'
+#define INDEX_COMPACT_THRESHOLD 64 //rewrite the index once it has more deletions than this and than messages
+
+bool readIndex(const std::filesystem::path &mailbox, std::vector<IndexEntry> &entries, int &lastId, int &deletions); //parses the index, false if it is missing or damaged
+bool indexIsCurrent(const std::filesystem::path &mailbox); //true if the index header matches the counter, only reads the header
+void writeIndex(const std::filesystem::path &mailbox, const std::vector<IndexEntry> &entries, int lastId); //replaces the index atomically
+void appendIndexRecord(const std::filesystem::path &mailbox, const IndexEntry &entry); //adds a delivered message, drops the index if it was stale
+void appendIndexDeletions(const std::filesystem::path &mailbox, const std::vector<int> &ids); //marks messages as deleted, one write for all of them
+void readIndexHashes(const std::filesystem::path &mailbox, const std::vector<int> &ids, std::vector<std::string> &hashes); //hashes of messages from the index, empty if unknown
+
+//reads the index of a mailbox for LIST, takes the mailbox lock itself
+//a stale index is recreated with rebuild() and an index with too many deletions is compacted, both under the exclusive lock
+bool loadIndex(const std::filesystem::path &mailbox, const std::string &username, std::vector<IndexEntry> &entries, const std::function<void()> &rebuild);
@@ -0,0 +1,630 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <iterator>
+#include <filesystem>
+#include "searchIndex.h"
+#include "mailboxIndex.h"
+#include "../logSrc/log.h"
+#include "lock.h"
+
+namespace fs = std::filesystem;
+
+#define SEARCH_LOG_HEADER_SIZE 11 //'#' + 9 digits + '\n', like INDEX_HEADER_SIZE
+
+//--- Terms ---
+
+static bool isWordByte(unsigned char c){
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+//appends prefix + every word of text, only ASCII letters are lowercased so UTF-8 words stay intact
+static void addWords(std::string_view text, const char *prefix, std::vector<std::string> &terms){
+
+    size_t position = 0;
+    while(position < text.length()){
+        if(!isWordByte(text[position])){
+            position++;
+            continue;
+        }
+
+        size_t start = position;
+        while(position < text.length() && isWordByte(text[position])){
+            position++;
+        }
+        if(position - start < SEARCH_MIN_TERM_LENGTH){
+            continue;
+        }
+
+        std::string term = prefix;
+        for(size_t i = start; i < start + std::min(position - start, (size_t)SEARCH_MAX_TERM_LENGTH); i++){
+            term += (text[i] >= 'A' && text[i] <= 'Z') ? text[i] - 'A' + 'a' : text[i];
+        }
+        terms.push_back(term);
+    }
+}
+
+std::string messageTerms(std::string_view message){
+
+    message = message.substr(0, SEARCH_INDEXED_SIZE);
+
+    //"<sender>\n<receivers>\n<subject>\n<body>", the receivers are not searchable
+    size_t senderEnd = message.find('\n');
+    size_t receiverEnd = senderEnd == std::string_view::npos ? senderEnd : message.find('\n', senderEnd + 1);
+    size_t subjectEnd = receiverEnd == std::string_view::npos ? receiverEnd : message.find('\n', receiverEnd + 1);
+
+    std::vector<std::string> terms;
+    std::string_view sender = message.substr(0, senderEnd);
+    if(!sender.empty() && std::all_of(sender.begin(), sender.end(), [](char c){ return isWordByte(c); })){
+        terms.push_back("from:" + std::string(sender));
+    }
+    if(receiverEnd != std::string_view::npos){
+        std::string_view subject = message.substr(receiverEnd + 1, subjectEnd == std::string_view::npos ? subjectEnd : subjectEnd - receiverEnd - 1);
+        addWords(subject, "", terms);
+        addWords(subject, "subject:", terms);
+    }
+    if(subjectEnd != std::string_view::npos){
+        addWords(message.substr(subjectEnd + 1), "", terms);
+    }
+
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+    std::string joined;
+    for(auto const &term : terms){
+        if(!joined.empty()){
+            joined += ' ';
+        }
+        joined += term;
+    }
+    return joined;
+}
+
+std::string messageFileTerms(int file, off_t offset, size_t length){
+
+    std::string message(std::min(length, (size_t)SEARCH_INDEXED_SIZE), '\0');
+    size_t done = 0;
+    while(done < message.length()){
+        ssize_t size = pread(file, &message[done], message.length() - done, offset + done);
+        if(size == -1 && errno == EINTR){
+            continue;
+        }
+        if(size <= 0){
+            logErrno("read message for search index");
+            return "";
+        }
+        done += size;
+    }
+
+    return messageTerms(message);
+}
+
+bool parseSearchQuery(std::string_view query, std::vector<std::string> &terms){
+
+    terms.clear();
+
+    size_t position = 0;
+    while(position < query.length()){
+        size_t end = query.find_first_of(" \t", position);
+        if(end == std::string_view::npos){
+            end = query.length();
+        }
+        std::string_view word = query.substr(position, end - position);
+        position = end + 1;
+
+        if(word.substr(0, 5) == "from:" && word.length() > 5){
+            //senders are usernames, they are stored lowercase and whole (also if shorter than a word)
+            std::string term = "from:";
+            for(char c : word.substr(5)){
+                term += (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+            }
+            terms.push_back(term);
+        } else if(word.substr(0, 8) == "subject:"){
+            addWords(word.substr(8), "subject:", terms);
+        } else {
+            addWords(word, "", terms);
+        }
+    }
+
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+    return !terms.empty() && terms.size() <= SEARCH_MAX_QUERY_TERMS;
+}
+
+static bool containsTerm(std::string_view terms, std::string_view term){
+
+    size_t position = 0;
+    while((position = terms.find(term, position)) != std::string_view::npos){
+        bool wordStart = position == 0 || terms[position - 1] == ' ';
+        bool wordEnd = position + term.length() == terms.length() || terms[position + term.length()] == ' ';
+        if(wordStart && wordEnd){
+            return true;
+        }
+        position++;
+    }
+    return false;
+}
+
+//--- Base ---
+
+static void encodePostings(const std::vector<int> &ids, std::string &data){
+
+    uint32_t previous = 0;
+    for(int id : ids){
+        uint32_t gap = (uint32_t)id - previous;
+        previous = id;
+        while(gap >= 0x80){
+            data += (char)((gap & 0x7f) | 0x80);
+            gap >>= 7;
+        }
+        data += (char)gap;
+    }
+}
+
+static bool decodePostings(const unsigned char *data, size_t length, std::vector<int> &ids){
+
+    uint32_t id = 0;
+    uint32_t gap = 0;
+    int shift = 0;
+    for(size_t i = 0; i < length; i++){
+        gap |= (uint32_t)(data[i] & 0x7f) << shift;
+        if(data[i] & 0x80){
+            shift += 7;
+            if(shift > 28){
+                return false;
+            }
+            continue;
+        }
+        id += gap;
+        ids.push_back((int)id);
+        gap = 0;
+        shift = 0;
+    }
+
+    return shift == 0;
+}
+
+//base file mapped into memory
+struct SearchBase {
+    const char *data = NULL;
+    size_t size = 0;
+    const SearchBaseHeader *header = NULL;
+    const SearchTermEntry *table = NULL;
+};
+
+static bool openBase(const fs::path &mailbox, SearchBase &base){
+
+    int baseFile = open((mailbox / SEARCH_BASE_FILE).string().c_str(), O_RDONLY | O_CLOEXEC);
+    if(baseFile == -1){
+        return false;
+    }
+
+    struct stat baseStat;
+    if(fstat(baseFile, &baseStat) == -1 || baseStat.st_size < (off_t)sizeof(SearchBaseHeader)){
+        close(baseFile);
+        return false;
+    }
+
+    void *mapping = mmap(NULL, baseStat.st_size, PROT_READ, MAP_PRIVATE, baseFile, 0);
+    close(baseFile); //mapping stays valid
+    if(mapping == MAP_FAILED){
+        logErrno("mmap");
+        return false;
+    }
+
+    base.data = (const char *)mapping;
+    base.size = baseStat.st_size;
+    base.header = (const SearchBaseHeader *)mapping;
+    base.table = (const SearchTermEntry *)(base.data + sizeof(SearchBaseHeader));
+
+    if(base.header->magic != SEARCH_MAGIC || (base.size - sizeof(SearchBaseHeader)) / sizeof(SearchTermEntry) < base.header->terms){
+        munmap(mapping, base.size);
+        base.data = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+static void closeBase(SearchBase &base){
+    if(base.data != NULL){
+        munmap((void *)base.data, base.size);
+        base.data = NULL;
+    }
+}
+
+static bool validEntry(const SearchBase &base, const SearchTermEntry &entry){
+    return (uint64_t)entry.termOffset + entry.termLength <= base.size && (uint64_t)entry.postingsOffset + entry.postingsLength <= base.size;
+}
+
+//postings of term in the base, binary search in the term table; false if the base is damaged
+static bool basePostings(const SearchBase &base, const std::string &term, std::vector<int> &ids){
+
+    uint32_t low = 0;
+    uint32_t high = base.header->terms;
+    while(low < high){
+        uint32_t middle = low + (high - low) / 2;
+        const SearchTermEntry &entry = base.table[middle];
+        if(!validEntry(base, entry)){
+            return false;
+        }
+
+        int order = std::string_view(base.data + entry.termOffset, entry.termLength).compare(term);
+        if(order == 0){
+            return decodePostings((const unsigned char *)base.data + entry.postingsOffset, entry.postingsLength, ids);
+        }
+        if(order < 0){
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return true;
+}
+
+static void writeBase(const fs::path &mailbox, const std::map<std::string, std::vector<int>> &postings, int lastId){
+
+    SearchBaseHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SEARCH_MAGIC;
+    header.lastId = lastId;
+    header.terms = postings.size();
+
+    std::vector<SearchTermEntry> table;
+    std::string data;
+    size_t dataStart = sizeof(header) + postings.size() * sizeof(SearchTermEntry);
+    for(auto const &term : postings){
+        SearchTermEntry entry;
+        entry.termOffset = dataStart + data.length();
+        entry.termLength = term.first.length();
+        data += term.first;
+        entry.postingsOffset = dataStart + data.length();
+        encodePostings(term.second, data);
+        entry.postingsLength = dataStart + data.length() - entry.postingsOffset;
+        table.push_back(entry);
+    }
+
+    //written to a temporary file and renamed, so readers either see the old or the new base
+    std::string temporaryFile = (mailbox / SEARCH_BASE_FILE ".tmp").string();
+    int baseFile = open(temporaryFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(baseFile == -1){
+        logErrno("open search index");
+        return;
+    }
+
+    std::string content((const char *)&header, sizeof(header));
+    content.append((const char *)table.data(), table.size() * sizeof(SearchTermEntry));
+    content += data;
+
+    size_t written = 0;
+    while(written < content.length()){
+        ssize_t size = write(baseFile, content.data() + written, content.length() - written);
+        if(size == -1 && errno == EINTR){
+            continue;
+        }
+        if(size == -1){
+            break;
+        }
+        written += size;
+    }
+
+    if(close(baseFile) == -1 || written < content.length() || rename(temporaryFile.c_str(), (mailbox / SEARCH_BASE_FILE).string().c_str()) == -1){
+        logErrno("write search index");
+        unlink(temporaryFile.c_str());
+    }
+}
+
+//--- Log ---
+
+//log file read into memory, records point into content
+struct SearchLog {
+    std::string content;
+    int lastId = -1;
+    std::vector<std::pair<int, std::string_view>> additions; //message-id and its terms
+    std::vector<int> deletions;
+};
+
+static bool readLog(const fs::path &mailbox, SearchLog &log){
+
+    int logFile = open((mailbox / SEARCH_LOG_FILE).string().c_str(), O_RDONLY | O_CLOEXEC);
+    if(logFile == -1){
+        return false;
+    }
+
+    struct stat logStat;
+    if(fstat(logFile, &logStat) == -1 || logStat.st_size < SEARCH_LOG_HEADER_SIZE){
+        close(logFile);
+        return false;
+    }
+
+    log.content.resize(logStat.st_size);
+    bool complete = pread(logFile, &log.content[0], log.content.length(), 0) == (ssize_t)log.content.length();
+    close(logFile);
+
+    //a record cut off by a crash makes the log stale
+    if(!complete || log.content[0] != '#' || log.content[SEARCH_LOG_HEADER_SIZE - 1] != '\n' || log.content.back() != '\n'){
+        return false;
+    }
+    std::string_view lastId = std::string_view(log.content).substr(1, SEARCH_LOG_HEADER_SIZE - 2);
+    if(!isMessageId(std::string(lastId))){
+        return false;
+    }
+    log.lastId = atoi(lastId.data());
+
+    std::string_view records = std::string_view(log.content).substr(SEARCH_LOG_HEADER_SIZE);
+    while(!records.empty()){
+        size_t lineEnd = records.find('\n');
+        std::string_view record = records.substr(0, lineEnd);
+        records = records.substr(lineEnd + 1);
+
+        if(record.length() < 2 || (record[0] != '+' && record[0] != '-')){
+            return false;
+        }
+        int id = atoi(record.data() + 1);
+        if(record[0] == '-'){
+            log.deletions.push_back(id);
+            continue;
+        }
+
+        size_t tab = record.find('\t');
+        if(tab == std::string_view::npos){
+            return false;
+        }
+        log.additions.emplace_back(id, record.substr(tab + 1));
+    }
+
+    return true;
+}
+
+//replaces the log by an empty one that starts at lastId
+static void resetLog(const fs::path &mailbox, int lastId){
+
+    char header[SEARCH_LOG_HEADER_SIZE + 1];
+    snprintf(header, sizeof(header), "#%09d\n", lastId);
+
+    std::string temporaryFile = (mailbox / SEARCH_LOG_FILE ".tmp").string();
+    int logFile = open(temporaryFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(logFile == -1 || write(logFile, header, SEARCH_LOG_HEADER_SIZE) != SEARCH_LOG_HEADER_SIZE || close(logFile) == -1 ||
+        rename(temporaryFile.c_str(), (mailbox / SEARCH_LOG_FILE).string().c_str()) == -1){
+        logErrno("write search log");
+        unlink(temporaryFile.c_str());
+    }
+}
+
+void appendSearchRecord(const fs::path &mailbox, int id, const std::string &terms){
+
+    fs::path logPath = mailbox / SEARCH_LOG_FILE;
+
+    int logFile = open(logPath.string().c_str(), O_RDWR | O_CLOEXEC);
+    if(logFile == -1 && id == 1){
+        //first message of a new mailbox, an empty index saves the first SEARCH a rebuild
+        writeBase(mailbox, {}, 0);
+        resetLog(mailbox, 0);
+        logFile = open(logPath.string().c_str(), O_RDWR | O_CLOEXEC);
+    }
+    if(logFile == -1){
+        return; //no index yet, SEARCH will build it
+    }
+
+    //the log may only be extended if it covers every message before this one
+    char header[SEARCH_LOG_HEADER_SIZE + 4] = {0}; //ids have at most 9 digits, the compiler does not know that
+    if(pread(logFile, header, SEARCH_LOG_HEADER_SIZE, 0) != SEARCH_LOG_HEADER_SIZE || header[0] != '#' || atoi(header + 1) != id - 1){
+        close(logFile);
+        fs::remove(logPath);
+        return;
+    }
+
+    std::string record = "+" + std::to_string(id) + "\t" + terms + "\n";
+
+    //record first, header last: a crash in between leaves a header behind the counter, which triggers a rebuild
+    off_t end = lseek(logFile, 0, SEEK_END);
+    snprintf(header, sizeof(header), "#%09d\n", id);
+    if(end == -1 || pwrite(logFile, record.data(), record.length(), end) != (ssize_t)record.length() || pwrite(logFile, header, SEARCH_LOG_HEADER_SIZE, 0) != SEARCH_LOG_HEADER_SIZE){
+        logErrno("search log write");
+        close(logFile);
+        fs::remove(logPath);
+        return;
+    }
+
+    close(logFile);
+}
+
+void appendSearchDeletions(const fs::path &mailbox, const std::vector<int> &ids){
+
+    if(ids.empty()){
+        return;
+    }
+
+    fs::path logPath = mailbox / SEARCH_LOG_FILE;
+
+    int logFile = open(logPath.string().c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if(logFile == -1){
+        return; //no index yet, SEARCH will build it
+    }
+
+    std::string record;
+    for(int id : ids){
+        record += "-" + std::to_string(id) + "\n";
+    }
+    if(write(logFile, record.data(), record.length()) != (ssize_t)record.length()){
+        logErrno("search log write");
+        close(logFile);
+        fs::remove(logPath);
+        return;
+    }
+
+    close(logFile);
+}
+
+//--- Search ---
+
+static void addTerms(std::map<std::string, std::vector<int>> &postings, int id, std::string_view terms){
+
+    while(!terms.empty()){
+        size_t end = terms.find(' ');
+        postings[std::string(terms.substr(0, end))].push_back(id);
+        terms = end == std::string_view::npos ? std::string_view() : terms.substr(end + 1);
+    }
+}
+
+//sorts the lists, drops duplicates (a log that was not reset after a merge) and deleted messages
+static void cleanPostings(std::map<std::string, std::vector<int>> &postings, std::vector<int> deletions){
+
+    std::sort(deletions.begin(), deletions.end());
+
+    for(auto term = postings.begin(); term != postings.end();){
+        std::vector<int> &ids = term->second;
+        if(!std::is_sorted(ids.begin(), ids.end())){
+            std::sort(ids.begin(), ids.end());
+        }
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        if(!deletions.empty()){
+            ids.erase(std::remove_if(ids.begin(), ids.end(), [&deletions](int id){ return std::binary_search(deletions.begin(), deletions.end(), id); }), ids.end());
+        }
+        term = ids.empty() ? postings.erase(term) : std::next(term);
+    }
+}
+
+//writes a new base with the postings of the old base and the log, mailbox must be locked exclusively
+static bool mergeLog(const fs::path &mailbox, const SearchBase &base, const SearchLog &log){
+
+    std::map<std::string, std::vector<int>> postings;
+    for(uint32_t i = 0; i < base.header->terms; i++){
+        const SearchTermEntry &entry = base.table[i];
+        if(!validEntry(base, entry) || !decodePostings((const unsigned char *)base.data + entry.postingsOffset, entry.postingsLength, postings[std::string(base.data + entry.termOffset, entry.termLength)])){
+            return false;
+        }
+    }
+    for(auto const &addition : log.additions){
+        addTerms(postings, addition.first, addition.second);
+    }
+    cleanPostings(postings, log.deletions);
+
+    //base first: a crash before the log is reset leaves records that are in the base already, they are dropped as duplicates
+    writeBase(mailbox, postings, log.lastId);
+    resetLog(mailbox, log.lastId);
+
+    return true;
+}
+
+//creates base and log from the messages, mailbox must be locked exclusively
+static void rebuildSearchIndex(const fs::path &mailbox, const std::function<void(const MessageVisitor &)> &scan){
+
+    std::map<std::string, std::vector<int>> postings;
+    int highestId = 0;
+
+    scan([&postings, &highestId](int id, int file, off_t offset, size_t length){
+        addTerms(postings, id, messageFileTerms(file, offset, length));
+        highestId = std::max(highestId, id);
+    });
+    cleanPostings(postings, {});
+
+    int lastId = std::max(readSequence(mailbox), highestId);
+    writeBase(mailbox, postings, lastId);
+    resetLog(mailbox, lastId);
+}
+
+//base and log are usable if both are readable and the log covers every message the counter handed out
+static bool loadSearchIndex(const fs::path &mailbox, SearchBase &base, SearchLog &log){
+    closeBase(base);
+    log = SearchLog();
+    return openBase(mailbox, base) && readLog(mailbox, log) && log.lastId == readSequence(mailbox);
+}
+
+bool searchMailbox(const fs::path &mailbox, const std::string &username, const std::vector<std::string> &terms,
+    std::vector<int> &ids, const std::function<void(const MessageVisitor &)> &scan){
+
+    ids.clear();
+
+    int lockFile = lock(mailboxLock(username), LOCK_SH);
+    if(lockFile == -1){
+        return false;
+    }
+
+    if(!fs::exists(mailbox)){
+        unlock(lockFile);
+        return true;
+    }
+
+    SearchBase base;
+    SearchLog log;
+
+    //rebuild or merge if necessary, this needs the exclusive lock
+    bool indexValid = loadSearchIndex(mailbox, base, log);
+    if(!indexValid || log.content.length() > SEARCH_MERGE_SIZE){
+        unlock(lockFile);
+        lockFile = lock(mailboxLock(username), LOCK_EX);
+        if(lockFile == -1){
+            closeBase(base);
+            return false;
+        }
+
+        if(!loadSearchIndex(mailbox, base, log)){
+            logInfo("Rebuilding search index of mailbox %s", username.c_str());
+            closeBase(base);
+            rebuildSearchIndex(mailbox, scan);
+        } else if(log.content.length() > SEARCH_MERGE_SIZE && !mergeLog(mailbox, base, log)){
+            logError("Search index of mailbox %s is damaged, rebuilding it", username.c_str());
+            closeBase(base);
+            rebuildSearchIndex(mailbox, scan);
+        }
+
+        if(!loadSearchIndex(mailbox, base, log)){
+            closeBase(base);
+            unlock(lockFile);
+            return false;
+        }
+    }
+
+    //postings of every term from base and log, the result is their intersection
+    std::map<std::string, std::vector<int>> postings;
+    bool valid = true;
+    for(auto const &term : terms){
+        valid = valid && basePostings(base, term, postings[term]);
+    }
+    for(auto const &addition : log.additions){
+        for(auto const &term : terms){
+            if(containsTerm(addition.second, term)){
+                postings[term].push_back(addition.first);
+            }
+        }
+    }
+
+    closeBase(base);
+
+    if(!valid){
+        logError("Search index of mailbox %s is damaged", username.c_str());
+        fs::remove(mailbox / SEARCH_LOG_FILE); //the next search rebuilds it
+        unlock(lockFile);
+        return false;
+    }
+
+    unlock(lockFile);
+
+    cleanPostings(postings, log.deletions);
+    if(postings.size() < terms.size()){
+        return true; //a term without any message
+    }
+
+    ids = postings.begin()->second;
+    for(auto const &term : postings){
+        std::vector<int> both;
+        std::set_intersection(ids.begin(), ids.end(), term.second.begin(), term.second.end(), std::back_inserter(both));
+        ids.swap(both);
+    }
+
+    return true;
+}
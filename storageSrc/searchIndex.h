@@ -0,0 +1,69 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+#include <functional>
+
+//every mailbox has an inverted index for SEARCH, so a search only reads the index instead of every message
+//terms are lowercase words (runs of letters, digits and non-ASCII bytes) of subject and body, every subject word once
+//more as "subject:<word>" and the sender as "from:<sender>"; words shorter than SEARCH_MIN_TERM_LENGTH are left out,
+//longer ones than SEARCH_MAX_TERM_LENGTH cut off, and only the first SEARCH_INDEXED_SIZE bytes of a message count
+//the index has two parts like an LSM tree:
+//  base: binary file with a sorted term table and one posting list (ascending message-ids) per term, read with mmap
+//  log:  append-only text that SEND and DEL extend, same header as the mailbox index (mailboxIndex.h)
+//          #<last message-id, 9 digits>
+//          +<id>\t<term> <term> ...
+//          -<id>
+//a search looks its terms up in the base and scans the log, once the log is larger than SEARCH_MERGE_SIZE it is
+//merged into a new base; a log whose header does not match the mailbox counter is stale and both parts are rebuilt
+#define SEARCH_BASE_FILE ".search"
+#define SEARCH_LOG_FILE ".searchlog"
+#define SEARCH_MAGIC 0x49535754 //"TWSI"
+#define SEARCH_MIN_TERM_LENGTH 2
+#define SEARCH_MAX_TERM_LENGTH 32
+#define SEARCH_MAX_QUERY_TERMS 8 //per SEARCH
+#define SEARCH_INDEXED_SIZE (1024 * 1024) //larger messages are only searchable by their beginning
+#define SEARCH_MERGE_SIZE (64 * 1024) //every search scans the whole log, merging costs a rewrite of the base
+
+//header of the base file, followed by the term table, the terms and the posting lists
+struct SearchBaseHeader {
+    uint32_t magic;
+    uint32_t lastId; //last message-id the base covers
+    uint32_t terms; //entries in the term table
+    uint32_t reserved;
+};
+
+//entry of the term table, sorted by term
+//a posting list is a sequence of varints (7 bits per byte, high bit set on all but the last byte), the first is the
+//lowest message-id and every other one the difference to the id before it
+struct SearchTermEntry {
+    uint32_t termOffset; //offsets are from the start of the file
+    uint32_t termLength;
+    uint32_t postingsOffset;
+    uint32_t postingsLength; //in bytes
+};
+
+//terms of a message as stored ("<sender>\n<receivers>\n<subject>\n<body>"), sorted, without duplicates, separated by ' '
+std::string messageTerms(std::string_view message);
+std::string messageFileTerms(int file, off_t offset, size_t length); //same for a message in a region of a file, "" on error
+
+//terms of a SEARCH line: words like in messages, "from:<user>" and "subject:<word>"
+//false if nothing is left to search for or there are more than SEARCH_MAX_QUERY_TERMS terms
+bool parseSearchQuery(std::string_view query, std::vector<std::string> &terms);
+
+//both append to the log and have to be called with the mailbox locked exclusively, right after the mailbox index
+void appendSearchRecord(const std::filesystem::path &mailbox, int id, const std::string &terms); //drops the log if it was stale, starts it with the first message of a mailbox
+void appendSearchDeletions(const std::filesystem::path &mailbox, const std::vector<int> &ids);
+
+//called by the scan of a rebuild for every message of the mailbox, file is only valid during the call
+typedef std::function<void(int id, int file, off_t offset, size_t length)> MessageVisitor;
+
+//message-ids in ascending order of the messages that contain all terms, takes the mailbox lock itself
+//a stale index is rebuilt with scan() (which passes every message to the visitor) and a large log is merged,
+//both under the exclusive lock; false on error
+bool searchMailbox(const std::filesystem::path &mailbox, const std::string &username, const std::vector<std::string> &terms,
+    std::vector<int> &ids, const std::function<void(const MessageVisitor &)> &scan);
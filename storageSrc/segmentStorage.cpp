@@ -0,0 +1,769 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include "segmentStorage.h"
+#include "../logSrc/log.h"
+#include "mailboxIndex.h"
+#include "searchIndex.h"
+#include "lock.h"
+
+namespace fs = std::filesystem;
+
+//FNV-1a, hash can be passed in to continue over several blocks
+static uint32_t checksum(const char *data, size_t length, uint32_t hash = 2166136261u){
+    for(size_t i = 0; i < length; i++){
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+SegmentStorage::SegmentStorage(const std::string &dataDirectory) : Storage(dataDirectory){
+    segmentsDirectory = fs::path(dataDirectory) / "segments";
+    create_directory(segmentsDirectory); //ok to use even if directory already exists
+}
+
+int SegmentStorage::deliver(const std::string &receiver, const std::string &sender, const std::string &subject, std::string_view message){
+
+    fs::path mailbox = segmentsDirectory / receiver;
+    std::string terms = messageTerms(message);
+
+    int lockFile = lock(mailboxLock(receiver), LOCK_EX);
+    if(lockFile == -1){
+        return -1;
+    }
+
+    create_directory(mailbox); //ok to use even if directory already exists
+
+    IndexEntry entry;
+    entry.id = nextMessageId(mailbox);
+    entry.size = (long)message.length();
+    entry.timestamp = (long)time(NULL);
+    entry.sender = sender;
+    entry.subject = subject;
+
+    SegmentRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = SEGMENT_MESSAGE;
+    header.id = entry.id;
+    header.timestamp = entry.timestamp;
+
+    //segment first, then offsets and index: a crash in between leaves the index behind the counter, which triggers a rebuild
+    SegmentLocation location;
+    if(!appendRecord(mailbox, header, message, location) || !appendLocation(mailbox, location)){
+        unlock(lockFile);
+        return -1;
+    }
+
+    appendIndexRecord(mailbox, entry);
+    appendSearchRecord(mailbox, entry.id, terms);
+
+    unlock(lockFile);
+
+    return entry.id;
+}
+
+int SegmentStorage::commit(StagedMessage &message, const std::string &receiver){
+
+    fs::path mailbox = segmentsDirectory / receiver;
+
+    //length of a record is 32 bits
+    if(message.length > UINT32_MAX){
+        return -1;
+    }
+
+    if(message.searchTerms.empty()){
+        message.searchTerms = messageFileTerms(message.file, 0, message.length);
+    }
+
+    int lockFile = lock(mailboxLock(receiver), LOCK_EX);
+    if(lockFile == -1){
+        return -1;
+    }
+
+    create_directory(mailbox); //ok to use even if directory already exists
+
+    IndexEntry entry;
+    entry.id = nextMessageId(mailbox);
+    entry.size = (long)message.length;
+    entry.timestamp = (long)time(NULL);
+    entry.sender = message.sender;
+    entry.subject = message.subject;
+
+    SegmentRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = SEGMENT_MESSAGE;
+    header.id = entry.id;
+    header.timestamp = entry.timestamp;
+
+    SegmentLocation location;
+    if(!appendRecordFromFile(mailbox, header, message.file, message.length, location) || !appendLocation(mailbox, location)){
+        unlock(lockFile);
+        return -1;
+    }
+
+    appendIndexRecord(mailbox, entry);
+    appendSearchRecord(mailbox, entry.id, message.searchTerms);
+
+    unlock(lockFile);
+
+    return entry.id;
+}
+
+bool SegmentStorage::list(const std::string &username, std::vector<IndexEntry> &entries){
+
+    fs::path mailbox = segmentsDirectory / username;
+
+    return loadIndex(mailbox, username, entries, [this, &mailbox](){ rebuild(mailbox); });
+}
+
+void SegmentStorage::openMessages(const std::string &username, const std::vector<int> &ids, std::vector<MessageFile> &files){
+
+    fs::path mailbox = segmentsDirectory / username;
+
+    files.assign(ids.size(), MessageFile());
+
+    int lockFile = lock(mailboxLock(username), LOCK_SH);
+    if(lockFile == -1){
+        return;
+    }
+
+    if(!fs::exists(mailbox)){
+        unlock(lockFile);
+        return;
+    }
+
+    //offsets may be missing the latest messages after a crash
+    if(!indexIsCurrent(mailbox)){
+        unlock(lockFile);
+        lockFile = lock(mailboxLock(username), LOCK_EX);
+        if(lockFile == -1){
+            return;
+        }
+        if(!indexIsCurrent(mailbox)){
+            rebuild(mailbox);
+        }
+    }
+
+    std::vector<SegmentLocation> locations = findMessages(mailbox, ids);
+
+    for(size_t i = 0; i < ids.size(); i++){
+        if(locations[i].length == 0){
+            continue;
+        }
+
+        int segmentFile = ::open(segmentPath(mailbox, locations[i].segment).string().c_str(), O_RDONLY | O_CLOEXEC);
+        if(segmentFile == -1){
+            logErrno("open segment");
+            continue;
+        }
+
+        files[i].file = segmentFile;
+        files[i].offset = locations[i].offset + sizeof(SegmentRecordHeader);
+        files[i].length = locations[i].length;
+    }
+
+    unlock(lockFile);
+}
+
+void SegmentStorage::removeMessages(const std::string &username, const std::vector<int> &ids, std::vector<bool> &removed){
+
+    fs::path mailbox = segmentsDirectory / username;
+
+    removed.assign(ids.size(), false);
+
+    int lockFile = lock(mailboxLock(username), LOCK_EX);
+    if(lockFile == -1){
+        return;
+    }
+
+    if(!fs::exists(mailbox)){
+        unlock(lockFile);
+        return;
+    }
+
+    if(!indexIsCurrent(mailbox)){
+        rebuild(mailbox);
+    }
+
+    std::vector<SegmentLocation> locations = findMessages(mailbox, ids);
+    std::vector<SegmentRecordHeader> headers;
+    std::vector<int> deleted;
+
+    for(size_t i = 0; i < ids.size(); i++){
+        //the same id twice in one batch is only deleted once
+        if(locations[i].length == 0 || std::find(deleted.begin(), deleted.end(), ids[i]) != deleted.end()){
+            continue;
+        }
+
+        SegmentRecordHeader header;
+        memset(&header, 0, sizeof(header));
+        header.type = SEGMENT_TOMBSTONE;
+        header.id = ids[i];
+        header.timestamp = time(NULL);
+        headers.push_back(header);
+        deleted.push_back(ids[i]);
+    }
+
+    //all tombstones go into the active segment with one write, and into the offsets file with another
+    if(!appendTombstones(mailbox, headers)){
+        unlock(lockFile);
+        return;
+    }
+
+    std::vector<SegmentLocation> tombstones(deleted.size());
+    for(size_t i = 0; i < deleted.size(); i++){
+        memset(&tombstones[i], 0, sizeof(SegmentLocation));
+        tombstones[i].id = deleted[i];
+    }
+    for(size_t i = 0; i < ids.size(); i++){
+        removed[i] = std::find(deleted.begin(), deleted.end(), ids[i]) != deleted.end();
+    }
+
+    appendLocations(mailbox, tombstones);
+    appendIndexDeletions(mailbox, deleted);
+    appendSearchDeletions(mailbox, deleted);
+
+    unlock(lockFile);
+}
+
+bool SegmentStorage::search(const std::string &username, const std::vector<std::string> &terms, std::vector<int> &ids){
+
+    fs::path mailbox = segmentsDirectory / username;
+
+    return searchMailbox(mailbox, username, terms, ids, [this, &mailbox](const MessageVisitor &visit){
+        //offsets may be missing the latest messages after a crash
+        if(!indexIsCurrent(mailbox)){
+            rebuild(mailbox);
+        }
+
+        //locations are sorted by id, so most of them are in the same segment as the one before
+        int segmentFile = -1;
+        uint32_t openSegment = 0;
+        for(auto const &location : readLocations(mailbox)){
+            if(segmentFile == -1 || location.segment != openSegment){
+                if(segmentFile != -1){
+                    close(segmentFile);
+                }
+                openSegment = location.segment;
+                segmentFile = ::open(segmentPath(mailbox, openSegment).string().c_str(), O_RDONLY | O_CLOEXEC);
+                if(segmentFile == -1){
+                    logErrno("open segment");
+                    continue;
+                }
+            }
+            visit(location.id, segmentFile, location.offset + sizeof(SegmentRecordHeader), location.length);
+        }
+        if(segmentFile != -1){
+            close(segmentFile);
+        }
+    });
+}
+
+void SegmentStorage::compact(){
+
+    std::vector<std::string> usernames;
+    for(auto const &mailbox : fs::directory_iterator(segmentsDirectory)){
+        if(mailbox.is_directory()){
+            usernames.push_back(mailbox.path().filename().string());
+        }
+    }
+
+    for(auto const &username : usernames){
+        compactMailbox(username);
+    }
+}
+
+void SegmentStorage::compactMailbox(const std::string &username){
+
+    fs::path mailbox = segmentsDirectory / username;
+
+    int lockFile = lock(mailboxLock(username), LOCK_EX);
+    if(lockFile == -1){
+        return;
+    }
+
+    if(!indexIsCurrent(mailbox)){
+        rebuild(mailbox);
+    }
+
+    std::vector<uint32_t> segments = listSegments(mailbox);
+    std::vector<SegmentLocation> locations = readLocations(mailbox);
+
+    uint64_t totalBytes = 0;
+    for(uint32_t segment : segments){
+        std::error_code error;
+        uintmax_t size = fs::file_size(segmentPath(mailbox, segment), error);
+        totalBytes += error ? 0 : size;
+    }
+
+    uint64_t liveBytes = 0;
+    for(auto const &location : locations){
+        liveBytes += sizeof(SegmentRecordHeader) + location.length;
+    }
+
+    //nothing to gain, deleted messages take up less space than the live ones
+    if(segments.empty() || liveBytes > totalBytes || totalBytes - liveBytes < COMPACTION_MIN_GARBAGE || totalBytes - liveBytes < liveBytes){
+        unlock(lockFile);
+        return;
+    }
+
+    uint32_t newSegment = segments.back() + 1;
+    int newSegmentFile = ::open(segmentPath(mailbox, newSegment).string().c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if(newSegmentFile == -1){
+        logErrno("open segment");
+        unlock(lockFile);
+        return;
+    }
+
+    //copy live records, tombstones and deleted messages are left behind
+    std::vector<char> buffer;
+    uint64_t newOffset = 0;
+    bool success = true;
+    for(auto &location : locations){
+        size_t recordSize = sizeof(SegmentRecordHeader) + location.length;
+        buffer.resize(recordSize);
+
+        int segmentFile = ::open(segmentPath(mailbox, location.segment).string().c_str(), O_RDONLY | O_CLOEXEC);
+        success = segmentFile != -1 && pread(segmentFile, buffer.data(), recordSize, location.offset) == (ssize_t)recordSize;
+        if(segmentFile != -1){
+            close(segmentFile);
+        }
+        success = success && write(newSegmentFile, buffer.data(), recordSize) == (ssize_t)recordSize;
+        if(!success){
+            break;
+        }
+
+        location.segment = newSegment;
+        location.offset = newOffset;
+        newOffset += recordSize;
+    }
+
+    //new segment has to be on disk before the old ones are gone
+    success = success && fsync(newSegmentFile) == 0;
+    close(newSegmentFile);
+
+    if(!success){
+        logErrno("compaction");
+        fs::remove(segmentPath(mailbox, newSegment));
+        unlock(lockFile);
+        return;
+    }
+
+    writeLocations(mailbox, locations);
+
+    for(uint32_t segment : segments){
+        fs::remove(segmentPath(mailbox, segment));
+    }
+
+    unlock(lockFile);
+
+    logInfo("Compacted mailbox %s: %llu -> %llu bytes", username.c_str(), (unsigned long long)totalBytes, (unsigned long long)newOffset);
+}
+
+int SegmentStorage::nextMessageId(const fs::path &mailbox){
+
+    int messageId = readSequence(mailbox);
+
+    //counter is missing or behind the offsets (e.g. lost after a crash) -> rebuild everything from the segments
+    std::vector<SegmentLocation> lastLocation(1);
+    int offsetsFile = ::open((mailbox / SEGMENT_OFFSETS_FILE).string().c_str(), O_RDONLY | O_CLOEXEC);
+    if(offsetsFile != -1){
+        off_t end = lseek(offsetsFile, 0, SEEK_END);
+        if(end < (off_t)sizeof(SegmentLocation) || pread(offsetsFile, lastLocation.data(), sizeof(SegmentLocation), end - sizeof(SegmentLocation)) != sizeof(SegmentLocation)){
+            lastLocation[0].id = 0;
+        }
+        close(offsetsFile);
+    } else {
+        lastLocation[0].id = 0;
+    }
+
+    if(messageId == -1 || (int)lastLocation[0].id > messageId){
+        rebuild(mailbox);
+        messageId = readSequence(mailbox);
+    }
+
+    messageId++;
+    writeSequence(mailbox, messageId);
+
+    return messageId;
+}
+
+int SegmentStorage::openActiveSegment(const fs::path &mailbox, uint32_t &segment, off_t &offset){
+
+    std::vector<uint32_t> segments = listSegments(mailbox);
+    segment = segments.empty() ? 1 : segments.back();
+
+    std::error_code error;
+    if(!segments.empty() && fs::file_size(segmentPath(mailbox, segment), error) >= SEGMENT_MAX_SIZE){
+        segment++;
+    }
+
+    int segmentFile = ::open(segmentPath(mailbox, segment).string().c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if(segmentFile == -1){
+        logErrno("open segment");
+        return -1;
+    }
+
+    //only one writer per mailbox (exclusive lock), so the current end is where the record goes
+    offset = lseek(segmentFile, 0, SEEK_END);
+    if(offset == -1){
+        logErrno("lseek segment");
+        close(segmentFile);
+        return -1;
+    }
+
+    return segmentFile;
+}
+
+bool SegmentStorage::appendRecord(const fs::path &mailbox, SegmentRecordHeader &header, std::string_view message, SegmentLocation &location){
+
+    uint32_t segment;
+    off_t offset;
+    int segmentFile = openActiveSegment(mailbox, segment, offset);
+    if(segmentFile == -1){
+        return false;
+    }
+
+    header.magic = SEGMENT_MAGIC;
+    header.length = message.length();
+    header.checksum = checksum(message.data(), message.length());
+
+    struct iovec parts[2];
+    parts[0].iov_base = &header;
+    parts[0].iov_len = sizeof(header);
+    parts[1].iov_base = (void *)message.data();
+    parts[1].iov_len = message.length();
+
+    ssize_t recordSize = sizeof(header) + message.length();
+    ssize_t bytesWritten = pwritev(segmentFile, parts, 2, offset);
+    close(segmentFile);
+
+    if(bytesWritten != recordSize){
+        logErrno("write segment");
+        return false;
+    }
+
+    memset(&location, 0, sizeof(location));
+    location.id = header.id;
+    location.segment = segment;
+    location.offset = offset;
+    location.length = header.length;
+
+    return true;
+}
+
+bool SegmentStorage::appendRecordFromFile(const fs::path &mailbox, SegmentRecordHeader &header, int file, size_t length, SegmentLocation &location){
+
+    uint32_t segment;
+    off_t offset;
+    int segmentFile = openActiveSegment(mailbox, segment, offset);
+    if(segmentFile == -1){
+        return false;
+    }
+
+    //message first, header last: until the header is written the record is a torn write that rebuild() cuts off
+    std::vector<char> buffer(SEGMENT_COPY_SIZE);
+    uint32_t hash = 2166136261u;
+    size_t copied = 0;
+    bool success = true;
+    while(success && copied < length){
+        ssize_t bytesRead = pread(file, buffer.data(), std::min(buffer.size(), length - copied), copied);
+        success = bytesRead > 0 && pwrite(segmentFile, buffer.data(), bytesRead, offset + sizeof(header) + copied) == bytesRead;
+        if(success){
+            hash = checksum(buffer.data(), bytesRead, hash);
+            copied += bytesRead;
+        }
+    }
+
+    header.magic = SEGMENT_MAGIC;
+    header.length = length;
+    header.checksum = hash;
+
+    success = success && pwrite(segmentFile, &header, sizeof(header), offset) == sizeof(header);
+    close(segmentFile);
+
+    if(!success){
+        logErrno("write segment");
+        return false;
+    }
+
+    memset(&location, 0, sizeof(location));
+    location.id = header.id;
+    location.segment = segment;
+    location.offset = offset;
+    location.length = header.length;
+
+    return true;
+}
+
+bool SegmentStorage::appendTombstones(const fs::path &mailbox, std::vector<SegmentRecordHeader> &headers){
+
+    if(headers.empty()){
+        return true;
+    }
+
+    uint32_t segment;
+    off_t offset;
+    int segmentFile = openActiveSegment(mailbox, segment, offset);
+    if(segmentFile == -1){
+        return false;
+    }
+
+    //a tombstone is only a header, so the headers are the records and lie next to each other in memory
+    for(SegmentRecordHeader &header : headers){
+        header.magic = SEGMENT_MAGIC;
+        header.length = 0;
+        header.checksum = checksum(NULL, 0);
+    }
+
+    ssize_t recordsSize = headers.size() * sizeof(SegmentRecordHeader);
+    ssize_t bytesWritten = pwrite(segmentFile, headers.data(), recordsSize, offset);
+    close(segmentFile);
+
+    if(bytesWritten != recordsSize){
+        logErrno("write segment");
+        return false;
+    }
+
+    return true;
+}
+
+bool SegmentStorage::appendLocation(const fs::path &mailbox, const SegmentLocation &location){
+    return appendLocations(mailbox, std::vector<SegmentLocation>{location});
+}
+
+bool SegmentStorage::appendLocations(const fs::path &mailbox, const std::vector<SegmentLocation> &locations){
+
+    if(locations.empty()){
+        return true;
+    }
+
+    int offsetsFile = ::open((mailbox / SEGMENT_OFFSETS_FILE).string().c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(offsetsFile == -1){
+        logErrno("open offsets");
+        return false;
+    }
+
+    ssize_t size = locations.size() * sizeof(SegmentLocation);
+    bool success = write(offsetsFile, locations.data(), size) == size;
+    close(offsetsFile);
+
+    return success;
+}
+
+std::vector<SegmentLocation> SegmentStorage::findMessages(const fs::path &mailbox, const std::vector<int> &ids){
+
+    std::vector<SegmentLocation> locations(ids.size());
+
+    //one message: scanning the offsets backwards is cheaper than reading all of them
+    if(ids.size() == 1){
+        if(!findMessage(mailbox, ids[0], locations[0])){
+            memset(&locations[0], 0, sizeof(SegmentLocation));
+        }
+        return locations;
+    }
+
+    std::vector<SegmentLocation> live = readLocations(mailbox);
+    for(size_t i = 0; i < ids.size(); i++){
+        auto it = std::lower_bound(live.begin(), live.end(), ids[i], [](const SegmentLocation &location, int id){ return (int)location.id < id; });
+        if(it != live.end() && (int)it->id == ids[i]){
+            locations[i] = *it;
+        } else {
+            memset(&locations[i], 0, sizeof(SegmentLocation));
+        }
+    }
+
+    return locations;
+}
+
+bool SegmentStorage::findMessage(const fs::path &mailbox, int id, SegmentLocation &location){
+
+    int offsetsFile = ::open((mailbox / SEGMENT_OFFSETS_FILE).string().c_str(), O_RDONLY | O_CLOEXEC);
+    if(offsetsFile == -1){
+        return false;
+    }
+
+    struct stat offsetsStat;
+    if(fstat(offsetsFile, &offsetsStat) == -1 || offsetsStat.st_size < (off_t)sizeof(SegmentLocation)){
+        close(offsetsFile);
+        return false;
+    }
+
+    size_t numberOfLocations = offsetsStat.st_size / sizeof(SegmentLocation);
+    void *mapping = mmap(NULL, numberOfLocations * sizeof(SegmentLocation), PROT_READ, MAP_PRIVATE, offsetsFile, 0);
+    close(offsetsFile);
+    if(mapping == MAP_FAILED){
+        logErrno("mmap");
+        return false;
+    }
+
+    //newest record first, it decides whether the message still exists
+    const SegmentLocation *locations = (const SegmentLocation *)mapping;
+    bool found = false;
+    for(size_t i = numberOfLocations; i > 0; i--){
+        if((int)locations[i - 1].id == id){
+            location = locations[i - 1];
+            found = location.length > 0;
+            break;
+        }
+    }
+
+    munmap(mapping, numberOfLocations * sizeof(SegmentLocation));
+
+    return found;
+}
+
+std::vector<SegmentLocation> SegmentStorage::readLocations(const fs::path &mailbox){
+
+    std::map<uint32_t, SegmentLocation> latest;
+
+    std::ifstream offsetsFile(mailbox / SEGMENT_OFFSETS_FILE, std::ios::binary);
+    SegmentLocation location;
+    while(offsetsFile.read((char *)&location, sizeof(location))){
+        if(location.length > 0){
+            latest[location.id] = location;
+        } else {
+            latest.erase(location.id);
+        }
+    }
+
+    std::vector<SegmentLocation> locations;
+    for(auto const &entry : latest){
+        locations.push_back(entry.second);
+    }
+
+    return locations;
+}
+
+void SegmentStorage::writeLocations(const fs::path &mailbox, const std::vector<SegmentLocation> &locations){
+
+    fs::path temporaryFile = mailbox / SEGMENT_OFFSETS_FILE ".tmp";
+    std::ofstream offsetsFile(temporaryFile, std::ios::binary | std::ios::trunc);
+    offsetsFile.write((const char *)locations.data(), locations.size() * sizeof(SegmentLocation));
+    offsetsFile.close();
+
+    fs::rename(temporaryFile, mailbox / SEGMENT_OFFSETS_FILE);
+}
+
+std::vector<uint32_t> SegmentStorage::listSegments(const fs::path &mailbox){
+
+    std::vector<uint32_t> segments;
+
+    for(auto const &file : fs::directory_iterator(mailbox)){
+        if(file.path().extension() == ".seg" && isMessageId(file.path().stem().string())){
+            segments.push_back(std::stoul(file.path().stem().string()));
+        }
+    }
+
+    std::sort(segments.begin(), segments.end());
+
+    return segments;
+}
+
+fs::path SegmentStorage::segmentPath(const fs::path &mailbox, uint32_t segment){
+    char filename[32];
+    snprintf(filename, sizeof(filename), "%06u.seg", segment);
+    return mailbox / filename;
+}
+
+void SegmentStorage::rebuild(const fs::path &mailbox){
+
+    std::map<uint32_t, std::pair<SegmentLocation, IndexEntry>> live;
+    int highestId = 0;
+
+    std::vector<uint32_t> segments = listSegments(mailbox);
+    if(!segments.empty()){
+        logInfo("Rebuilding mailbox %s from segments", mailbox.filename().string().c_str());
+    }
+    std::vector<char> message;
+
+    for(size_t i = 0; i < segments.size(); i++){
+
+        int segmentFile = ::open(segmentPath(mailbox, segments[i]).string().c_str(), O_RDWR | O_CLOEXEC);
+        if(segmentFile == -1){
+            logErrno("open segment");
+            continue;
+        }
+
+        off_t segmentSize = lseek(segmentFile, 0, SEEK_END);
+        off_t offset = 0;
+        SegmentRecordHeader header;
+
+        while(offset + (off_t)sizeof(header) <= segmentSize){
+
+            if(pread(segmentFile, &header, sizeof(header), offset) != sizeof(header) || header.magic != SEGMENT_MAGIC || offset + (off_t)sizeof(header) + header.length > segmentSize){
+                break;
+            }
+
+            message.resize(header.length);
+            if(pread(segmentFile, message.data(), header.length, offset + sizeof(header)) != (ssize_t)header.length || checksum(message.data(), header.length) != header.checksum){
+                break;
+            }
+
+            highestId = std::max(highestId, (int)header.id);
+
+            if(header.type == SEGMENT_MESSAGE){
+                SegmentLocation location;
+                memset(&location, 0, sizeof(location));
+                location.id = header.id;
+                location.segment = segments[i];
+                location.offset = offset;
+                location.length = header.length;
+
+                //sender and subject are the first and third line of the message
+                IndexEntry entry;
+                entry.id = header.id;
+                entry.size = header.length;
+                entry.timestamp = header.timestamp;
+                std::string content(message.data(), message.size());
+                size_t senderEnd = content.find('\n');
+                size_t receiverEnd = senderEnd == std::string::npos ? std::string::npos : content.find('\n', senderEnd + 1);
+                size_t subjectEnd = receiverEnd == std::string::npos ? std::string::npos : content.find('\n', receiverEnd + 1);
+                entry.sender = content.substr(0, senderEnd);
+                entry.subject = receiverEnd == std::string::npos ? "" : content.substr(receiverEnd + 1, subjectEnd == std::string::npos ? std::string::npos : subjectEnd - receiverEnd - 1);
+
+                live[header.id] = std::make_pair(location, entry);
+            } else {
+                live.erase(header.id);
+            }
+
+            offset += sizeof(header) + header.length;
+        }
+
+        //a torn record at the end of the active segment is cut off, so new records follow a valid one
+        if(offset < segmentSize && i == segments.size() - 1){
+            logWarn("Truncating damaged end of segment %u", segments[i]);
+            if(ftruncate(segmentFile, offset) == -1){
+                logErrno("ftruncate");
+            }
+        }
+
+        close(segmentFile);
+    }
+
+    std::vector<SegmentLocation> locations;
+    std::vector<IndexEntry> entries;
+    for(auto const &message : live){
+        locations.push_back(message.second.first);
+        entries.push_back(message.second.second);
+    }
+
+    //counter must never hand out an id that is already in a segment
+    int lastId = std::max(readSequence(mailbox), highestId);
+    writeSequence(mailbox, lastId);
+    writeLocations(mailbox, locations);
+    writeIndex(mailbox, entries, lastId);
+}
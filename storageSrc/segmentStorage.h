@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+#include "storage.h"
+
+//log-structured backend: messages of a mailbox are appended to segment files under segments/<user>/<number>.seg
+//DEL appends a tombstone instead of removing anything, compact() later copies the live messages into a new
+//segment and drops the old ones. An offsets file maps message-ids to their position in the segments,
+//counter and index files are the same as in the directory backend.
+//a mailbox can be rebuilt completely from its segments, records are checksummed so a torn write at the end is detected
+
+#define SEGMENT_MAGIC 0x534d5754 //"TWMS"
+#define SEGMENT_MESSAGE 1
+#define SEGMENT_TOMBSTONE 2
+#define SEGMENT_MAX_SIZE (16 * 1024 * 1024) //start a new segment once the active one is bigger than this
+#define SEGMENT_OFFSETS_FILE "offsets"
+#define SEGMENT_COPY_SIZE (64 * 1024) //block size for copying staged messages into a segment
+#define COMPACTION_MIN_GARBAGE (1024 * 1024) //only compact mailboxes with at least this many bytes of deleted messages
+
+//header in front of every record in a segment, followed by <length> bytes of message
+struct SegmentRecordHeader {
+    uint32_t magic;
+    uint32_t type; //SEGMENT_MESSAGE or SEGMENT_TOMBSTONE
+    uint32_t id;
+    uint32_t length;
+    int64_t timestamp;
+    uint32_t checksum; //FNV-1a of the message
+    uint32_t reserved;
+};
+
+//record of the offsets file, the last record of an id wins, length 0 means deleted
+struct SegmentLocation {
+    uint32_t id;
+    uint32_t segment;
+    uint64_t offset; //offset of the record header in the segment
+    uint32_t length;
+    uint32_t reserved;
+};
+
+class SegmentStorage : public Storage {
+public:
+    SegmentStorage(const std::string &dataDirectory);
+
+    int deliver(const std::string &receiver, const std::string &sender, const std::string &subject, std::string_view message) override;
+    int commit(StagedMessage &message, const std::string &receiver) override;
+    bool list(const std::string &username, std::vector<IndexEntry> &entries) override;
+    void openMessages(const std::string &username, const std::vector<int> &ids, std::vector<MessageFile> &files) override;
+    void removeMessages(const std::string &username, const std::vector<int> &ids, std::vector<bool> &removed) override;
+    bool search(const std::string &username, const std::vector<std::string> &terms, std::vector<int> &ids) override;
+    void compact() override;
+
+private:
+    std::filesystem::path segmentsDirectory;
+
+    int nextMessageId(const std::filesystem::path &mailbox); //mailbox must be locked exclusively
+    int openActiveSegment(const std::filesystem::path &mailbox, uint32_t &segment, off_t &offset); //segment that new records are appended to and its current end
+    bool appendRecord(const std::filesystem::path &mailbox, SegmentRecordHeader &header, std::string_view message, SegmentLocation &location); //appends to the active segment
+    bool appendRecordFromFile(const std::filesystem::path &mailbox, SegmentRecordHeader &header, int file, size_t length, SegmentLocation &location); //same, copies the message from a file in blocks
+    bool appendTombstones(const std::filesystem::path &mailbox, std::vector<SegmentRecordHeader> &headers); //one write for all of them
+    bool appendLocation(const std::filesystem::path &mailbox, const SegmentLocation &location);
+    bool appendLocations(const std::filesystem::path &mailbox, const std::vector<SegmentLocation> &locations); //one write for all of them
+    bool findMessage(const std::filesystem::path &mailbox, int id, SegmentLocation &location); //latest location of a message, false if missing or deleted
+    std::vector<SegmentLocation> findMessages(const std::filesystem::path &mailbox, const std::vector<int> &ids); //location of every id, length 0 if missing or deleted
+    std::vector<SegmentLocation> readLocations(const std::filesystem::path &mailbox); //latest location of every live message, sorted by id
+    void writeLocations(const std::filesystem::path &mailbox, const std::vector<SegmentLocation> &locations); //replaces the offsets file atomically
+    std::vector<uint32_t> listSegments(const std::filesystem::path &mailbox); //segment numbers in ascending order
+    std::filesystem::path segmentPath(const std::filesystem::path &mailbox, uint32_t segment);
+    void rebuild(const std::filesystem::path &mailbox); //recreates counter, offsets and index from the segments, mailbox must be locked exclusively
+    void compactMailbox(const std::string &username);
+};
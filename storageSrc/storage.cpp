@@ -0,0 +1,144 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <filesystem>
+#include "storage.h"
+#include "../logSrc/log.h"
+#include "directoryStorage.h"
+#include "segmentStorage.h"
+
+Storage *createStorage(const std::string &type, const std::string &dataDirectory){
+
+    if(type == STORAGE_DIRECTORY){
+        return new DirectoryStorage(dataDirectory);
+    }
+
+    if(type == STORAGE_SEGMENT){
+        return new SegmentStorage(dataDirectory);
+    }
+
+    return nullptr;
+}
+
+namespace fs = std::filesystem;
+
+Storage::Storage(const std::string &dataDirectory){
+
+    stagingDirectory = fs::path(dataDirectory) / "tmp";
+
+    //messages that were staged when the server stopped can never be completed
+    std::error_code error;
+    fs::remove_all(stagingDirectory, error);
+    create_directory(stagingDirectory);
+}
+
+bool Storage::stage(const std::string &receivers, const std::string &sender, const std::string &subject, StagedMessage &message){
+
+    std::string path = (stagingDirectory / "message-XXXXXX").string();
+    int file = mkostemp(&path[0], O_CLOEXEC);
+    if(file == -1){
+        logErrno("mkostemp");
+        return false;
+    }
+
+    message.file = file;
+    message.path = path;
+    message.receivers = receivers;
+    message.sender = sender;
+    message.subject = subject;
+    message.length = 0;
+
+    std::string header = sender + "\n" + receivers + "\n" + subject + "\n";
+    if(!append(message, header.data(), header.length())){
+        discard(message);
+        return false;
+    }
+
+    return true;
+}
+
+bool Storage::append(StagedMessage &message, const char *data, size_t length){
+
+    while(length > 0){
+        ssize_t bytesWritten = write(message.file, data, length);
+        if(bytesWritten == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            logErrno("write staged message");
+            return false;
+        }
+        message.length += bytesWritten;
+        message.lastByte = data[bytesWritten - 1];
+        data += bytesWritten;
+        length -= bytesWritten;
+    }
+
+    return true;
+}
+
+void Storage::discard(StagedMessage &message){
+
+    if(message.file != -1){
+        close(message.file);
+        unlink(message.path.c_str());
+    }
+
+    message = StagedMessage();
+}
+
+bool Storage::open(const std::string &username, int id, MessageFile &messageFile){
+
+    std::vector<MessageFile> files;
+    openMessages(username, std::vector<int>{id}, files);
+    messageFile = files[0];
+
+    return messageFile.file != -1;
+}
+
+bool Storage::remove(const std::string &username, int id){
+
+    std::vector<bool> removed;
+    removeMessages(username, std::vector<int>{id}, removed);
+
+    return removed[0];
+}
+
+bool Storage::read(const std::string &username, int id, std::string &message){
+
+    MessageFile messageFile;
+    if(!open(username, id, messageFile)){
+        return false;
+    }
+
+    message.resize(messageFile.length);
+    size_t bytesRead = 0;
+    while(bytesRead < messageFile.length){
+        ssize_t result = pread(messageFile.file, &message[bytesRead], messageFile.length - bytesRead, messageFile.offset + bytesRead);
+        if(result <= 0){
+            break;
+        }
+        bytesRead += result;
+    }
+    close(messageFile.file);
+
+    return bytesRead == messageFile.length;
+}
+
+bool isMessageId(const std::string &filename){
+
+    if(filename.empty() || filename.length() > 9){ //max. 9 digits, so the id always fits into an int
+        return false;
+    }
+
+    for(char c : filename){
+        if(c < '0' || c > '9'){
+            return false;
+        }
+    }
+
+    return true;
+}
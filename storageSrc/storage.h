@@ -0,0 +1,101 @@
+#pragma once
+
+#include <sys/types.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+
+//summary of one message, as returned by LIST
+struct IndexEntry {
+    int id;
+    long size; //size of the message in bytes
+    long timestamp; //time of delivery in seconds since epoch
+    std::string sender;
+    std::string subject;
+    std::string hash; //content hash of backends that store messages by it (blobStore.h), empty if unknown
+};
+
+//region of an open file that holds a message, the file descriptor belongs to whoever gets it
+//the region stays readable after the mailbox lock is released: files are never changed in place, only unlinked
+struct MessageFile {
+    int file = -1;
+    off_t offset = 0;
+    size_t length = 0;
+};
+
+//message that is written to a temporary file while it is received (large SEND bodies), see Storage::stage()
+//the file already holds the complete message ("<sender>\n<receivers>\n<subject>\n<body>"), so backends can move it into place
+struct StagedMessage {
+    int file = -1;
+    std::string path;
+    std::string receivers;
+    std::string sender;
+    std::string subject;
+    size_t length = 0; //bytes written so far, including the header lines
+    char lastByte = 0;
+    std::string contentHash; //set by backends that address content by hash, computed once for all receivers
+    std::string searchTerms; //terms for the search index (searchIndex.h), computed once for all receivers
+};
+
+//interface of the storage backends, every backend takes the mailbox locks itself
+//messages are stored as "<sender>\n<receivers>\n<subject>\n<body>" and READ returns exactly these bytes,
+//<receivers> is the comma-separated list of everyone the message was sent to (usually just one username)
+class Storage {
+public:
+    Storage(const std::string &dataDirectory); //creates the staging directory <dataDirectory>/tmp and removes leftovers of earlier runs
+    virtual ~Storage() {}
+
+    //stores a complete message (header lines and body) in the mailbox of receiver, sender and subject are for the index
+    //returns the new message-id or -1 on error
+    virtual int deliver(const std::string &receiver, const std::string &sender, const std::string &subject, std::string_view message) = 0;
+
+    //creates a temporary file for a message that is too large to be kept in memory and writes the header lines to it
+    bool stage(const std::string &receivers, const std::string &sender, const std::string &subject, StagedMessage &message);
+
+    //appends part of the body to a staged message
+    bool append(StagedMessage &message, const char *data, size_t length);
+
+    //stores a staged message in the mailbox of receiver, can be called once for every receiver
+    //returns the new message-id or -1 on error, the temporary file stays until discard()
+    virtual int commit(StagedMessage &message, const std::string &receiver) = 0;
+
+    //removes the temporary file of a staged message (after commit() or if it will not be delivered)
+    void discard(StagedMessage &message);
+
+    //all messages of a mailbox in order of their message-id, false on error
+    virtual bool list(const std::string &username, std::vector<IndexEntry> &entries) = 0;
+
+    //opens messages of one mailbox for reading without copying them (e.g. for sendfile()), all under one lock
+    //files[i] belongs to ids[i] and has no file (-1) if that message does not exist
+    virtual void openMessages(const std::string &username, const std::vector<int> &ids, std::vector<MessageFile> &files) = 0;
+
+    //same for one message, false if it does not exist
+    bool open(const std::string &username, int id, MessageFile &messageFile);
+
+    //content of one message, false if it does not exist
+    virtual bool read(const std::string &username, int id, std::string &message);
+
+    //deletes messages of one mailbox under one lock, removed[i] is false if ids[i] did not exist
+    virtual void removeMessages(const std::string &username, const std::vector<int> &ids, std::vector<bool> &removed) = 0;
+
+    //same for one message, false if it does not exist
+    bool remove(const std::string &username, int id);
+
+    //ids of the messages of a mailbox that contain all terms (see parseSearchQuery() in searchIndex.h), in ascending order
+    //answered from the search index of the mailbox, message files are only read to rebuild a stale index; false on error
+    virtual bool search(const std::string &username, const std::vector<std::string> &terms, std::vector<int> &ids) = 0;
+
+    //periodic maintenance (e.g. compaction), called from a background thread
+    virtual void compact() {}
+
+protected:
+    std::filesystem::path stagingDirectory; //same file system as the mailboxes, so staged messages can be renamed into place
+};
+
+#define STORAGE_DIRECTORY "directory" //one file per message under messages/<user>/<id> (default)
+#define STORAGE_SEGMENT "segment" //append-only segment files under segments/<user>/
+
+Storage *createStorage(const std::string &type, const std::string &dataDirectory); //nullptr if type is unknown
+
+bool isMessageId(const std::string &filename); //true if filename is a message-id (only digits), skips counter and other metadata files
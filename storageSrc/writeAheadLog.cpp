@@ -0,0 +1,813 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <filesystem>
+#include "writeAheadLog.h"
+#include "../logSrc/log.h"
+
+namespace fs = std::filesystem;
+
+//an lsn is the generation of the log file in the upper bits and the offset in that file in the lower ones,
+//so lsns grow over all files and never repeat, not even across restarts (generations are never reused)
+#define WAL_GENERATION_SHIFT 40
+#define WAL_OFFSET_MASK ((1ull << WAL_GENERATION_SHIFT) - 1)
+
+#define WAL_MAX_COPIES 64 //staged messages copied with the log unlocked at the same time, more wait for the lock like small ones
+#define WAL_MAX_OWNERS 1024 //processes with unfinished messages at the same time, more wait until one of them is done
+
+//space of a staged message that is being copied into the log
+struct WalCopy {
+    uint64_t lsn; //of the record, 0 if the slot is free
+    pid_t process;
+};
+
+//logged messages of one process whose deliveries are not finished yet, they are dropped when the process exits
+//(a client process can die between logMessage() and finishMessage(), it would hold back the previous file forever)
+struct WalOwner {
+    pid_t process; //0 if the slot is free
+    uint64_t unfinished[2]; //per generation (index generation % 2)
+};
+
+//state of the log, in shared memory so that the client processes of fork mode share it as well as the worker threads
+struct WalState {
+    pthread_mutex_t mutex; //process-shared and robust (a client process can die while it holds it), guards everything below
+    pthread_cond_t synced; //broadcast whenever a sync or a copy is done or an owner slot is freed
+    uint64_t generation; //of the current log file, records are only appended to it
+    uint64_t fileEnd; //bytes in the current log file
+    uint64_t durable; //lsn up to which the log is on disk
+    bool syncing; //a process is syncing the log, the others wait for it
+    pid_t syncingProcess;
+    bool previousPending; //file of generation - 1 still exists, no new file is started until it is removed
+    bool removingPrevious;
+    WalCopy copies[WAL_MAX_COPIES]; //no file is started while a copy is running, it goes into the current one
+    WalOwner owners[WAL_MAX_OWNERS];
+};
+
+static WalState *state = NULL;
+static int durabilityLevel = WAL_NONE;
+static fs::path dataPath;
+static fs::path walDirectory;
+
+//descriptor of the current log file in this process, a forked child keeps the one of its parent
+static int logFile = -1;
+static uint64_t logFileGeneration = 0;
+
+static fs::path logFilePath(uint64_t generation);
+static std::vector<uint64_t> logFileGenerations(); //of all log files in the directory, in ascending order
+static bool syncDirectory(const fs::path &directory);
+static bool writeAll(int file, const char *data, size_t length, off_t offset);
+static uint32_t checksum(const char *data, size_t length, uint32_t hash = 2166136261u);
+
+static void lockState();
+static void unlockState();
+static bool openCurrentFile(); //log has to be locked
+static bool startNextFile(); //log has to be locked
+static bool prepareFile(); //rotates and opens the current file before a record is appended, log has to be locked
+static long long appendRecord(uint32_t type, std::string_view data, const StagedMessage *staged, uint64_t &recordEnd); //log has to be locked
+static long long reserveRecord(size_t length, int copy, uint64_t &recordEnd); //space for a record that is copied with the log unlocked, log has to be locked
+static bool copyStagedMessage(int file, const StagedMessage &message, off_t offset, uint32_t &hash); //data of a record, returns its checksum in hash
+static uint64_t syncTarget(); //lsn up to which the log is completely written, log has to be locked
+static WalOwner *findOwner(pid_t process); //slot of a process, NULL if it has no unfinished messages, log has to be locked
+static WalOwner *claimOwner(); //slot of this process for a message that is about to be logged, log has to be locked
+static void releaseOwner(WalOwner *owner); //frees the slot if the process has no unfinished messages left, log has to be locked
+static int waitForChange(); //waits for a sync, copy or freed owner slot, log has to be locked
+static bool waitDurable(uint64_t lsn); //log has to be locked, is unlocked while the log is synced
+static void removePreviousIfDone(); //removes the previous log file once all its messages are finished, log must not be locked
+
+int parseDurability(const char *name){
+
+    if(strcmp(name, "none") == 0){
+        return WAL_NONE;
+    }
+    if(strcmp(name, "batched") == 0){
+        return WAL_BATCHED;
+    }
+    if(strcmp(name, "per-message") == 0){
+        return WAL_PER_MESSAGE;
+    }
+    return -1;
+}
+
+bool initWriteAheadLog(const std::string &dataDirectory, int durability){
+
+    durabilityLevel = durability;
+    dataPath = dataDirectory;
+    walDirectory = dataPath / WAL_DIRECTORY;
+
+    std::error_code error;
+    create_directory(walDirectory, error); //ok to use even if directory already exists
+    if(error){
+        logError("write-ahead log directory %s: %s", walDirectory.c_str(), error.message().c_str());
+        return false;
+    }
+
+    void *mapping = mmap(NULL, sizeof(WalState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mapping == MAP_FAILED){
+        logErrno("mmap write-ahead log");
+        return false;
+    }
+    state = new (mapping) WalState();
+
+    pthread_mutexattr_t mutexAttributes;
+    pthread_mutexattr_init(&mutexAttributes);
+    pthread_mutexattr_setpshared(&mutexAttributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutexAttributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&state->mutex, &mutexAttributes);
+    pthread_mutexattr_destroy(&mutexAttributes);
+
+    pthread_condattr_t conditionAttributes;
+    pthread_condattr_init(&conditionAttributes);
+    pthread_condattr_setpshared(&conditionAttributes, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&state->synced, &conditionAttributes);
+    pthread_condattr_destroy(&conditionAttributes);
+
+    //files of earlier runs are left for replayWriteAheadLog(), this run starts a new generation
+    std::vector<uint64_t> generations = logFileGenerations();
+    state->generation = generations.empty() ? 1 : generations.back() + 1;
+    state->durable = state->generation << WAL_GENERATION_SHIFT;
+
+    if(durabilityLevel == WAL_NONE){
+        return true;
+    }
+
+    lockState();
+    bool opened = openCurrentFile();
+    unlockState();
+
+    return opened && syncDirectory(walDirectory);
+}
+
+void replayWriteAheadLog(Storage *storage){
+
+    //a logged message is applied to a receiver if it was delivered (marker) and the mailbox still has it, or if it
+    //was deleted since; everything else is delivered again, e.g. a mailbox write that was lost with the page cache
+    //a crash between a delivery and its marker delivers that message twice, which is better than never
+    struct LoggedMessage {
+        uint64_t generation;
+        off_t offset; //of the data in the file
+        uint32_t length;
+    };
+    std::map<uint64_t, LoggedMessage> messages;
+    std::map<std::pair<uint64_t, std::string>, int> delivered;
+    std::set<std::pair<std::string, int>> deleted;
+
+    std::vector<uint64_t> generations;
+    for(uint64_t generation : logFileGenerations()){
+        if(generation < state->generation){
+            generations.push_back(generation);
+        }
+    }
+    if(generations.empty()){
+        return;
+    }
+
+    std::map<uint64_t, int> files;
+    std::string data;
+    for(uint64_t generation : generations){
+        int file = open(logFilePath(generation).c_str(), O_RDONLY | O_CLOEXEC);
+        if(file == -1){
+            logErrno("open write-ahead log");
+            continue;
+        }
+        files[generation] = file;
+
+        struct stat fileStat;
+        off_t fileSize = fstat(file, &fileStat) == 0 ? fileStat.st_size : 0;
+
+        off_t offset = 0;
+        WalRecordHeader header;
+        while(pread(file, &header, sizeof(header), offset) == (ssize_t)sizeof(header)){
+
+            //a record that was not written completely when the server stopped (torn write) ends the file
+            if(header.magic != WAL_MAGIC || offset + (off_t)sizeof(header) + header.length > fileSize){
+                break;
+            }
+            if(header.type == WAL_PADDING){
+                offset += sizeof(header) + header.length;
+                continue;
+            }
+            data.resize(header.length);
+            if(pread(file, &data[0], header.length, offset + sizeof(header)) != (ssize_t)header.length
+                || checksum(data.data(), data.length()) != header.checksum){
+                break;
+            }
+
+            if(header.type == WAL_MESSAGE){
+                messages[header.lsn] = LoggedMessage{generation, (off_t)(offset + sizeof(header)), header.length};
+            } else if(header.type == WAL_DELIVERED){
+                unsigned long long lsn;
+                int id;
+                char receiver[64];
+                if(sscanf(data.c_str(), "%llu %d %63s", &lsn, &id, receiver) == 3){
+                    delivered[{lsn, receiver}] = id;
+                }
+            } else if(header.type == WAL_DELETED){
+                int id;
+                char username[64];
+                if(sscanf(data.c_str(), "%d %63s", &id, username) == 2){
+                    deleted.insert({username, id});
+                }
+            }
+
+            offset += sizeof(header) + header.length;
+        }
+    }
+
+    int replayed = 0;
+    for(auto const &[lsn, logged] : messages){
+
+        std::string message(logged.length, '\0');
+        if(pread(files[logged.generation], &message[0], logged.length, logged.offset) != (ssize_t)logged.length){
+            logErrno("read write-ahead log");
+            continue;
+        }
+
+        //"<sender>\n<receivers>\n<subject>\n<body>", the receivers are the ones send() delivers to
+        size_t senderEnd = message.find('\n');
+        size_t receiversEnd = senderEnd == std::string::npos ? senderEnd : message.find('\n', senderEnd + 1);
+        size_t subjectEnd = receiversEnd == std::string::npos ? receiversEnd : message.find('\n', receiversEnd + 1);
+        if(subjectEnd == std::string::npos){
+            continue;
+        }
+        std::string sender = message.substr(0, senderEnd);
+        std::string receivers = message.substr(senderEnd + 1, receiversEnd - senderEnd - 1);
+        std::string subject = message.substr(receiversEnd + 1, subjectEnd - receiversEnd - 1);
+
+        size_t start = 0;
+        while(start <= receivers.length()){
+            size_t end = std::min(receivers.find(',', start), receivers.length());
+            std::string receiver = receivers.substr(start, end - start);
+            start = end + 1;
+
+            auto marker = delivered.find({lsn, receiver});
+            if(marker != delivered.end()){
+                std::string stored;
+                if(deleted.count({receiver, marker->second}) > 0
+                    || (storage->read(receiver, marker->second, stored) && stored == message)){
+                    continue;
+                }
+            }
+
+            if(storage->deliver(receiver, sender, subject, message) == -1){
+                logError("Could not replay message for %s from the write-ahead log", receiver.c_str());
+                continue;
+            }
+            replayed++;
+        }
+    }
+
+    for(auto const &[generation, file] : files){
+        close(file);
+    }
+
+    //the replayed deliveries are only in the page cache, the log that repeats them is removed once they are on disk
+    int directory = open(dataPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(directory == -1 || syncfs(directory) == -1){
+        logErrno("syncfs");
+        if(directory != -1){
+            close(directory);
+        }
+        return;
+    }
+    close(directory);
+
+    for(uint64_t generation : generations){
+        unlink(logFilePath(generation).c_str());
+    }
+    syncDirectory(walDirectory);
+
+    logInfo("Replayed %d deliveries of %zu logged messages from the write-ahead log", replayed, messages.size());
+}
+
+long long logMessage(std::string_view message){
+
+    if(durabilityLevel == WAL_NONE){
+        return 0;
+    }
+
+    uint64_t recordEnd;
+    lockState();
+    WalOwner *owner = claimOwner();
+    long long lsn = appendRecord(WAL_MESSAGE, message, NULL, recordEnd);
+    if(lsn != -1){
+        owner->unfinished[((uint64_t)lsn >> WAL_GENERATION_SHIFT) % 2]++;
+    } else {
+        releaseOwner(owner);
+    }
+    bool durable = lsn != -1 && waitDurable(recordEnd);
+    unlockState();
+
+    if(lsn != -1 && !durable){
+        finishMessage(lsn);
+        return -1;
+    }
+
+    return lsn;
+}
+
+long long logStagedMessage(const StagedMessage &message){
+
+    if(durabilityLevel == WAL_NONE){
+        return 0;
+    }
+
+    //with group commit only the space of the message is reserved with the log locked, the copy runs unlocked
+    //(copying up to the max. message size would stop every other SEND); once it is written the record is marked
+    //as done so that the syncs cover it; per message nothing is shared, so there (and when WAL_MAX_COPIES copies are
+    //running already) the message is copied with the log locked
+    uint64_t recordEnd;
+    lockState();
+    WalOwner *owner = claimOwner();
+
+    int copy = -1;
+    for(int i = 0; durabilityLevel == WAL_BATCHED && i < WAL_MAX_COPIES && copy == -1; i++){
+        copy = state->copies[i].lsn == 0 ? i : -1;
+    }
+
+    long long lsn = copy == -1 ? appendRecord(WAL_MESSAGE, std::string_view(), &message, recordEnd) : reserveRecord(message.length, copy, recordEnd);
+
+    //counted before the log is unlocked, another thread of this process could free the slot meanwhile
+    if(lsn != -1){
+        owner->unfinished[((uint64_t)lsn >> WAL_GENERATION_SHIFT) % 2]++;
+    } else {
+        releaseOwner(owner);
+    }
+
+    bool copied = true;
+    if(copy != -1 && lsn != -1){
+        //a duplicate, the descriptor of this process may be replaced by another thread while the log is unlocked
+        int file = dup(logFile);
+        unlockState();
+
+        WalRecordHeader header;
+        header.magic = WAL_MAGIC;
+        header.type = WAL_MESSAGE;
+        header.lsn = lsn;
+        header.length = message.length;
+        off_t offset = lsn & WAL_OFFSET_MASK;
+        copied = file != -1 && copyStagedMessage(file, message, offset + sizeof(header), header.checksum)
+            && writeAll(file, (const char *)&header, sizeof(header), offset);
+        if(file != -1){
+            close(file);
+        }
+
+        lockState();
+        state->copies[copy].lsn = 0;
+        pthread_cond_broadcast(&state->synced);
+    }
+
+    bool durable = lsn != -1 && copied && waitDurable(recordEnd);
+    unlockState();
+
+    if(lsn != -1 && !durable){
+        finishMessage(lsn);
+        return -1;
+    }
+
+    return lsn;
+}
+
+void logDelivered(long long lsn, const std::string &receiver, int id){
+
+    if(durabilityLevel == WAL_NONE || lsn <= 0){
+        return;
+    }
+
+    std::string marker = std::to_string(lsn) + " " + std::to_string(id) + " " + receiver;
+    uint64_t recordEnd;
+    lockState();
+    appendRecord(WAL_DELIVERED, marker, NULL, recordEnd);
+    unlockState();
+}
+
+void finishMessage(long long lsn){
+
+    if(durabilityLevel == WAL_NONE || lsn <= 0){
+        return;
+    }
+
+    lockState();
+    WalOwner *owner = findOwner(getpid());
+    if(owner != NULL){
+        owner->unfinished[((uint64_t)lsn >> WAL_GENERATION_SHIFT) % 2]--;
+        releaseOwner(owner);
+    }
+    unlockState();
+
+    removePreviousIfDone();
+}
+
+void dropProcessMessages(pid_t process){
+
+    if(durabilityLevel == WAL_NONE){
+        return;
+    }
+
+    lockState();
+    WalOwner *owner = findOwner(process);
+    if(owner != NULL){
+        owner->unfinished[0] = 0;
+        owner->unfinished[1] = 0;
+        releaseOwner(owner);
+    }
+    //a copy that did not finish stays padding, its message was never acknowledged
+    for(WalCopy &copy : state->copies){
+        if(copy.lsn != 0 && copy.process == process){
+            copy.lsn = 0;
+            pthread_cond_broadcast(&state->synced);
+        }
+    }
+    unlockState();
+
+    removePreviousIfDone();
+}
+
+void logDeleted(const std::string &username, int id){
+
+    if(durabilityLevel == WAL_NONE){
+        return;
+    }
+
+    std::string marker = std::to_string(id) + " " + username;
+    uint64_t recordEnd;
+    lockState();
+    appendRecord(WAL_DELETED, marker, NULL, recordEnd);
+    unlockState();
+}
+
+static bool prepareFile(){
+
+    bool copying = false;
+    for(const WalCopy &copy : state->copies){
+        copying = copying || copy.lsn != 0;
+    }
+
+    if(state->fileEnd >= WAL_ROTATE_SIZE && !state->previousPending && !copying && !startNextFile()){
+        return false;
+    }
+    return openCurrentFile();
+}
+
+static long long appendRecord(uint32_t type, std::string_view data, const StagedMessage *staged, uint64_t &recordEnd){
+
+    if(!prepareFile()){
+        return -1;
+    }
+
+    WalRecordHeader header;
+    header.magic = WAL_MAGIC;
+    header.type = type;
+    header.lsn = (state->generation << WAL_GENERATION_SHIFT) + state->fileEnd;
+    header.length = staged != NULL ? staged->length : data.length();
+    header.checksum = checksum(data.data(), data.length());
+
+    off_t offset = state->fileEnd + sizeof(header);
+
+    if(staged != NULL){
+        if(!copyStagedMessage(logFile, *staged, offset, header.checksum)){
+            return -1;
+        }
+    } else if(!writeAll(logFile, data.data(), data.length(), offset)){
+        return -1;
+    }
+
+    //the header goes last, replay only sees the record once it is complete
+    if(!writeAll(logFile, (const char *)&header, sizeof(header), state->fileEnd)){
+        return -1;
+    }
+
+    state->fileEnd += sizeof(header) + header.length;
+    recordEnd = (state->generation << WAL_GENERATION_SHIFT) + state->fileEnd;
+    return header.lsn;
+}
+
+static long long reserveRecord(size_t length, int copy, uint64_t &recordEnd){
+
+    if(!prepareFile()){
+        return -1;
+    }
+
+    //the space is a WAL_PADDING record until the copy replaces its header, so replay skips a copy that did not
+    //finish (failed, or the server stopped meanwhile) and still finds the records after it
+    uint64_t lsn = (state->generation << WAL_GENERATION_SHIFT) + state->fileEnd;
+    WalRecordHeader header;
+    header.magic = WAL_MAGIC;
+    header.type = WAL_PADDING;
+    header.lsn = lsn;
+    header.length = length;
+    header.checksum = checksum(NULL, 0);
+    if(!writeAll(logFile, (const char *)&header, sizeof(header), state->fileEnd)){
+        return -1;
+    }
+
+    state->copies[copy].lsn = lsn;
+    state->copies[copy].process = getpid();
+
+    state->fileEnd += sizeof(WalRecordHeader) + length;
+    recordEnd = (state->generation << WAL_GENERATION_SHIFT) + state->fileEnd;
+
+    return lsn;
+}
+
+//a staged message is copied from its temporary file, the checksum is computed on the way
+static bool copyStagedMessage(int file, const StagedMessage &message, off_t offset, uint32_t &hash){
+
+    std::vector<char> buffer(WAL_COPY_SIZE);
+    off_t stagedOffset = 0;
+    hash = checksum(NULL, 0);
+    while(stagedOffset < (off_t)message.length){
+        ssize_t bytesRead = pread(message.file, buffer.data(), std::min((off_t)buffer.size(), (off_t)message.length - stagedOffset), stagedOffset);
+        if(bytesRead <= 0 || !writeAll(file, buffer.data(), bytesRead, offset + stagedOffset)){
+            if(bytesRead <= 0){
+                logErrno("read staged message");
+            }
+            return false;
+        }
+        hash = checksum(buffer.data(), bytesRead, hash);
+        stagedOffset += bytesRead;
+    }
+
+    return true;
+}
+
+static uint64_t syncTarget(){
+
+    uint64_t target = (state->generation << WAL_GENERATION_SHIFT) + state->fileEnd;
+
+    for(const WalCopy &copy : state->copies){
+        if(copy.lsn != 0){
+            target = std::min(target, copy.lsn);
+        }
+    }
+
+    return target;
+}
+
+static WalOwner *findOwner(pid_t process){
+
+    for(WalOwner &owner : state->owners){
+        if(owner.process == process){
+            return &owner;
+        }
+    }
+    return NULL;
+}
+
+static WalOwner *claimOwner(){
+
+    WalOwner *owner;
+    while((owner = findOwner(getpid())) == NULL){
+        WalOwner *free = findOwner(0);
+        if(free != NULL){
+            free->process = getpid();
+            return free;
+        }
+        waitForChange(); //a slot is freed by finishMessage() or dropProcessMessages()
+    }
+    return owner;
+}
+
+static void releaseOwner(WalOwner *owner){
+
+    if(owner->unfinished[0] == 0 && owner->unfinished[1] == 0){
+        owner->process = 0;
+        pthread_cond_broadcast(&state->synced);
+    }
+}
+
+static int waitForChange(){
+
+    struct timespec timeout;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += 1;
+    int result = pthread_cond_timedwait(&state->synced, &state->mutex, &timeout);
+    if(result == EOWNERDEAD){
+        pthread_mutex_consistent(&state->mutex);
+    }
+    return result;
+}
+
+static bool waitDurable(uint64_t lsn){
+
+    //one fsync per message, nothing is shared
+    if(durabilityLevel == WAL_PER_MESSAGE){
+        int file = dup(logFile);
+        unlockState();
+        bool success = file != -1 && fdatasync(file) == 0;
+        if(!success){
+            logErrno("fdatasync write-ahead log");
+        }
+        if(file != -1){
+            close(file);
+        }
+        lockState();
+        return success;
+    }
+
+    //group commit: the first one that finds the log not synced far enough syncs everything written so far,
+    //records appended meanwhile are synced by the next one that finds the log not synced far enough
+    while(state->durable < lsn){
+
+        if(state->syncing){
+            int result = waitForChange();
+            //the process that was syncing died, someone else has to do it
+            if(result == ETIMEDOUT && state->syncing && kill(state->syncingProcess, 0) == -1 && errno == ESRCH){
+                state->syncing = false;
+            }
+            continue;
+        }
+
+        //an earlier record is still being copied, there is nothing to sync before it is done
+        uint64_t target = syncTarget();
+        if(target <= state->durable){
+            waitForChange();
+            continue;
+        }
+
+        state->syncing = true;
+        state->syncingProcess = getpid();
+
+        //a duplicate, the descriptor of this process may be replaced by another thread while the log is unlocked
+        int file = dup(logFile);
+        unlockState();
+        bool success = file != -1 && fdatasync(file) == 0;
+        if(file != -1){
+            close(file);
+        }
+        lockState();
+
+        state->syncing = false;
+        pthread_cond_broadcast(&state->synced);
+        if(!success){
+            logErrno("fdatasync write-ahead log");
+            return false;
+        }
+        state->durable = std::max(state->durable, target);
+    }
+
+    return true;
+}
+
+static bool startNextFile(){
+
+    //the current file is synced completely first, so durable never has to look at two files
+    if(fdatasync(logFile) == -1){
+        logErrno("fdatasync write-ahead log");
+        return false;
+    }
+
+    state->generation++;
+    state->fileEnd = 0;
+    state->durable = state->generation << WAL_GENERATION_SHIFT;
+    state->previousPending = true;
+    pthread_cond_broadcast(&state->synced);
+
+    return openCurrentFile() && syncDirectory(walDirectory);
+}
+
+static bool openCurrentFile(){
+
+    if(logFile != -1 && logFileGeneration == state->generation){
+        return true;
+    }
+
+    int file = open(logFilePath(state->generation).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if(file == -1){
+        logErrno("open write-ahead log");
+        return false;
+    }
+
+    if(logFile != -1){
+        close(logFile);
+    }
+    logFile = file;
+    logFileGeneration = state->generation;
+
+    return true;
+}
+
+static void removePreviousIfDone(){
+
+    lockState();
+    bool unfinished = false;
+    for(const WalOwner &owner : state->owners){
+        unfinished = unfinished || (owner.process != 0 && owner.unfinished[(state->generation - 1) % 2] > 0);
+    }
+    if(!state->previousPending || state->removingPrevious || unfinished){
+        unlockState();
+        return;
+    }
+    state->removingPrevious = true;
+    uint64_t previous = state->generation - 1;
+    unlockState();
+
+    //the deliveries of the previous file may only be in the page cache, syncfs() writes them (with everything else
+    //on the file system) to disk before the log that could repeat them is gone
+    bool removed = false;
+    int directory = open(dataPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(directory != -1 && syncfs(directory) == 0){
+        removed = unlink(logFilePath(previous).c_str()) == 0 || errno == ENOENT;
+    }
+    if(!removed){
+        logErrno("remove previous write-ahead log");
+    }
+    if(directory != -1){
+        close(directory);
+    }
+
+    lockState();
+    state->previousPending = !removed;
+    state->removingPrevious = false;
+    unlockState();
+}
+
+static void lockState(){
+
+    //a client process died while it held the lock, every change of the state is complete before anything is
+    //written, so it is still consistent (at most a record was written that the next one overwrites)
+    if(pthread_mutex_lock(&state->mutex) == EOWNERDEAD){
+        pthread_mutex_consistent(&state->mutex);
+    }
+}
+
+static void unlockState(){
+    pthread_mutex_unlock(&state->mutex);
+}
+
+static fs::path logFilePath(uint64_t generation){
+    return walDirectory / (std::to_string(generation) + ".log");
+}
+
+static std::vector<uint64_t> logFileGenerations(){
+
+    std::vector<uint64_t> generations;
+
+    std::error_code error;
+    for(auto const &entry : fs::directory_iterator(walDirectory, error)){
+        std::string filename = entry.path().filename().string();
+        if(entry.path().extension() == ".log" && isMessageId(entry.path().stem().string())){
+            generations.push_back(std::stoull(filename));
+        }
+    }
+
+    std::sort(generations.begin(), generations.end());
+    return generations;
+}
+
+static bool syncDirectory(const fs::path &directory){
+
+    int file = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(file == -1 || fsync(file) == -1){
+        logErrno("fsync write-ahead log directory");
+        if(file != -1){
+            close(file);
+        }
+        return false;
+    }
+
+    close(file);
+    return true;
+}
+
+static bool writeAll(int file, const char *data, size_t length, off_t offset){
+
+    while(length > 0){
+        ssize_t bytesWritten = pwrite(file, data, length, offset);
+        if(bytesWritten == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            logErrno("write write-ahead log");
+            return false;
+        }
+        data += bytesWritten;
+        length -= bytesWritten;
+        offset += bytesWritten;
+    }
+
+    return true;
+}
+
+//FNV-1a like the segment records, hash can be passed in to continue over several blocks
+static uint32_t checksum(const char *data, size_t length, uint32_t hash){
+    for(size_t i = 0; i < length; i++){
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include "storage.h"
+
+//write-ahead log for SEND: a message is appended to the log and written to disk before it is delivered into the
+//mailboxes, so "OK" is only sent for messages that survive a crash; mailbox files themselves are never fsynced
+//concurrent SENDs of all client processes and worker threads share one fsync (group commit): whoever finds the log
+//not synced far enough syncs everything appended so far, the others wait for it and find their records synced as well
+//a staged message (large SEND body) is copied into space reserved for it with the log unlocked, so a long copy does not
+//hold up the other SENDs; a sync only covers the log up to the first record that is still being copied
+//after every delivery a marker with the message-id is appended (not synced), DEL appends one for every removed
+//message; on startup replayWriteAheadLog() delivers every logged message to the receivers it did not reach
+//the log is a sequence of files wal/<generation>.log, once the current one is larger than WAL_ROTATE_SIZE the next
+//is started, and the previous one is removed as soon as all its messages are delivered and the mailboxes are synced
+
+#define WAL_NONE 0 //no log, messages are on disk whenever the kernel writes them (fastest, a crash can lose mail)
+#define WAL_BATCHED 1 //log with group commit (default)
+#define WAL_PER_MESSAGE 2 //log with one fsync per message, nothing is shared (slowest, for comparison)
+
+#define WAL_DIRECTORY "wal" //in the data directory
+#define WAL_MAGIC 0x4c575754 //"TWWL"
+#define WAL_ROTATE_SIZE (64 * 1024 * 1024) //start a new log file once the current one is larger than this
+#define WAL_COPY_SIZE (64 * 1024) //block size for copying staged messages into the log
+
+#define WAL_MESSAGE 1 //complete message as stored ("<sender>\n<receivers>\n<subject>\n<body>")
+#define WAL_DELIVERED 2 //"<lsn of the message> <message-id> <receiver>"
+#define WAL_DELETED 3 //"<message-id> <username>"
+#define WAL_PADDING 4 //space of a staged message until it is copied completely, replay skips it
+
+//header in front of every record, followed by <length> bytes
+struct WalRecordHeader {
+    uint32_t magic;
+    uint32_t type; //WAL_MESSAGE, WAL_DELIVERED, WAL_DELETED or WAL_PADDING
+    uint64_t lsn; //position of the record over all log files (log sequence number)
+    uint32_t length;
+    uint32_t checksum; //FNV-1a of the record data
+};
+
+int parseDurability(const char *name); //"none", "batched" or "per-message", -1 if unknown
+
+//opens the log in shared memory and the current log file, has to be called before the server forks or starts workers
+//returns false if the log directory can not be used
+bool initWriteAheadLog(const std::string &dataDirectory, int durability);
+
+//delivers logged messages that are missing in their mailboxes, then syncs the mailboxes and removes the old log files
+//has to be called after initWriteAheadLog() and before any client is served, also works with WAL_NONE
+void replayWriteAheadLog(Storage *storage);
+
+//appends a message to the log and returns once it is on disk (as far as the durability level says)
+//returns its lsn, 0 with WAL_NONE, -1 on error (the message must not be delivered then)
+//every logged message has to be finished with finishMessage() after its deliveries
+long long logMessage(std::string_view message);
+long long logStagedMessage(const StagedMessage &message); //same for a message in a temporary file
+
+void logDelivered(long long lsn, const std::string &receiver, int id); //message was stored in the mailbox of receiver with id
+void finishMessage(long long lsn); //all deliveries of the message are done (or failed), its log file can be removed once synced
+void logDeleted(const std::string &username, int id); //message was removed, replay must not deliver it again
+void dropProcessMessages(pid_t process); //a client process exited (and was collected), its unfinished messages and copies are dropped
@@ -10,8 +10,16 @@
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <algorithm>
+#include <fstream>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <ldap.h>
 #include "ldapAuthSrc/mypw.h"
+#include "protocolSrc/frame.h"
 
 //commands
 #define SEND 1
@@ -21,6 +29,8 @@
 #define QUIT 5
 #define ERROR 6
 #define LOGIN 7
+#define STATS 8
+#define SEARCH 9
 
 int stringCommandToInt(std::string input); //enables switch case for commands
 
@@ -28,35 +38,135 @@ int create_socket = -1;
 std::string stringBuffer;
 std::string input;
 
+//pipelined mode (-p): requests are tagged with a request-id and sent without waiting for the response,
+//a reader thread prints the responses with their id as they arrive
+bool pipelined = false;
+uint32_t nextRequestId = 1;
+std::atomic<bool> quitSent(false); //server closing the connection is expected after QUIT
+void readResponses(); //reader thread in pipelined mode
+
+//batch mode (-b <file>): requests are read from a file or stdin ('-') instead of the prompts and pipelined over
+//one or more connections (-c), every request (item) gets a result line, for bulk imports and scripted sessions
+//the input is either a script with exactly the lines that would be typed into the prompts (LIST is followed by its
+//range line, SEND by receiver, subject and body ending with '.'), or an mbox file (-m) whose messages are sent as SEND
+//LOGIN (and -L) goes to every connection, all other items are distributed over the connections round-robin
+#define BATCH_WINDOW 64 //max. requests per connection that are sent but not answered yet
+
+struct BatchItem {
+    size_t number = 0; //position in the input, counts from 1
+    size_t line = 0; //first line of the item in the input
+    std::string command;
+    std::string request;
+};
+
+//an item that is waiting for its response
+struct PendingItem {
+    uint32_t requestId;
+    size_t number;
+    size_t line;
+    std::string command;
+    bool entries; //answered with one result per entry (SEND to several receivers, READ or DEL of several messages)
+};
+
+struct BatchConnection {
+    int socket = -1;
+    int number = 0;
+    bool verbose = false;
+    uint32_t nextRequestId = 1;
+    std::mutex mutex;
+    std::condition_variable windowFree;
+    std::deque<PendingItem> pending; //in order of the requests, the server answers in the same order
+    std::thread reader;
+};
+
+struct BatchOptions {
+    const char *input = NULL;
+    bool mbox = false;
+    int connections = 1;
+    std::string username; //-L: every connection logs in as this user first
+    std::string receiver; //-R: receiver of all mbox messages instead of their To: header
+    bool verbose = false; //prints whole responses instead of their status
+};
+
+std::mutex outputMutex; //result lines of the reader threads
+std::atomic<size_t> failedItems(0);
+
+int runBatch(const struct sockaddr_in &address, const BatchOptions &options); //returns the exit status
+bool readScriptItem(std::istream &in, size_t &lineNumber, BatchItem &item); //false at the end of the input
+bool readMboxItem(std::istream &in, size_t &lineNumber, std::string &nextLine, const std::string &receiver, BatchItem &item);
+std::string mboxReceivers(const std::string &to); //local parts of the addresses of a To: header, separated by ','
+void sendBatchItem(BatchConnection &connection, const BatchItem &item);
+void readBatchResponses(BatchConnection *connection); //reader thread of a connection in batch mode
+void printBatchResult(const BatchConnection &connection, const PendingItem &item, const std::string &response);
+bool hasEntryResults(const BatchItem &item); //true if the server answers the item with one result per entry
+bool entryFailed(const std::string &response, bool withMessages); //true if a result line of the entries is ERR, READ has the messages in between
+
 //reads line and adds it to stringBuffer
 void getLineToBuffer();
 
 //before sending the actual message, another message containing the size of the actual message is sent,
 //so that the server can allocate memory for the message and messages are not limited in size
 //by a fixed buffer
-void sendMessage(); //sends message from stringBuffer to server
-void receiveMessage(); //receives message from server and writes it to stringBuffer
+void sendMessage(); //sends message from stringBuffer to server, tagged with the next request-id in pipelined mode
+void sendFrames(int socket, const std::string &message, bool tagged, uint32_t requestId); //sends message as frames, chunked if large
+void sendBytes(int socket, const char *data, size_t length, int flags); //sends all bytes, exits on error
+bool receiveMessage(int socket, std::string &message, bool &tagged, uint32_t &requestId); //receives message from server, false if the server closed the connection after QUIT
 
 int main(int argc, char *argv[]) {
 
-    
-    if(argc < 3){
-        fprintf(stderr, "Usage: %s <ip> <port>\n", argv[0]);
+    BatchOptions batchOptions;
+
+    int option;
+    while((option = getopt(argc, argv, "pb:mc:L:R:v")) != -1){
+        switch(option){
+            case 'p':
+                pipelined = true;
+                break;
+            case 'b':
+                batchOptions.input = optarg;
+                break;
+            case 'm':
+                batchOptions.mbox = true;
+                break;
+            case 'c':
+                batchOptions.connections = atoi(optarg);
+                break;
+            case 'L':
+                batchOptions.username = optarg;
+                break;
+            case 'R':
+                batchOptions.receiver = optarg;
+                break;
+            case 'v':
+                batchOptions.verbose = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p] [-b <file> [-m] [-c connections] [-L user] [-R receiver] [-v]] <ip> <port>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if(argc - optind < 2 || batchOptions.connections < 1){
+        fprintf(stderr, "Usage: %s [-p] [-b <file> [-m] [-c connections] [-L user] [-R receiver] [-v]] <ip> <port>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
     struct sockaddr_in address;
 
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET; // IPv4
+    address.sin_port = htons(std::stoi(argv[optind + 1]));
+    inet_aton(argv[optind], &address.sin_addr);
+
+    if(batchOptions.input != NULL){
+        return runBatch(address, batchOptions);
+    }
+
     if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1){
         perror("Socket error");
         exit(EXIT_FAILURE);
     }
 
-    memset(&address, 0, sizeof(address));
-    address.sin_family = AF_INET; // IPv4
-    address.sin_port = htons(std::stoi(argv[2]));
-    inet_aton(argv[1], &address.sin_addr);
-
     if (connect(create_socket, (struct sockaddr *)&address, sizeof(address)) == -1) {
         perror("Connect error - no server available");
         exit(EXIT_FAILURE);
@@ -64,9 +174,17 @@ int main(int argc, char *argv[]) {
 
     printf("Connection with server (%s) established\n", inet_ntoa(address.sin_addr));
 
-    receiveMessage(); //receive Message from Server and copy message to stringBuffer
+    bool tagged;
+    uint32_t requestId;
+
+    receiveMessage(create_socket, stringBuffer, tagged, requestId); //receive Message from Server and copy message to stringBuffer
     std::cout << "<< " << stringBuffer << "\n";
 
+    std::thread responseReader;
+    if(pipelined){
+        responseReader = std::thread(readResponses);
+    }
+
     //main loop
     //creates message from input, sends it to server, then waits for response
     while(true) {
@@ -83,7 +201,7 @@ int main(int argc, char *argv[]) {
                 stringBuffer += getpass() + "\n";
                 break;
             case SEND:
-                printf("Enter receiver (max. 8 chars):\n>> ");
+                printf("Enter receiver (max. 8 chars, several separated by ','):\n>> ");
                 getLineToBuffer();
                 printf("Enter subject (max. 80 chars):\n>> ");
                 getLineToBuffer();
@@ -95,19 +213,27 @@ int main(int argc, char *argv[]) {
                 break;
 
             case LIST:
+                printf("Enter range (empty for all, <offset>[,<limit>] or SINCE <message number>[,<limit>]):\n>> ");
+                getLineToBuffer();
                 break;
 
             case READ:
-                printf("Enter message number:\n>> ");
+                printf("Enter message number (or list, e.g. 1,3,5-9):\n>> ");
+                getLineToBuffer();
+                break;
+
+            case SEARCH:
+                printf("Enter search terms (words, from:<user>, subject:<word>):\n>> ");
                 getLineToBuffer();
                 break;
 
             case DEL:
-                printf("Enter message number:\n>> ");
+                printf("Enter message number (or list, e.g. 1,3,5-9):\n>> ");
                 getLineToBuffer();
                 break;
 
             case QUIT:
+            case STATS:
                 break;
 
             default:
@@ -115,14 +241,27 @@ int main(int argc, char *argv[]) {
                 continue;
         }
 
+        if (stringBuffer == "QUIT\n") {
+            quitSent = true;
+        }
+
         //send Message from stringBuffer to server
         sendMessage();
 
         if (stringBuffer == "QUIT\n") {
+            //server answers everything that was sent before QUIT, then closes the connection
+            if(pipelined){
+                responseReader.join();
+            }
             exit(EXIT_SUCCESS);
         }
 
-        receiveMessage(); //receive Message from Server and copy message to stringBuffer
+        //responses are printed by the reader thread
+        if(pipelined){
+            continue;
+        }
+
+        receiveMessage(create_socket, stringBuffer, tagged, requestId); //receive Message from Server and copy message to stringBuffer
         std::cout << "<< " << stringBuffer << "\n";
     }
 
@@ -130,38 +269,16 @@ int main(int argc, char *argv[]) {
     exit(EXIT_SUCCESS);   
 }
 
-void sendMessage(){
-    const uint32_t  stringLength = htonl(stringBuffer.length());
-    int bytesSent = -1;
-
-    //sends length of upcoming message first
-    //set MSG_NOSIGNAL to ignore SIGPIPE error when socket is disconnected (this is handled when recv is called later)
-    bytesSent = send(create_socket, &stringLength, sizeof(uint32_t), MSG_NOSIGNAL);
-
-    if(bytesSent == -1){
-        if(errno == EPIPE){
-            printf("Error - Server closed remote socket\n");
-        } else {
-            perror("send error");
-        }
-        printf("Stopping client...\n");
-        exit(EXIT_FAILURE);
-    };
-
-    if(bytesSent != sizeof(uint32_t)){
-        printf("Error - could not send length of message.\n");
-        exit(EXIT_FAILURE);
-    };
+void sendBytes(int socket, const char *data, size_t length, int flags){
 
-    //sends actual message
-
-    int bytesLeft = stringBuffer.length();
-    int index = 0;
-    bytesSent = -1;
+    size_t bytesLeft = length;
+    size_t index = 0;
+    int bytesSent = -1;
 
     while(bytesLeft > 0){
-        
-        bytesSent = send(create_socket, &stringBuffer.data()[index], bytesLeft, MSG_NOSIGNAL);
+
+        //set MSG_NOSIGNAL to ignore SIGPIPE error when socket is disconnected
+        bytesSent = send(socket, &data[index], bytesLeft, MSG_NOSIGNAL | flags);
 
         if(bytesSent == -1){
             if(errno == EPIPE){
@@ -176,52 +293,490 @@ void sendMessage(){
         bytesLeft -= bytesSent;
         index += bytesSent;
     }
+}
+
+void sendMessage(){
+
+    //in pipelined mode the first frame carries the request-id, the response comes back with the same id
+    uint32_t requestId = 0;
+    if(pipelined){
+        requestId = nextRequestId++;
+        printf("[%u] sent\n", requestId);
+    }
+
+    sendFrames(create_socket, stringBuffer, pipelined, requestId);
 };
 
-void receiveMessage(){
+void sendFrames(int socket, const std::string &message, bool tagged, uint32_t requestId){
+
+    //large messages are split into chunks, every chunk but the last one has FRAME_MORE_CHUNKS set in its length,
+    //so the server never has to hold a large message in memory
+    size_t index = 0;
+    do{
+        size_t chunkLength = std::min(message.length() - index, (size_t)FRAME_CHUNK_SIZE);
+        bool lastChunk = index + chunkLength == message.length();
+        bool taggedChunk = tagged && index == 0;
+
+        //length of upcoming chunk first (and request-id), then the chunk itself
+        //MSG_MORE keeps the header from going out as a packet of its own
+        uint32_t header[2];
+        header[0] = htonl(chunkLength | (lastChunk ? 0 : FRAME_MORE_CHUNKS) | (taggedChunk ? FRAME_TAGGED : 0));
+        header[1] = htonl(requestId);
+        sendBytes(socket, (const char *)header, taggedChunk ? FRAME_TAGGED_HEADER_SIZE : FRAME_HEADER_SIZE, MSG_MORE);
+        sendBytes(socket, &message.data()[index], chunkLength, 0);
+
+        index += chunkLength;
+    }while(index < message.length());
+}
+
+void readResponses(){
+
+    std::string message;
+    bool tagged;
+    uint32_t requestId;
+
+    while(receiveMessage(create_socket, message, tagged, requestId)){
+        if(tagged){
+            std::cout << "<< [" << requestId << "] " << message << "\n";
+        } else {
+            std::cout << "<< " << message << "\n";
+        }
+    }
+}
+
+bool receiveMessage(int socket, std::string &message, bool &tagged, uint32_t &requestId){
 
-    //first we receive length of upcoming message
-    uint32_t  lengthOfMessage;
-    uint32_t bytesReceived = -1;
-    bytesReceived = recv(create_socket, &lengthOfMessage, sizeof(uint32_t),0);
-    if (bytesReceived == (unsigned)-1) {
+    //first we receive length of upcoming message (and request-id if it is tagged)
+    uint32_t header[2];
+    ssize_t bytesReceived = recv(socket, header, FRAME_HEADER_SIZE, MSG_WAITALL);
+    if (bytesReceived == -1) {
         perror("recv error");
         exit(EXIT_FAILURE);
     }
-    if (bytesReceived == (unsigned)0) {
+    if (bytesReceived == 0) {
+        if(quitSent){
+            return false;
+        }
         printf("Server closed remote socket\n"); // ignore error
         exit(EXIT_FAILURE);
     }
-    if (bytesReceived != sizeof(uint32_t)) {
+    if (bytesReceived != FRAME_HEADER_SIZE) {
         printf("Error - could not receive length of message.\n");
         exit(EXIT_FAILURE);
     }
-    lengthOfMessage = ntohl(lengthOfMessage);
+    uint32_t lengthOfMessage = ntohl(header[0]);
+
+    tagged = lengthOfMessage & FRAME_TAGGED;
+    if(tagged){
+        if(recv(socket, &header[1], sizeof(uint32_t), MSG_WAITALL) != sizeof(uint32_t)){
+            printf("Error - could not receive request-id of message.\n");
+            exit(EXIT_FAILURE);
+        }
+        requestId = ntohl(header[1]);
+    }
+    lengthOfMessage &= FRAME_LENGTH_MASK;
 
     //now we receive actual message
 
-    std::vector<char> receiveBuffer;
-    receiveBuffer.resize(lengthOfMessage); //allocate memory for message
-    
-    bytesReceived = -1;
+    message.resize(lengthOfMessage); //allocate memory for message
 
     //MSG_WAITALL is set so recv waits until entire message is received
-    bytesReceived = recv(create_socket, receiveBuffer.data(), lengthOfMessage, MSG_WAITALL);
-    if (bytesReceived == (unsigned)-1) {
+    bytesReceived = lengthOfMessage == 0 ? 0 : recv(socket, &message[0], lengthOfMessage, MSG_WAITALL);
+    if (bytesReceived == -1) {
         perror("recv error");
         exit(EXIT_FAILURE);
     }
-    if (bytesReceived == (unsigned)0) {
-        printf("Server closed remote socket\n");
-        exit(EXIT_FAILURE);
-    }
     if (bytesReceived != lengthOfMessage) {
         printf("Received message is shorter than message size.\n");
         exit(EXIT_FAILURE);
     }
 
-    //load message into stringBuffer
-    stringBuffer.assign(receiveBuffer.data(), receiveBuffer.size());
+    return true;
+}
+
+int runBatch(const struct sockaddr_in &address, const BatchOptions &options){
+
+    std::ifstream file;
+    bool fromStdin = strcmp(options.input, "-") == 0;
+    if(!fromStdin){
+        file.open(options.input);
+        if(!file){
+            perror("Could not open batch input");
+            return EXIT_FAILURE;
+        }
+    }
+    std::istream &in = fromStdin ? std::cin : file;
+
+    //mbox messages are sent by the user given with -L, the password comes from the environment so that the
+    //import can run unattended, otherwise it is asked for (not possible when the input is stdin)
+    BatchItem login;
+    if(!options.username.empty()){
+        const char *password = getenv("TWMAILER_PASSWORD");
+        if(password == NULL && fromStdin){
+            fprintf(stderr, "Set TWMAILER_PASSWORD to log in while the batch input is stdin\n");
+            return EXIT_FAILURE;
+        }
+        login.command = "LOGIN";
+        login.request = "LOGIN\n" + options.username + "\n" + (password != NULL ? password : getpass()) + "\n";
+    } else if(options.mbox){
+        fprintf(stderr, "mbox input needs a user to log in (-L)\n");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<BatchConnection> connections(options.connections);
+    for(int i = 0; i < options.connections; i++){
+        BatchConnection &connection = connections[i];
+        connection.number = i + 1;
+        connection.verbose = options.verbose;
+        if((connection.socket = socket(AF_INET, SOCK_STREAM, 0)) == -1){
+            perror("Socket error");
+            exit(EXIT_FAILURE);
+        }
+        if(connect(connection.socket, (struct sockaddr *)&address, sizeof(address)) == -1){
+            perror("Connect error - no server available");
+            exit(EXIT_FAILURE);
+        }
+
+        std::string welcome;
+        bool tagged;
+        uint32_t requestId;
+        receiveMessage(connection.socket, welcome, tagged, requestId);
+
+        connection.reader = std::thread(readBatchResponses, &connection);
+        if(!login.request.empty()){
+            sendBatchItem(connection, login);
+        }
+    }
+
+    size_t lineNumber = 0;
+    size_t itemNumber = 0;
+    size_t nextConnection = 0;
+    std::string nextLine; //first line of the next mbox message, already read by the previous one
+    BatchItem item;
+
+    while(options.mbox ? readMboxItem(in, lineNumber, nextLine, options.receiver, item) : readScriptItem(in, lineNumber, item)){
+
+        item.number = ++itemNumber;
+        if(item.command == "QUIT"){
+            break;
+        }
+
+        if(item.request.empty()){
+            std::lock_guard<std::mutex> guard(outputMutex);
+            printf("item %zu (line %zu): invalid %s\n", item.number, item.line, item.command.c_str());
+            failedItems++;
+            continue;
+        }
+
+        //a session command has to reach every connection, everything else goes to the next one
+        if(item.command == "LOGIN"){
+            for(auto &connection : connections){
+                sendBatchItem(connection, item);
+            }
+        } else {
+            sendBatchItem(connections[nextConnection], item);
+            nextConnection = (nextConnection + 1) % connections.size();
+        }
+    }
+
+    //the server answers everything that was sent before QUIT, then closes the connection
+    quitSent = true;
+    for(auto &connection : connections){
+        sendFrames(connection.socket, "QUIT\n", false, 0);
+    }
+    for(auto &connection : connections){
+        connection.reader.join();
+        close(connection.socket);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(outputMutex);
+        printf("%zu items, %zu failed\n", itemNumber, failedItems.load());
+    }
+
+    return failedItems == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool readScriptItem(std::istream &in, size_t &lineNumber, BatchItem &item){
+
+    std::string line;
+
+    //empty lines between commands are skipped, like an empty input at the prompt
+    do{
+        if(!getline(in, line)){
+            return false;
+        }
+        lineNumber++;
+    }while(line.empty());
+
+    item.line = lineNumber;
+    item.command = line;
+    item.request = line + "\n";
+
+    //number of lines that follow the command, the body of SEND follows up to the line '.'
+    int fields;
+    switch(stringCommandToInt(line)){
+        case LOGIN:
+            fields = 2;
+            break;
+        case SEND:
+            fields = 2;
+            break;
+        case LIST:
+        case READ:
+        case DEL:
+        case SEARCH:
+            fields = 1;
+            break;
+        case QUIT:
+        case STATS:
+            return true;
+        default:
+            item.request.clear(); //reported as invalid
+            return true;
+    }
+
+    for(int i = 0; i < fields; i++){
+        if(!getline(in, line)){
+            item.request.clear();
+            return true;
+        }
+        lineNumber++;
+        item.request += line + "\n";
+    }
+
+    if(item.command == "SEND"){
+        do{
+            if(!getline(in, line)){
+                item.request.clear();
+                return true;
+            }
+            lineNumber++;
+            item.request += line + "\n";
+        }while(line != ".");
+    }
+
+    return true;
+}
+
+bool readMboxItem(std::istream &in, size_t &lineNumber, std::string &nextLine, const std::string &receiver, BatchItem &item){
+
+    //every message starts with a "From " line, lines of the body that start with "From " are quoted as ">From ",
+    //one '>' is removed again (mboxrd)
+    std::string line;
+    if(nextLine.empty()){
+        do{
+            if(!getline(in, line)){
+                return false;
+            }
+            lineNumber++;
+        }while(line.compare(0, 5, "From ") != 0);
+    } else {
+        line = nextLine;
+        nextLine.clear();
+    }
+
+    item.line = lineNumber;
+    item.command = "SEND";
+    item.request.clear();
+
+    //headers up to the first empty line, continuation lines start with whitespace
+    std::string to;
+    std::string subject;
+    std::string *lastHeader = NULL;
+    while(getline(in, line)){
+        lineNumber++;
+        if(line.empty() || line == "\r"){
+            break;
+        }
+        if((line[0] == ' ' || line[0] == '\t') && lastHeader != NULL){
+            *lastHeader += " " + line.substr(line.find_first_not_of(" \t"));
+            continue;
+        }
+        lastHeader = NULL;
+        if(strncasecmp(line.c_str(), "To:", 3) == 0){
+            to = line.substr(3);
+            lastHeader = &to;
+        } else if(strncasecmp(line.c_str(), "Subject:", 8) == 0){
+            subject = line.substr(8);
+            lastHeader = &subject;
+        }
+    }
+
+    std::string body;
+    bool emptyLine = false; //the empty line before "From " belongs to the separator, not to the body
+    while(getline(in, line)){
+        lineNumber++;
+        if(line.compare(0, 5, "From ") == 0){
+            nextLine = line;
+            break;
+        }
+        if(emptyLine){
+            body += "\n";
+        }
+        emptyLine = line.empty();
+        if(emptyLine){
+            continue;
+        }
+        size_t quoted = line.find_first_not_of('>');
+        if(quoted > 0 && quoted != std::string::npos && line.compare(quoted, 5, "From ") == 0){
+            line.erase(0, 1);
+        }
+        body += line + "\n";
+    }
+
+    //the subject is cut to the 80 chars the server accepts
+    subject.erase(0, subject.find_first_not_of(" \t"));
+    if(!subject.empty() && subject.back() == '\r'){
+        subject.pop_back();
+    }
+    subject = subject.substr(0, 80);
+
+    std::string receivers = receiver.empty() ? mboxReceivers(to) : receiver;
+    if(receivers.empty()){
+        return true; //reported as invalid
+    }
+
+    //same form as a message typed into the prompt
+    item.request = "SEND\n" + receivers + "\n" + subject + "\n" + body + ".\n";
+    return true;
+}
+
+std::string mboxReceivers(const std::string &to){
+
+    //"Name <user@host>, other@host" -> "user,other"
+    std::string receivers;
+    std::stringstream addresses(to);
+    std::string address;
+    while(getline(addresses, address, ',')){
+        size_t start = address.find('<');
+        start = start == std::string::npos ? 0 : start + 1;
+        size_t end = address.find_first_of("@>", start);
+        std::string user = address.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        user.erase(0, user.find_first_not_of(" \t\r"));
+        user.erase(user.find_last_not_of(" \t\r") + 1);
+        if(user.empty()){
+            continue;
+        }
+        if(!receivers.empty()){
+            receivers += ",";
+        }
+        receivers += user;
+    }
+
+    return receivers;
+}
+
+void sendBatchItem(BatchConnection &connection, const BatchItem &item){
+
+    uint32_t requestId;
+    {
+        //waits until the window has room, so a large import never queues more than BATCH_WINDOW requests per connection
+        std::unique_lock<std::mutex> guard(connection.mutex);
+        connection.windowFree.wait(guard, [&connection]{ return connection.pending.size() < BATCH_WINDOW; });
+        requestId = connection.nextRequestId++;
+        connection.pending.push_back(PendingItem{requestId, item.number, item.line, item.command, hasEntryResults(item)});
+    }
+
+    sendFrames(connection.socket, item.request, true, requestId);
+}
+
+void readBatchResponses(BatchConnection *connection){
+
+    std::string message;
+    bool tagged;
+    uint32_t requestId;
+
+    while(receiveMessage(connection->socket, message, tagged, requestId)){
+        PendingItem item;
+        {
+            std::lock_guard<std::mutex> guard(connection->mutex);
+            if(connection->pending.empty() || !tagged || connection->pending.front().requestId != requestId){
+                printf("Error - unexpected response on connection %d\n", connection->number);
+                exit(EXIT_FAILURE);
+            }
+            item = std::move(connection->pending.front());
+            connection->pending.pop_front();
+        }
+        connection->windowFree.notify_one();
+
+        printBatchResult(*connection, item, message);
+    }
+}
+
+void printBatchResult(const BatchConnection &connection, const PendingItem &item, const std::string &response){
+
+    //a failed request is answered with ERR (LIST and SEARCH answer with the count instead of OK), a list of receivers or
+    //message numbers is answered with one result per entry, an item with a failed entry counts as failed
+    std::string status = "OK";
+    if(response.compare(0, 4, "ERR\n") == 0){
+        status = "ERR";
+    } else if(item.entries && entryFailed(response, item.command == "READ")){
+        status = "PARTIAL";
+    }
+    if(status != "OK"){
+        failedItems++;
+    }
+
+    //the login of -L is not an item of the input
+    char label[64];
+    if(item.number == 0){
+        snprintf(label, sizeof(label), "login (connection %d)", connection.number);
+    } else {
+        snprintf(label, sizeof(label), "item %zu (line %zu, connection %d)", item.number, item.line, connection.number);
+    }
+
+    std::lock_guard<std::mutex> guard(outputMutex);
+    if(connection.verbose){
+        printf("%s: %s\n%s\n", label, item.command.c_str(), response.c_str());
+    } else {
+        printf("%s: %s %s\n", label, item.command.c_str(), status.c_str());
+    }
+}
+
+bool hasEntryResults(const BatchItem &item){
+
+    //second line of the request: receivers of SEND, message numbers of READ and DEL
+    size_t start = item.request.find('\n');
+    std::string line = start == std::string::npos ? "" : item.request.substr(start + 1, item.request.find('\n', start + 1) - start - 1);
+
+    if(item.command == "SEND"){
+        return line.find(',') != std::string::npos;
+    }
+    if(item.command == "READ" || item.command == "DEL"){
+        return line.find_first_of(",-") != std::string::npos;
+    }
+    return false;
+}
+
+bool entryFailed(const std::string &response, bool withMessages){
+
+    //"OK\n<count>\n", then "<entry> OK\n" or "<entry> ERR\n" per entry, READ has "<id> OK <length>\n<message>" instead
+    size_t position = response.find('\n', 3);
+    if(response.compare(0, 3, "OK\n") != 0 || position == std::string::npos){
+        return true;
+    }
+    position++;
+
+    while(position < response.length()){
+        size_t end = response.find('\n', position);
+        if(end == std::string::npos){
+            return true;
+        }
+        std::string line = response.substr(position, end - position);
+        position = end + 1;
+
+        size_t space = line.find(' ');
+        std::string result = space == std::string::npos ? "" : line.substr(space + 1);
+        if(result.compare(0, 2, "OK") != 0){
+            return true;
+        }
+        if(withMessages){
+            position += strtoull(result.c_str() + 2, NULL, 10); //the message is not looked at
+        }
+    }
+
+    return false;
 }
 
 void getLineToBuffer(){
@@ -254,5 +809,13 @@ int stringCommandToInt(std::string input){
         return LOGIN;
     }
 
+    if (input == "STATS") {
+        return STATS;
+    }
+
+    if (input == "SEARCH") {
+        return SEARCH;
+    }
+
     return ERROR;
-}
\ No newline at end of file
+}
@@ -2,6 +2,7 @@
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -9,16 +10,36 @@
 #include <string.h>
 #include <string>
 #include <iostream>
-#include <sstream>
 #include <vector>
 #include <filesystem>
 #include <fstream>
-#include <regex>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <ldap.h>
 #include "ldapAuthSrc/ldapAuth.h"
-#include <chrono>
+#include "ldapAuthSrc/authCache.h"
+#include "ldapAuthSrc/loginTable.h"
+#include "storageSrc/storage.h"
+#include "storageSrc/lock.h"
+#include "storageSrc/writeAheadLog.h"
+#include "storageSrc/searchIndex.h"
+#include "storageSrc/fileBatch.h"
+#include "protocolSrc/frame.h"
+#include "protocolSrc/parser.h"
+#include "metricsSrc/metrics.h"
+#include "logSrc/log.h"
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
 
 namespace fs = std::filesystem;
 
@@ -27,168 +48,923 @@ namespace fs = std::filesystem;
 #define ENABLE_TEST_ACCOUNTS true //enable test accounts for login without LDAP authentication
 #define MAX_FAILED_LOGIN_ATTEMPTS 2 //number of failed login attempts before ip is blacklisted
 #define IP_BLACKLIST_TIME 60 //blacklist time (in seconds)
+#define FAILED_LOGIN_ATTEMPT_TIME 600 //failed login attempts of an ip are forgotten after this time without another one (in seconds)
+#define LOGIN_SNAPSHOT_INTERVAL 60 //default seconds between two snapshots of failed login attempts and blacklist (-b), 0 = no snapshots
+#define MAX_MESSAGE_SIZE (64 * 1024 * 1024) //default max. size of a received message in bytes (-l), larger messages close the connection
 
-//--- Signal handler ---
+//--- Signals ---
 
-void signalHandler(int sig);
+//SIGINT, SIGUSR1 and SIGCHLD are blocked in every thread and handled by signalLoop() with sigwait(), so they are handled
+//like anything else (logging, exit()) instead of in a signal handler, where only async-signal-safe calls are allowed
+void blockSignals(); //has to be called before any thread is started, threads inherit the signal mask
+void signalLoop(); //waits for signals and handles them, runs in its own thread in the server and in every child process
 
 //--- Sockets and forking ---
 
+#define MODE_FORK 1 //one child process per client (default)
+#define MODE_EPOLL 2 //non-blocking sockets with epoll, one event loop per worker thread
+
+int serverMode = MODE_FORK;
+int numberOfWorkers = 1; //epoll mode only, 0 = one worker per core
+
 int create_socket = -1;
-int current_socket = -1;
 pid_t pid = -1;
 
+int createListenSocket(int port); //creates a listening socket with SO_REUSEADDR and SO_REUSEPORT set
+void forkLoop(); //accepts clients and forks a child process running connectionLogic() for each one
+
+//--- Event-driven mode (epoll) ---
+
+#define EPOLL_MAX_EVENTS 64
+#define LDAP_EVENT (1ULL << 32) //epoll data of an LDAP socket: this flag plus the client socket whose LOGIN waits for it
+
+//--- Session ---
+
+//message file that is sent as part of a response (zero-copy READ), followed by more text of the response
+struct ResponseFile {
+    MessageFile file;
+    std::string after;
+};
+
+//state of one connected client, passed to all handlers so they can run concurrently in worker threads
+struct Session {
+    int socket = -1;
+    std::string stringBuffer; //input/output buffer
+    std::string request; //request that is being handled (parsed in place), stringBuffer then holds the response
+    bool loggedIn = false;
+    std::string sessionUsername; //set once user is logged in
+    std::string clientIP;
+    std::vector<ResponseFile> responseFiles; //sent after stringBuffer as part of the same message, files are closed once sent
+
+    //state of the message that is currently received, see receiveData()
+    bool messageStarted = false;
+    char frameHeader[FRAME_TAGGED_HEADER_SIZE];
+    size_t frameHeaderReceived = 0;
+    bool requestTagged = false; //the response is tagged with requestId
+    uint32_t requestId = 0;
+    bool inFrame = false;
+    bool lastFrame = false;
+    size_t frameBytesLeft = 0;
+    size_t messageSize = 0; //bytes of the current message received so far
+    long long parseTime = 0; //microseconds spent in receiveData() on the current message
+    long long requestStart = 0; //metricsClock() when handling of the request started, for the latency of a pending LOGIN
+    bool messageTruncated = false; //message is too large for its command, the rest of it was dropped
+    StagedMessage stagedMessage; //body of a large SEND, stringBuffer then only holds the command lines
+
+    //LOGIN that waits for the LDAP server (epoll mode only), see continueLogin()
+    bool loginPending = false;
+    std::string loginUsername;
+    std::string loginPassword;
+    LDAPBind bind;
+};
+
+//part of the output of a connection in epoll mode, either bytes or a region of a file
+struct OutputChunk {
+    std::string data;
+    size_t dataSent = 0;
+    MessageFile file;
+};
+
+//per-connection state in epoll mode, incomplete messages are kept in the session
+struct Connection {
+    Session session;
+    std::deque<OutputChunk> output; //framed responses not yet sent
+    bool closeAfterWrite = false;
+    std::string pendingInput; //received while a LOGIN is pending, processed once it is answered
+    int watchedLoginSocket = -1; //LDAP socket of the pending LOGIN in the epoll set
+};
+
+//each worker owns one SO_REUSEPORT listener (shard), the kernel balances new connections between them
+void epollLoop(int listenSocket); //accepts and serves clients of one shard
+void startWorkers(int port); //creates one listener per worker and runs epollLoop() in pinned worker threads
+void raiseDescriptorLimit(); //raises the soft limit of open files to the hard one, every client holds a socket in this process
+bool refuseClient(int listenSocket, int &spareFile); //accepts and closes one client with the spare descriptor when out of descriptors
+bool readFromConnection(Connection &connection); //reads available data and processes all complete messages
+bool processInput(Connection &connection, const char *data, size_t length); //processes complete messages in data, keeps the rest while a LOGIN is pending
+bool processMessage(Connection &connection); //runs mailerLogic() for the message in session.stringBuffer and queues the response
+bool continueConnection(Connection &connection); //checks the pending LOGIN, once it is answered the input that arrived meanwhile is processed
+bool watchConnection(int epollFd, Connection &connection, std::unordered_set<int> &pendingLogins); //updates epoll events of client and LDAP socket, false if the connection is done
+int loginTimeout(std::unordered_map<int, Connection> &connections, const std::unordered_set<int> &pendingLogins); //milliseconds epoll_wait() may sleep, -1 without pending logins
+void queueMessage(Connection &connection); //appends session.stringBuffer (and session.responseFiles) as a framed message to the output
+bool flushConnection(Connection &connection); //sends as much of the output as the socket accepts
+void closeConnection(Connection &connection); //closes socket and files that were not sent yet, drops a partly received message
+
 //--- Communication logic (sending and reveiving messages) ---
 
-std::string stringBuffer; //gloabl variable for input/output buffer
-std::string line;
+void connectionLogic(Session &session); //receives and sends messages to and from client
 
-void connectionLogic(); //receives and sends messages to and from client
+int sendMessage(Session &session); //sends message from stringBuffer (followed by responseFiles) to client
+bool sendString(int socket, const std::string &data); //sends all bytes of data
+bool sendFile(int socket, MessageFile &file); //streams a file region to the socket with sendfile(), closes the file
+size_t responseLength(const Session &session); //stringBuffer and all responseFiles
+void closeResponseFiles(Session &session); //closes files of a response that is not sent
+int receiveMessage(Session &session); //receives message from client and writes it to stringBuffer
 
-int sendMessage(); //sends message from stringBuffer to client
-int receiveMessage(); //receives message from client and writes it to stringBuffer
+#define RECEIVE_BUFFER_SIZE (64 * 1024)
+#define MESSAGE_MEMORY_LIMIT (64 * 1024) //larger SEND bodies are streamed to a temporary file, other commands this large are rejected
 
-//--- Mailer logic ---
+#define RECEIVE_INCOMPLETE 0 //all data consumed, message is not complete yet
+#define RECEIVE_COMPLETE 1 //message is complete, data that was not consumed belongs to the next message
+#define RECEIVE_TOO_LARGE 2 //message is larger than maxMessageSize, connection has to be closed
+
+size_t maxMessageSize = MAX_MESSAGE_SIZE;
 
-#define SEND 1
-#define LIST 2
-#define READ 3
-#define DEL 4
-#define QUIT 5
-#define ERROR 6
-#define LOGIN 7
+int receiveData(Session &session, const char *data, size_t length, size_t &consumed); //feeds received bytes into the current message (frames and chunks)
+size_t frameHeaderSize(const Session &session); //size of the header of the frame being received, known once its length is there
+size_t buildFrameHeader(const Session &session, size_t length, char *header); //header of a response (tagged like the request), returns its size or 0 if length does not fit into a frame
+void rejectOversizedResponse(Session &session); //replaces a response that does not fit into a frame with ERR
+void appendToMessage(Session &session, const char *data, size_t length); //adds payload to stringBuffer or the staged SEND body
+void stageMessage(Session &session); //moves the body of a large SEND from stringBuffer to a temporary file, drops anything else that large
 
-int stringCommandToInt(std::string functionString); //enables switch case for commands
+//--- Mailer logic ---
 
-void mailerLogic(); //main logic for mailer functions
+void mailerLogic(Session &session); //main logic for mailer functions
 
 //functions for the different mailer commands, used in mailerLogic()
-void login(std::istringstream &inputString);
-void send(std::istringstream &inputString);
-void list();
-void read(std::istringstream &inputString);
-void del(std::istringstream &inputString);
-
-bool checkUsername(std::string &username); //checks if username is valid
-bool checkSubject(std::string &subject); //checks if email subject is valid
+//the request is read with a RequestReader (protocolSrc/parser.h) that points into session.request
+//READ and DEL take a single message-id or a list ("1,3,5-9"), SEND a single receiver or a list ("user1,user2"),
+//lists are answered with "OK\n<count>\n" and one status line per item (READ: "<id> OK <length>\n<message>" or "<id> ERR\n")
+//LIST takes an optional range ("<offset>,<limit>" or "SINCE <id>,<limit>") and answers only the entries in it
+//SEARCH takes a line of terms (words, "from:<user>", "subject:<word>") and answers like LIST with the messages that contain all of them
+void login(Session &session, RequestReader &request);
+void send(Session &session, RequestReader &request);
+void list(Session &session, RequestReader &request);
+void read(Session &session, RequestReader &request);
+void del(Session &session, RequestReader &request);
+void search(Session &session, RequestReader &request);
+void stats(Session &session); //metrics (metricsSrc/metrics.h) in the Prometheus text format, only for clients on the same host
+
+//in epoll mode LOGIN does not wait for the LDAP bind, the worker serves other clients meanwhile and answers it later
+void continueLogin(Session &session); //sends or checks the LDAP bind of a pending LOGIN, calls finishLogin() once it is done
+void finishLogin(Session &session, bool authenticated); //writes the response of LOGIN
+
+std::string joinReceivers(const std::vector<std::string_view> &receivers); //valid receivers without duplicates, comma-separated for the header of the message
 
 char* dataDirectory; //directory where the mail data will be stored
 
-int fileLock; //file descriptor for dataDirectory, used to lock entire filesystem
-void lock(); //lock filesystem
-void unlock(); //unlock filesystem
+#define COMPACTION_INTERVAL 60 //seconds between two compaction runs of the storage backend
 
-//--- Session handling and blacklist ---
+Storage *storage; //backend for messages, selected with -s
+int durability = WAL_BATCHED; //write-ahead log of SEND (storageSrc/writeAheadLog.h), selected with -D
+void compactionLoop(); //runs storage->compact() periodically in a background thread
 
-bool loggedIn = false;
-std::string sessionUsername; //set once user is logged in
-std::string clientIP;
+//--- Blacklist ---
 
-bool checkIfIPisBlacklisted(); //check if ip of currently connected client is blacklisted
-void addFailedLoginAttempt(); //add a failed login attempt to ip of currently connected client
-void addIPtoBlacklist(); //blacklist ip, automatically called by addFailedLoginAttempt() when ip had to many failed login attempts
+//failed attempts and blacklist are counted in a table in shared memory (ldapAuthSrc/loginTable.h)
+bool checkIfIPisBlacklisted(const std::string &clientIP); //check if ip of currently connected client is blacklisted
+void addFailedLoginAttempt(const std::string &clientIP); //add a failed login attempt to ip of currently connected client, blacklists it after too many
+
+int loginSnapshotInterval = LOGIN_SNAPSHOT_INTERVAL;
+void loginSnapshotLoop(); //saves the login table to the data directory periodically in a background thread
 
 // --- Main ---
 
+#ifndef TWMAILER_NO_MAIN //bench/serverBench.cpp includes this file to benchmark its functions directly
+
 int main(int argc, char *argv[]) {
 
-    if(argc < 3){
-        fprintf(stderr, "Usage: %s <port> <mail-spool-directoryname>\n", argv[0]);
+    int option;
+    std::string storageType = STORAGE_DIRECTORY;
+    LDAPConfig ldapConfig;
+    int authCacheTTL = AUTH_CACHE_DEFAULT_TTL;
+    int authCacheSize = AUTH_CACHE_DEFAULT_SIZE;
+    int logRateLimit = LOG_DEFAULT_RATE_LIMIT;
+    while((option = getopt(argc, argv, "m:t:s:l:u:d:c:nw:a:A:b:v:r:D:")) != -1){
+        switch(option){
+            case 'm':
+                if(strcmp(optarg, "fork") == 0){
+                    serverMode = MODE_FORK;
+                } else if(strcmp(optarg, "epoll") == 0){
+                    serverMode = MODE_EPOLL;
+                } else {
+                    fprintf(stderr, "Unknown mode: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                numberOfWorkers = atoi(optarg);
+                if(numberOfWorkers < 0){
+                    fprintf(stderr, "Invalid number of worker threads: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                storageType = optarg;
+                break;
+            case 'l':
+                if(atoll(optarg) <= 0 || atoll(optarg) > FRAME_LENGTH_MASK){
+                    fprintf(stderr, "Invalid max. message size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                maxMessageSize = atoll(optarg);
+                break;
+            case 'u':
+                ldapConfig.uri = optarg;
+                break;
+            case 'd':
+                ldapConfig.dnTemplate = optarg;
+                break;
+            case 'c':
+                ldapConfig.poolSize = atoi(optarg);
+                break;
+            case 'n':
+                ldapConfig.startTLS = false;
+                break;
+            case 'w':
+                ldapConfig.timeout = atoi(optarg);
+                break;
+            case 'a':
+                authCacheTTL = atoi(optarg);
+                break;
+            case 'A':
+                authCacheSize = atoi(optarg);
+                break;
+            case 'b':
+                loginSnapshotInterval = atoi(optarg);
+                break;
+            case 'v':
+                logLevel = parseLogLevel(optarg);
+                if(logLevel == -1){
+                    fprintf(stderr, "Unknown log level: %s (error, warn, info or debug)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                logRateLimit = atoi(optarg);
+                break;
+            case 'D':
+                durability = parseDurability(optarg);
+                if(durability == -1){
+                    fprintf(stderr, "Unknown durability: %s (none, batched or per-message)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-m fork|epoll] [-t workers] [-s directory|segment] [-l max-message-size] [-u ldap-uri] [-d ldap-dn-template] [-c ldap-connections] [-n] [-w ldap-timeout] [-a auth-cache-ttl] [-A auth-cache-size] [-b login-snapshot-interval] [-v error|warn|info|debug] [-r log-records-per-second] [-D none|batched|per-message] <port> <mail-spool-directoryname>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if(argc - optind < 2){
+        fprintf(stderr, "Usage: %s [-m fork|epoll] [-t workers] [-s directory|segment] [-l max-message-size] [-u ldap-uri] [-d ldap-dn-template] [-c ldap-connections] [-n] [-w ldap-timeout] [-a auth-cache-ttl] [-A auth-cache-size] [-b login-snapshot-interval] [-v error|warn|info|debug] [-r log-records-per-second] [-D none|batched|per-message] <port> <mail-spool-directoryname>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    if (signal(SIGINT, signalHandler) == SIG_ERR) {
-        perror("signal can not be registered");
+    int port = std::stoi(argv[optind]);
+
+    if(!LDAPconfigure(ldapConfig)){
+        fprintf(stderr, "Invalid LDAP settings: dn template needs exactly one %%s, at least one connection and a timeout of at least one second\n");
         exit(EXIT_FAILURE);
     }
 
-    if (signal(SIGUSR1, signalHandler) == SIG_ERR) {
-        perror("signal can not be registered");
+    blockSignals();
+    initLogger(logLevel, logRateLimit);
+    std::thread(signalLoop).detach();
+
+    //sendfile() has no MSG_NOSIGNAL, a closed socket is handled by its return value instead
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        logErrno("signal can not be registered");
         exit(EXIT_FAILURE);
     }
 
-    socklen_t addrlen;
-    struct sockaddr_in address, cliaddress;
-    
-    dataDirectory = argv[2];
+    dataDirectory = argv[optind + 1];
 
     //make sure that data directory exists
     fs::path p{dataDirectory};
     create_directory(p); //ok to use even if directory already exists
 
-    p /= "messages";
-    create_directory(p);
+    initLocks(dataDirectory);
+    initAuthCache(authCacheSize, authCacheTTL);
+    initMetrics(numberOfWorkers != 0 ? numberOfWorkers : std::max((int)std::thread::hardware_concurrency(), 1));
+
+    LoginPolicy loginPolicy;
+    loginPolicy.maxFailedAttempts = MAX_FAILED_LOGIN_ATTEMPTS;
+    loginPolicy.failedAttemptTime = FAILED_LOGIN_ATTEMPT_TIME;
+    loginPolicy.blacklistTime = IP_BLACKLIST_TIME;
+    initLoginTable(loginPolicy);
+    loadLoginTable((p / LOGIN_TABLE_SNAPSHOT_FILE).string());
+
+    storage = createStorage(storageType, dataDirectory);
+    if(storage == nullptr){
+        fprintf(stderr, "Unknown storage backend: %s\n", storageType.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    //messages that were acknowledged before a crash but did not reach their mailboxes are delivered before any client is served
+    if(!initWriteAheadLog(dataDirectory, durability)){
+        exit(EXIT_FAILURE);
+    }
+    replayWriteAheadLog(storage);
+    logInfo("File operations use %s", fileBatchMethod());
+
+    std::thread(compactionLoop).detach();
+    if(loginSnapshotInterval > 0){
+        std::thread(loginSnapshotLoop).detach();
+    }
+
+    logInfo("Waiting for connections...");
+
+    if(serverMode == MODE_EPOLL){
+        startWorkers(port);
+    } else {
+        create_socket = createListenSocket(port);
+        forkLoop();
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+#endif
 
-    if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("Error creating socket");
+int createListenSocket(int port){
+
+    int listenSocket;
+    struct sockaddr_in address;
+
+    if ((listenSocket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        logErrno("Error creating socket");
         exit(EXIT_FAILURE);
     }
     
     int option_value = 1;
-    if (setsockopt(create_socket, SOL_SOCKET, SO_REUSEADDR, &option_value, sizeof(option_value)) == -1) {
-        perror("set socket options - reuseAddr");
+    if (setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &option_value, sizeof(option_value)) == -1) {
+        logErrno("set socket options - reuseAddr");
         exit(EXIT_FAILURE);
     }
 
-    if (setsockopt(create_socket, SOL_SOCKET, SO_REUSEPORT, &option_value, sizeof(option_value)) == -1) {
-        perror("set socket options - reusePort");
+    if (setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &option_value, sizeof(option_value)) == -1) {
+        logErrno("set socket options - reusePort");
         exit(EXIT_FAILURE);
     }
 
     memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(std::stoi(argv[1]));
+    address.sin_port = htons(port);
 
-    if (bind(create_socket, (struct sockaddr *)&address, sizeof(address)) == -1) {
-        perror("bind error");
+    if (bind(listenSocket, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        logErrno("bind error");
         exit(EXIT_FAILURE);
     }
 
-    if (listen(create_socket, 5) == -1)
+    if (listen(listenSocket, 5) == -1)
     {
-      perror("listen error");
+      logErrno("listen error");
       exit(EXIT_FAILURE);
     }
 
-    printf("Waiting for connections...\n");
-    
+    return listenSocket;
+}
+
+void forkLoop(){
+
+    socklen_t addrlen;
+    struct sockaddr_in cliaddress;
+    int current_socket;
+
     while (1)
     {
         addrlen = sizeof(struct sockaddr_in);
         if ((current_socket = accept(create_socket, (struct sockaddr *)&cliaddress, &addrlen)) == -1) {
-            perror("accept");
+            logErrno("accept");
             break;
         }
 
+        //responses are written in pieces (header, text, files), coalescing is done with MSG_MORE instead of
+        //Nagle, which would hold the last piece back until the delayed ACK of the client
+        int noDelay = 1;
+        setsockopt(current_socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        countConnectionOpened();
+
         if((pid = fork()) == 0){   
             close(create_socket);
-            clientIP.assign(inet_ntoa(cliaddress.sin_addr));
-            printf("\nClient connected from %s:%d\n", inet_ntoa(cliaddress.sin_addr), ntohs(cliaddress.sin_port));
-            printf("Client with will be handled by child process %d\n", getpid());
-            connectionLogic();
+            restartLoggerAfterFork();
+            std::thread(signalLoop).detach();
+            Session session;
+            session.socket = current_socket;
+            session.clientIP.assign(inet_ntoa(cliaddress.sin_addr));
+            logInfo("Client connected from %s:%d, handled by child process %d", inet_ntoa(cliaddress.sin_addr), ntohs(cliaddress.sin_port), getpid());
+            connectionLogic(session);
+            countConnectionClosed();
             kill(getppid(), SIGUSR1); //send custom signal to parent process before exiting child process
             exit(EXIT_SUCCESS);
         } else {
             close(current_socket);
         }
     }
+}
 
-    exit(EXIT_SUCCESS);
+void startWorkers(int port){
+
+    raiseDescriptorLimit();
+
+    int numberOfCores = (int)std::thread::hardware_concurrency();
+    if(numberOfCores < 1){
+        numberOfCores = 1;
+    }
+    if(numberOfWorkers == 0){
+        numberOfWorkers = numberOfCores;
+    }
+
+    //create all listeners up front so bind errors are reported before any worker starts
+    std::vector<int> listenSockets;
+    for(int i = 0; i < numberOfWorkers; i++){
+        listenSockets.push_back(createListenSocket(port));
+    }
+
+    if(numberOfWorkers == 1){
+        epollLoop(listenSockets[0]);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for(int i = 0; i < numberOfWorkers; i++){
+        workers.emplace_back(epollLoop, listenSockets[i]);
+
+        //pin worker to one core, so connections of a shard stay on the same cpu
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(i % numberOfCores, &cpuSet);
+        if(pthread_setaffinity_np(workers.back().native_handle(), sizeof(cpu_set_t), &cpuSet) != 0){
+            logWarn("Could not pin worker %d to core %d", i, i % numberOfCores);
+        }
+    }
+
+    for(auto &worker : workers){
+        worker.join();
+    }
 }
 
-void connectionLogic(){
+void raiseDescriptorLimit(){
 
-    stringBuffer = "Welcome to TWMailer!\n";
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == limit.rlim_max){
+        return;
+    }
 
-    //sends Message from stringBuffer
-    if(!sendMessage()){
+    rlim_t previous = limit.rlim_cur;
+    limit.rlim_cur = limit.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &limit) == -1){
+        logErrno("setrlimit");
         return;
-    };
+    }
+    logInfo("Raised limit of open files from %llu to %llu", (unsigned long long)previous, (unsigned long long)limit.rlim_cur);
+}
+
+bool refuseClient(int listenSocket, int &spareFile){
+
+    //the listener is level-triggered, a client that can not be accepted wakes up epoll_wait() again at once, so the
+    //spare descriptor is given up to accept the client and close it right away (it sees its connection closed)
+    if(spareFile == -1){
+        spareFile = open("/dev/null", O_RDONLY | O_CLOEXEC); //another worker may have taken it last time
+    }
+    if(spareFile == -1){
+        return false;
+    }
+    close(spareFile);
+
+    int clientSocket = accept4(listenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(clientSocket != -1){
+        close(clientSocket);
+        logWarn("Out of file descriptors, refused a client");
+    }
+
+    spareFile = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return clientSocket != -1;
+}
+
+void epollLoop(int listenSocket){
+
+    int epollFd = epoll_create1(0);
+    if(epollFd == -1){
+        logErrno("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = listenSocket;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSocket, &event) == -1){
+        logErrno("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    std::unordered_map<int, Connection> connections;
+    std::unordered_set<int> pendingLogins; //client sockets whose LOGIN waits for LDAP
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int spareFile = open("/dev/null", O_RDONLY | O_CLOEXEC); //see refuseClient()
+
+    logInfo("Worker %ld running in epoll mode (process %d)", (long)gettid(), getpid());
+
+    while(1){
+
+        int numberOfEvents = epoll_wait(epollFd, events, EPOLL_MAX_EVENTS, loginTimeout(connections, pendingLogins));
+        if(numberOfEvents == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            logErrno("epoll_wait");
+            break;
+        }
+
+        for(int i = 0; i < numberOfEvents; i++){
+
+            //new clients on listening socket
+            if(events[i].data.fd == listenSocket){
+                while(1){
+                    struct sockaddr_in cliaddress;
+                    socklen_t addrlen = sizeof(struct sockaddr_in);
+                    int clientSocket = accept4(listenSocket, (struct sockaddr *)&cliaddress, &addrlen, SOCK_NONBLOCK);
+                    if(clientSocket == -1){
+                        if((errno == EMFILE || errno == ENFILE) && refuseClient(listenSocket, spareFile)){
+                            continue;
+                        }
+                        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                            logErrno("accept");
+                        }
+                        break;
+                    }
+
+                    int noDelay = 1; //see forkLoop()
+                    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+                    char ipString[INET_ADDRSTRLEN]; //inet_ntoa() is not thread-safe
+                    inet_ntop(AF_INET, &cliaddress.sin_addr, ipString, sizeof(ipString));
+                    logInfo("Client connected from %s:%d", ipString, ntohs(cliaddress.sin_port));
+
+                    Connection &connection = connections[clientSocket];
+                    connection = Connection();
+                    connection.session.socket = clientSocket;
+                    connection.session.clientIP.assign(ipString);
+
+                    memset(&event, 0, sizeof(event));
+                    event.events = EPOLLIN;
+                    event.data.fd = clientSocket;
+                    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event) == -1){
+                        logErrno("epoll_ctl");
+                        close(clientSocket);
+                        connections.erase(clientSocket);
+                        continue;
+                    }
+                    countConnectionOpened(); //closed in closeConnection()
+
+                    connection.session.stringBuffer = "Welcome to TWMailer!\n";
+                    queueMessage(connection);
+                    if(!flushConnection(connection)){
+                        closeConnection(connection);
+                        connections.erase(clientSocket);
+                    }
+                }
+                continue;
+            }
+
+            //result of a pending LOGIN on its LDAP socket
+            if(events[i].data.u64 & LDAP_EVENT){
+                auto it = connections.find((int)(events[i].data.u64 & ~LDAP_EVENT));
+                if(it == connections.end() || !it->second.session.loginPending){
+                    continue;
+                }
+                if(!continueConnection(it->second) || !watchConnection(epollFd, it->second, pendingLogins)){
+                    pendingLogins.erase(it->first);
+                    closeConnection(it->second);
+                    connections.erase(it);
+                }
+                continue;
+            }
+
+            auto it = connections.find(events[i].data.fd);
+            if(it == connections.end()){
+                continue;
+            }
+            Connection &connection = it->second;
+
+            bool keepOpen = true;
+
+            if(events[i].events & EPOLLERR){
+                keepOpen = false;
+            }
+
+            //the client socket is not read while a LOGIN is pending, a hang up would be reported again and again
+            if(connection.session.loginPending && (events[i].events & EPOLLHUP)){
+                keepOpen = false;
+            }
+
+            //EPOLLHUP is handled by recv() returning 0
+            if(keepOpen && (events[i].events & (EPOLLIN | EPOLLHUP))){
+                keepOpen = readFromConnection(connection);
+            }
+
+            if(keepOpen){
+                keepOpen = flushConnection(connection);
+            }
+
+            if(!keepOpen || !watchConnection(epollFd, connection, pendingLogins)){
+                pendingLogins.erase(it->first);
+                closeConnection(connection); //closing the socket also removes it from epoll set
+                connections.erase(it);
+            }
+        }
+
+        //logins that wait for a pooled LDAP connection or are over their deadline
+        std::vector<int> dueLogins;
+        for(int clientSocket : pendingLogins){
+            LDAPBind &bind = connections[clientSocket].session.bind;
+            if(bind.socket == -1 || LDAPnextCheck(bind) == 0){
+                dueLogins.push_back(clientSocket);
+            }
+        }
+        for(int clientSocket : dueLogins){
+            auto it = connections.find(clientSocket);
+            if(!continueConnection(it->second) || !watchConnection(epollFd, it->second, pendingLogins)){
+                pendingLogins.erase(it->first);
+                closeConnection(it->second);
+                connections.erase(it);
+            }
+        }
+    }
+
+    close(epollFd);
+}
+
+bool readFromConnection(Connection &connection){
+
+    char buffer[RECEIVE_BUFFER_SIZE];
+
+    //input of a connection with a pending LOGIN waits in the socket buffer
+    while(!connection.session.loginPending){
+        ssize_t bytesReceived = recv(connection.session.socket, buffer, sizeof(buffer), 0);
+        if(bytesReceived == -1){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+            if(errno == EINTR){
+                continue;
+            }
+            logErrno("recv error");
+            return false;
+        }
+        if(bytesReceived == 0){
+            logInfo("Client closed remote socket");
+            return false;
+        }
+        countBytesReceived(bytesReceived);
+
+        if(!processInput(connection, buffer, bytesReceived)){
+            return false;
+        }
+    }
 
-    //set up file descriptor for file lock
-    if((fileLock = open(fs::path(dataDirectory).string().c_str(), O_DIRECTORY, O_RDWR)) == -1){
-        perror("open");
+    return true;
+}
+
+bool processInput(Connection &connection, const char *data, size_t length){
+
+    //process every complete message, a message that is not complete yet stays in the session
+    size_t index = 0;
+    while(!connection.closeAfterWrite && index < length){
+
+        //responses have to stay in order, so nothing after a pending LOGIN is processed before it is answered
+        if(connection.session.loginPending){
+            connection.pendingInput.append(&data[index], length - index);
+            break;
+        }
+
+        size_t consumed;
+        long long start = metricsClock();
+        int result = receiveData(connection.session, &data[index], length - index, consumed);
+        connection.session.parseTime += metricsClock() - start;
+        index += consumed;
+
+        if(result == RECEIVE_TOO_LARGE){
+            connection.session.stringBuffer = "ERR\n";
+            queueMessage(connection);
+            connection.closeAfterWrite = true;
+        }
+
+        if(result == RECEIVE_COMPLETE && !processMessage(connection)){
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool processMessage(Connection &connection){
+
+    if(connection.session.stringBuffer == "QUIT\n"){
+        logInfo("Client sent QUIT");
+        connection.closeAfterWrite = true;
+        return true;
+    }
+
+    mailerLogic(connection.session);
+
+    //answered by continueConnection() once the LDAP server replied
+    if(connection.session.loginPending){
+        return true;
+    }
+
+    queueMessage(connection);
+
+    return true;
+}
+
+bool continueConnection(Connection &connection){
+
+    continueLogin(connection.session);
+    if(connection.session.loginPending){
+        return true;
+    }
+
+    queueMessage(connection);
+
+    std::string input;
+    input.swap(connection.pendingInput);
+    if(!processInput(connection, input.data(), input.size())){
+        return false;
+    }
+
+    return flushConnection(connection);
+}
+
+bool watchConnection(int epollFd, Connection &connection, std::unordered_set<int> &pendingLogins){
+
+    Session &session = connection.session;
+    bool writePending = !connection.output.empty();
+
+    if(connection.closeAfterWrite && !writePending){
+        return false;
+    }
+
+    if(session.loginPending){
+        pendingLogins.insert(session.socket);
+    } else {
+        pendingLogins.erase(session.socket);
+    }
+
+    struct epoll_event event;
+
+    //the LDAP socket of a pending LOGIN is watched instead of the client socket (-1 while it waits for a pooled connection)
+    int loginSocket = session.loginPending ? session.bind.socket : -1;
+    if(connection.watchedLoginSocket != -1 && connection.watchedLoginSocket != loginSocket){
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, connection.watchedLoginSocket, NULL); //fails if the connection was closed already, which also removed it
+    }
+    if(loginSocket != -1){
+        //added every time: a replacement connection can get the number of the closed one, which epoll dropped (EEXIST otherwise)
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u64 = LDAP_EVENT | (uint32_t)session.socket;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, loginSocket, &event);
+    }
+    connection.watchedLoginSocket = loginSocket;
+
+    //only wait for EPOLLOUT while there is something left to send
+    memset(&event, 0, sizeof(event));
+    event.events = 0;
+    if(!session.loginPending){
+        event.events |= EPOLLIN;
+    }
+    if(writePending){
+        event.events |= EPOLLOUT;
+    }
+    event.data.fd = session.socket;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, session.socket, &event);
+
+    return true;
+}
+
+int loginTimeout(std::unordered_map<int, Connection> &connections, const std::unordered_set<int> &pendingLogins){
+
+    int timeout = -1;
+    for(int clientSocket : pendingLogins){
+        int nextCheck = LDAPnextCheck(connections[clientSocket].session.bind);
+        if(timeout == -1 || nextCheck < timeout){
+            timeout = nextCheck;
+        }
+    }
+
+    return timeout;
+}
+
+void queueMessage(Connection &connection){
+
+    //same framing as sendMessage(): length of message first, then the message
+    Session &session = connection.session;
+    char header[FRAME_TAGGED_HEADER_SIZE];
+    size_t headerSize = buildFrameHeader(session, responseLength(session), header);
+    if(headerSize == 0){
+        rejectOversizedResponse(session);
+        headerSize = buildFrameHeader(session, responseLength(session), header);
+    }
+
+    //bytes are appended to the last chunk unless that one is a file
+    if(connection.output.empty() || connection.output.back().file.file != -1){
+        connection.output.emplace_back();
+    }
+    connection.output.back().data.append(header, headerSize);
+    connection.output.back().data.append(session.stringBuffer);
+
+    for(auto &responseFile : session.responseFiles){
+        connection.output.emplace_back();
+        connection.output.back().file = responseFile.file;
+        if(!responseFile.after.empty()){
+            connection.output.emplace_back();
+            connection.output.back().data.swap(responseFile.after);
+        }
+    }
+    session.responseFiles.clear();
+}
+
+bool flushConnection(Connection &connection){
+
+    if(connection.output.empty()){
+        return true;
+    }
+    long long start = metricsClock();
+
+    while(!connection.output.empty()){
+
+        OutputChunk &chunk = connection.output.front();
+        ssize_t bytesSent;
+
+        if(chunk.file.file != -1){
+            if(chunk.file.length == 0){
+                close(chunk.file.file);
+                connection.output.pop_front();
+                continue;
+            }
+            bytesSent = sendfile(connection.session.socket, chunk.file.file, &chunk.file.offset, chunk.file.length);
+        } else {
+            if(chunk.dataSent == chunk.data.size()){
+                connection.output.pop_front();
+                continue;
+            }
+            //MSG_MORE if another chunk follows, so header, text and file of a response leave in as few packets as possible
+            int flags = MSG_NOSIGNAL | (connection.output.size() > 1 ? MSG_MORE : 0);
+            bytesSent = send(connection.session.socket, &chunk.data.data()[chunk.dataSent], chunk.data.size() - chunk.dataSent, flags);
+        }
+
+        if(bytesSent == -1){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                countPhase(METRICS_PHASE_SEND, metricsClock() - start);
+                return true; //socket buffer full, continue on EPOLLOUT
+            }
+            if(errno == EINTR){
+                continue;
+            }
+            logErrno("send error");
+            return false;
+        }
+
+        countBytesSent(bytesSent);
+
+        if(chunk.file.file != -1){
+            if(bytesSent == 0){ //file is shorter than expected, the frame can not be completed
+                logError("Error - message file ended early");
+                return false;
+            }
+            chunk.file.length -= bytesSent; //sendfile() already advanced the offset
+        } else {
+            chunk.dataSent += bytesSent;
+        }
+    }
+
+    countPhase(METRICS_PHASE_SEND, metricsClock() - start);
+    return true;
+}
+
+void closeConnection(Connection &connection){
+
+    for(auto &chunk : connection.output){
+        if(chunk.file.file != -1){
+            close(chunk.file.file);
+        }
+    }
+    connection.output.clear();
+
+    closeResponseFiles(connection.session);
+
+    storage->discard(connection.session.stagedMessage);
+
+    //closes the LDAP connection, which also removes its socket from the epoll set
+    if(connection.session.loginPending){
+        LDAPcancelBind(connection.session.bind);
+    }
+
+    close(connection.session.socket);
+    countConnectionClosed();
+}
+
+void connectionLogic(Session &session){
+
+    session.stringBuffer = "Welcome to TWMailer!\n";
+
+    //sends Message from stringBuffer
+    if(!sendMessage(session)){
         return;
     };
 
@@ -200,19 +976,20 @@ void connectionLogic(){
     while(1){
 
         //receaves message and saves message in stringBuffer
-        if(!receiveMessage()){
+        if(!receiveMessage(session)){
+            storage->discard(session.stagedMessage);
             return;
         };
 
-        if(stringBuffer == "QUIT\n"){
-            printf("\nClient sent QUIT\n");
+        if(session.stringBuffer == "QUIT\n"){
+            logInfo("Client sent QUIT");
             return;
         }
         
         //processes input, does logic and writes response to stringBuffer
-        mailerLogic();
+        mailerLogic(session);
 
-        if(!sendMessage()){
+        if(!sendMessage(session)){
             return;
         };
 
@@ -221,547 +998,910 @@ void connectionLogic(){
     return;
 }
 
-void mailerLogic(){
+void mailerLogic(Session &session){
 
-    //std::cout << "Received from client: " << *stringBuffer << "\n";
+    //std::cout << "Received from client: " << session.stringBuffer << "\n";
 
-    std::istringstream inputString(stringBuffer);
-    stringBuffer.clear();
+    countPhase(METRICS_PHASE_PARSE, session.parseTime);
+    session.parseTime = 0;
+    session.requestStart = metricsClock();
 
-    std::getline(inputString,line);
+    //message was too large for its command, see stageMessage()
+    if(session.messageTruncated){
+        session.stringBuffer = "ERR\n";
+        countRequest(ERROR, true, metricsClock() - session.requestStart);
+        return;
+    }
+
+    //swapping keeps the capacity of both buffers, so there is no allocation for the request or the response
+    session.request.swap(session.stringBuffer);
+    session.stringBuffer.clear();
+
+    RequestReader request{session.request};
+    std::string_view commandName;
+    request.nextLine(commandName);
+    int command = parseCommand(commandName);
 
-    switch (stringCommandToInt(line)) {
+    switch (command) {
         case LOGIN:
-            login(inputString);
+            login(session, request);
             break;
 
         case SEND:
-            send(inputString);
+            send(session, request);
             break;
 
         case LIST:
-            list();
+            list(session, request);
             break;
 
         case READ:
-            read(inputString);
+            read(session, request);
             break;
 
         case DEL:
-            del(inputString);
+            del(session, request);
+            break;
+
+        case SEARCH:
+            search(session, request);
+            break;
+
+        case STATS:
+            stats(session);
             break;
 
         case QUIT:
             break;
 
         case ERROR:
-            stringBuffer = "ERROR - Command not recognized by server.";
+            session.stringBuffer = "ERROR - Command not recognized by server.";
             break;
     }
 
+    //staged SEND body that was not delivered (e.g. invalid receiver)
+    storage->discard(session.stagedMessage);
+
+    //a pending LOGIN is counted once it is answered, see continueLogin()
+    if(!session.loginPending){
+        countRequest(command, session.stringBuffer.compare(0, 3, "ERR") == 0, metricsClock() - session.requestStart);
+    }
 }
 
-void login(std::istringstream &inputString){
+void login(Session &session, RequestReader &request){
     
-    if(checkIfIPisBlacklisted()){
-        sessionUsername.clear();
-        loggedIn = false;
-        stringBuffer = "ERR\n";
+    if(checkIfIPisBlacklisted(session.clientIP)){
+        session.sessionUsername.clear();
+        session.loggedIn = false;
+        session.stringBuffer = "ERR\n";
         return;
     }
     
-    std::string loginUsername;
-    std::string loginPassword;
+    std::string_view loginUsername;
+    std::string_view loginPassword;
     
-    std::getline(inputString, loginUsername);
-    std::getline(inputString, loginPassword);
+    request.nextLine(loginUsername);
+    request.nextLine(loginPassword);
 
     //test accounts for debugging
     if((loginUsername == "test1" || loginUsername == "test2") && loginPassword == "test" && ENABLE_TEST_ACCOUNTS){
-        printf("Client in child process %d sucessfully logged in as %s\n", getpid(), loginUsername.c_str());
-        sessionUsername = loginUsername;
-        loggedIn = true;
-        stringBuffer = "OK\n";
+        logInfo("Client %s sucessfully logged in as %.*s", session.clientIP.c_str(), (int)loginUsername.length(), loginUsername.data());
+        session.sessionUsername = loginUsername;
+        session.loggedIn = true;
+        session.stringBuffer = "OK\n";
         return;
     }
     
-    //actual authentication with LDAP
-    if(LDAPauthenticate(loginUsername, loginPassword)){    
-        printf("Client in child process %d sucessfully logged in as %s\n", getpid(), loginUsername.c_str());
-        sessionUsername = loginUsername;
-        loggedIn = true;
-        stringBuffer = "OK\n";
+    //actual authentication with LDAP, unless the same user logged in with the same password a short time ago
+    session.loginUsername = loginUsername;
+    session.loginPassword = loginPassword;
+    if(checkAuthCache(session.loginUsername, session.loginPassword)){
+        finishLogin(session, true);
         return;
     }
 
-    addFailedLoginAttempt();
+    if(serverMode == MODE_EPOLL){
+        session.loginPending = true;
+        if(LDAPstartBind(session.loginUsername, session.loginPassword, session.bind) == LDAP_BIND_PENDING){
+            return;
+        }
+        finishLogin(session, false);
+        return;
+    }
 
-    sessionUsername.clear();
-    loggedIn = false;
-    stringBuffer = "ERR\n";
+    bool authenticated = LDAPauthenticate(session.loginUsername, session.loginPassword);
+    if(authenticated){
+        addToAuthCache(session.loginUsername, session.loginPassword);
+    }
+    finishLogin(session, authenticated);
 }
 
-void send(std::istringstream &inputString){
+void continueLogin(Session &session){
 
-    if(!loggedIn){
-        stringBuffer = "ERR\n";
+    int result = LDAPcheckBind(session.bind);
+    if(result == LDAP_BIND_PENDING){
         return;
     }
 
-    std::string receiver;
-    std::string subject;
+    if(result == LDAP_BIND_SUCCESS){
+        addToAuthCache(session.loginUsername, session.loginPassword);
+    }
+    finishLogin(session, result == LDAP_BIND_SUCCESS);
+    countRequest(LOGIN, result != LDAP_BIND_SUCCESS, metricsClock() - session.requestStart);
+}
+
+void finishLogin(Session &session, bool authenticated){
+
+    session.loginPending = false;
+    session.bind = LDAPBind();
 
-    std::getline(inputString,receiver);
-    std::getline(inputString,subject);
+    if(authenticated){
+        logInfo("Client %s sucessfully logged in as %s", session.clientIP.c_str(), session.loginUsername.c_str());
+        session.sessionUsername.swap(session.loginUsername);
+        session.loggedIn = true;
+        session.stringBuffer = "OK\n";
+    } else {
+        addFailedLoginAttempt(session.clientIP);
+
+        session.sessionUsername.clear();
+        session.loggedIn = false;
+        session.stringBuffer = "ERR\n";
+    }
+
+    session.loginUsername.clear();
+    session.loginPassword.clear();
+}
+
+void send(Session &session, RequestReader &request){
+
+    if(!session.loggedIn){
+        session.stringBuffer = "ERR\n";
+        return;
+    }
+
+    std::string_view receiverLine;
+    std::string_view subject;
+
+    request.nextLine(receiverLine);
+    request.nextLine(subject);
+
+    std::vector<std::string_view> receivers;
+    if(!splitList(receiverLine, receivers)){
+        session.stringBuffer = "ERR\n";
+        return;
+    }
+    bool batch = receivers.size() > 1;
 
     //check if receiver username is valid (min. 1, max. 8 chars, no special chars)
-    if(!checkUsername(receiver)){
-        printf("receiver is not valid!\n");
-        stringBuffer = "ERR\n";
+    //in a list every invalid receiver only fails itself
+    if(!batch && !isValidUsername(receivers[0])){
+        logDebug("receiver is not valid!");
+        session.stringBuffer = "ERR\n";
         return;
     }
 
     //check if subject is valid (max. 80 chars)
-    if(!checkSubject(subject)){
-        printf("subject is not valid!\n");
-        stringBuffer = "ERR\n";
+    if(!isValidSubject(subject)){
+        logDebug("subject is not valid!");
+        session.stringBuffer = "ERR\n";
         return;
     }
 
-    fs::path p{dataDirectory};
-    p /= "messages";
-    p /= receiver; //add receiver to path
-
-    lock();
-         
-    create_directory(p); //ok to use even if directory already exists
+    std::string receiverList = joinReceivers(receivers);
+    std::string subjectString(subject);
 
-    //count number of messages for new message-id
-    int highestMessageId = 0;
-    for (auto const &email : fs::directory_iterator(p)){
-        if(std::stoi(email.path().filename().string()) > highestMessageId){
-            highestMessageId = std::stoi(email.path().filename().string());
+    //large bodies were already streamed to a temporary file while they were received, see stageMessage()
+    //otherwise the rest of the request is the body, it always ends with a newline
+    std::string message;
+    if(session.stagedMessage.file != -1){
+        if(session.stagedMessage.lastByte != '\n' && !storage->append(session.stagedMessage, "\n", 1)){
+            session.stringBuffer = "ERR\n";
+            return;
         }
+    } else {
+        std::string_view body = request.rest;
+        message.reserve(session.sessionUsername.length() + receiverList.length() + subject.length() + body.length() + 4);
+        message.append(session.sessionUsername).append("\n").append(receiverList).append("\n").append(subject).append("\n").append(body);
+        if(!body.empty() && body.back() != '\n'){
+            message += '\n';
+        }
+    }
+
+    //every receiver gets its own copy, stored under the lock of its own mailbox only, a receiver that
+    //is listed twice gets the message once
+    std::vector<std::pair<std::string_view, bool>> results;
+    if(batch){
+        session.stringBuffer = "OK\n" + std::to_string(receivers.size()) + "\n";
     }
 
-    p /= std::to_string(highestMessageId + 1); //set path to message-id
+    //the message is on disk in the write-ahead log before it goes to any mailbox, "OK" is only sent for logged messages
+    long long start = metricsClock();
+    long long lsn = session.stagedMessage.file != -1 ? logStagedMessage(session.stagedMessage) : logMessage(message);
+    if(lsn == -1){
+        countPhase(METRICS_PHASE_STORAGE, metricsClock() - start);
+        session.stringBuffer = "ERR\n";
+        return;
+    }
 
-    //create file and write data to file
-    std::ofstream emailFile(p);
-    emailFile << sessionUsername << "\n";
-    emailFile << receiver << "\n";
-    emailFile << subject << "\n";
+    bool delivered = true;
+    for(auto receiver : receivers){
+        bool success = false;
+
+        auto earlier = std::find_if(results.begin(), results.end(), [receiver](auto const &result){ return result.first == receiver; });
+        if(earlier != results.end()){
+            success = earlier->second;
+        } else if(isValidUsername(receiver)){
+            std::string receiverString(receiver);
+            int id;
+            if(session.stagedMessage.file != -1){
+                id = storage->commit(session.stagedMessage, receiverString);
+            } else {
+                id = storage->deliver(receiverString, session.sessionUsername, subjectString, message);
+            }
+            success = id != -1;
+            if(success){
+                logDelivered(lsn, receiverString, id);
+            }
+            results.emplace_back(receiver, success);
+        }
 
-    //write rest of message to file
-    while(getline (inputString,line)){
-        emailFile << line << "\n";
+        delivered = delivered && success;
+        if(batch){
+            session.stringBuffer.append(receiver).append(success ? " OK\n" : " ERR\n");
+        }
     }
+    finishMessage(lsn);
+    countPhase(METRICS_PHASE_STORAGE, metricsClock() - start);
+
+    if(!batch){
+        session.stringBuffer = delivered ? "OK\n" : "ERR\n";
+    }
+}
 
-    emailFile.close();
+std::string joinReceivers(const std::vector<std::string_view> &receivers){
 
-    unlock();
+    std::string receiverList;
 
-    stringBuffer = "OK\n";
+    for(size_t i = 0; i < receivers.size(); i++){
+        if(!isValidUsername(receivers[i]) || std::find(receivers.begin(), receivers.begin() + i, receivers[i]) != receivers.begin() + i){
+            continue;
+        }
+        if(!receiverList.empty()){
+            receiverList += ',';
+        }
+        receiverList.append(receivers[i]);
+    }
+
+    return receiverList;
 }
 
-void list(){
+void list(Session &session, RequestReader &request){
     
-    if(!loggedIn){
-        stringBuffer = "ERR\n";
+    if(!session.loggedIn){
+        session.stringBuffer = "ERR\n";
         return;
     }
-    
-    fs::path p{dataDirectory};
-    p /= "messages";
-    p /= sessionUsername; //add username to path
 
-    lock();
+    std::string_view line;
+    request.nextLine(line);
 
-    if(!fs::exists(p)){
-        stringBuffer = "0\n";
-        unlock();
+    ListRange range;
+    if(!parseListRange(line, range)){
+        session.stringBuffer = "ERR\n";
         return;
     }
 
-    //count number of messages and write list of messages to stringBuffer
-    int numberOfMessages = 0;
-    
-    for (auto const &email : fs::directory_iterator(p)){
-        numberOfMessages++;
+    std::vector<IndexEntry> entries;
+    long long start = metricsClock();
+    bool found = storage->list(session.sessionUsername, entries);
+    countPhase(METRICS_PHASE_STORAGE, metricsClock() - start);
+    if(!found){
+        session.stringBuffer = "ERR\n";
+        return;
+    }
 
-        std::ifstream emailFile(email.path().string()); 
-        if (emailFile.is_open()) {
-            getline (emailFile,line); //skip first to lines to get to subject
-            getline (emailFile,line);
-            getline (emailFile,line);
-            emailFile.close();
-        }
+    //entries are sorted by message-id, so both kinds of range are a slice of them
+    auto first = entries.begin() + std::min((size_t)range.start, entries.size());
+    if(range.since){
+        first = std::upper_bound(entries.begin(), entries.end(), range.start, [](int id, const IndexEntry &entry){ return id < entry.id; });
+    }
+    auto last = entries.end();
+    if(range.limit != LIST_NO_LIMIT && last - first > range.limit){
+        last = first + range.limit;
+    }
 
-        stringBuffer += "<" + email.path().filename().string() + "> " + line + "\n";
+    //write number of messages and list of messages to stringBuffer
+    session.stringBuffer.append(std::to_string(last - first)).append("\n");
+    for(auto entry = first; entry != last; ++entry){
+        session.stringBuffer.append("<").append(std::to_string(entry->id)).append("> ").append(entry->subject).append("\n");
     }
-    unlock();
-    stringBuffer.insert(0, std::to_string(numberOfMessages) + "\n"); //write number of messages into first line of stringBuffer
 }
 
-void read(std::istringstream &inputString){
+void read(Session &session, RequestReader &request){
 
-    if(!loggedIn){
-        stringBuffer = "ERR\n";
+    if(!session.loggedIn){
+        session.stringBuffer = "ERR\n";
         return;
     }
     
-    fs::path p{dataDirectory};
-    p /= "messages";
-    p /= sessionUsername; //add username to path
-    
-    std::getline(inputString,line);
-    p /= line; //add message-id to path
+    std::string_view line;
+    request.nextLine(line);
+
+    //the messages themselves are not copied, they are sent straight from their files
+
+    if(!isIdList(line)){
+        int id;
+        MessageFile file;
+        long long start = metricsClock();
+        bool found = parseMessageId(line, id) && storage->open(session.sessionUsername, id, file);
+        countPhase(METRICS_PHASE_STORAGE, metricsClock() - start);
+        if(!found){
+            session.stringBuffer = "ERR\n";
+            return;
+        }
 
-    lock();
-    
-    if(!fs::exists(p)){
-        stringBuffer = "ERR\n";
-        unlock();
+        session.stringBuffer = "OK\n";
+        session.responseFiles.push_back(ResponseFile{file, ""});
         return;
     }
 
-    std::ifstream emailFile(p.string()); 
-    
-    if (emailFile.is_open()) {
-        
-        stringBuffer += "OK\n";
-        
-        while(getline (emailFile,line)){
-            stringBuffer += line + "\n";
+    std::vector<int> ids;
+    if(!parseMessageIdList(line, ids)){
+        session.stringBuffer = "ERR\n";
+        return;
+    }
+
+    std::vector<MessageFile> files;
+    long long start = metricsClock();
+    storage->openMessages(session.sessionUsername, ids, files);
+    countPhase(METRICS_PHASE_STORAGE, metricsClock() - start);
+
+    //status line of each message goes after the file of the one before
+    session.responseFiles.reserve(ids.size());
+    std::string *text = &session.stringBuffer;
+    *text = "OK\n" + std::to_string(ids.size()) + "\n";
+
+    for(size_t i = 0; i < ids.size(); i++){
+        if(files[i].file == -1){
+            *text += std::to_string(ids[i]) + " ERR\n";
+            continue;
         }
 
-        emailFile.close();
+        *text += std::to_string(ids[i]) + " OK " + std::to_string(files[i].length) + "\n";
+        session.responseFiles.push_back(ResponseFile{files[i], ""});
+        text = &session.responseFiles.back().after;
     }
 
-    unlock();
+    //the whole list is one frame, a list that does not fit is rejected (the client can read it in smaller lists)
+    if(responseLength(session) > FRAME_LENGTH_MASK){
+        closeResponseFiles(session);
+        session.stringBuffer = "ERR\n";
+    }
 }
 
-void del(std::istringstream &inputString){
+void del(Session &session, RequestReader &request){
 
-    if(!loggedIn){
-        stringBuffer = "ERR\n";
+    if(!session.loggedIn){
+        session.stringBuffer = "ERR\n";
         return;
     }
     
-    fs::path p{dataDirectory};
-    p /= "messages";
-    p /= sessionUsername; //add username to path
-    
-    std::getline(inputString,line);
-    p /= line; //add message-id to path
+    std::string_view line;
+    request.nextLine(line);
+
+    if(!isIdList(line)){
+        int id;
+        long long start = metricsClock();
+        bool removed = parseMessageId(line, id) && storage->remove(session.sessionUsername, id);
+        countPhase(METRICS_PHASE_STORAGE, metricsClock() - start);
+        if(!removed){
+            session.stringBuffer = "ERR\n";
+            return;
+        }
+        logDeleted(session.sessionUsername, id);
 
-    lock();
-    
-    if(!fs::exists(p)){
-        stringBuffer = "ERR\n";
-        unlock();
+        session.stringBuffer = "OK\n";
         return;
     }
 
-    fs::remove(p);
+    std::vector<int> ids;
+    if(!parseMessageIdList(line, ids)){
+        session.stringBuffer = "ERR\n";
+        return;
+    }
 
-    unlock();
+    std::vector<bool> removed;
+    long long start = metricsClock();
+    storage->removeMessages(session.sessionUsername, ids, removed);
+    countPhase(METRICS_PHASE_STORAGE, metricsClock() - start);
 
-    stringBuffer += "OK\n";
+    session.stringBuffer = "OK\n" + std::to_string(ids.size()) + "\n";
+    for(size_t i = 0; i < ids.size(); i++){
+        if(removed[i]){
+            logDeleted(session.sessionUsername, ids[i]);
+        }
+        session.stringBuffer += std::to_string(ids[i]) + (removed[i] ? " OK\n" : " ERR\n");
+    }
 }
 
-int stringCommandToInt(std::string functionString){
-    if (functionString == "SEND") {
-        return SEND;
+void search(Session &session, RequestReader &request){
+
+    if(!session.loggedIn){
+        session.stringBuffer = "ERR\n";
+        return;
     }
-    
-    if (functionString == "LIST") {
-        return LIST;
+
+    std::string_view line;
+    request.nextLine(line);
+
+    std::vector<std::string> terms;
+    if(!parseSearchQuery(line, terms)){
+        session.stringBuffer = "ERR\n";
+        return;
     }
 
-    if (functionString == "READ") {
-        return READ;
+    //the search index only knows message-ids, the subjects come from the mailbox index like for LIST
+    std::vector<int> ids;
+    std::vector<IndexEntry> entries;
+    long long start = metricsClock();
+    bool found = storage->search(session.sessionUsername, terms, ids) && (ids.empty() || storage->list(session.sessionUsername, entries));
+    countPhase(METRICS_PHASE_STORAGE, metricsClock() - start);
+    if(!found){
+        session.stringBuffer = "ERR\n";
+        return;
     }
 
-    if (functionString == "DEL") {
-        return DEL;
+    //both are sorted by message-id, a message deleted in between is left out
+    std::vector<const IndexEntry *> matches;
+    auto entry = entries.begin();
+    for(int id : ids){
+        while(entry != entries.end() && entry->id < id){
+            ++entry;
+        }
+        if(entry != entries.end() && entry->id == id){
+            matches.push_back(&*entry);
+        }
     }
 
-    if (functionString == "QUIT") {
-        return QUIT;
+    session.stringBuffer.append(std::to_string(matches.size())).append("\n");
+    for(auto match : matches){
+        session.stringBuffer.append("<").append(std::to_string(match->id)).append("> ").append(match->subject).append("\n");
     }
+}
+
+void stats(Session &session){
 
-    if (functionString == "LOGIN") {
-        return LOGIN;
+    //the metrics tell a lot about the users of the server, so they are only for admins on the same host
+    if(session.clientIP.compare(0, 4, "127.") != 0){
+        session.stringBuffer = "ERR\n";
+        return;
     }
 
-    return ERROR;
+    session.stringBuffer = "OK\n" + formatMetrics(serverMode == MODE_FORK);
 }
 
-int sendMessage(){
+int sendMessage(Session &session){
 
     //before sending the actual message, another message containing the size of the actual message is sent,
     //so that the client can allocate memory for the message and messages are not limited in size
     //by a fixed buffer
 
-    const uint32_t  stringLength = htonl(stringBuffer.length());
+    long long start = metricsClock();
+    char header[FRAME_TAGGED_HEADER_SIZE];
+    size_t headerSize = buildFrameHeader(session, responseLength(session), header);
+    if(headerSize == 0){
+        rejectOversizedResponse(session);
+        headerSize = buildFrameHeader(session, responseLength(session), header);
+    }
     int bytesSent = -1;
 
     //sends length of upcoming message first
     //set MSG_NOSIGNAL to ignore SIGPIPE error when socket is disconnected (this is handled when recv is called later)
-    bytesSent = send(current_socket, &stringLength, sizeof(uint32_t), MSG_NOSIGNAL);
+    //MSG_MORE lets the kernel put length and message into one packet, a separate small packet would wait for the
+    //delayed ACK of the client (Nagle) and stall pipelined requests
+    bytesSent = send(session.socket, header, headerSize, MSG_NOSIGNAL | MSG_MORE);
 
     if(bytesSent == -1){
-        perror("send error");
+        logErrno("send error");
+        closeResponseFiles(session);
         return false;
     };
 
-    if(bytesSent != sizeof(uint32_t)){
-        printf("Error - could not send length of message.\n");
+    if(bytesSent != (int)headerSize){
+        logError("Error - could not send length of message.");
+        closeResponseFiles(session);
         return false;
     };
+    countBytesSent(bytesSent);
+
+    //now sends actual message, files of READ go straight from the page cache to the socket
 
-    //now sends actual message
+    bool success = sendString(session.socket, session.stringBuffer);
+
+    for(auto &responseFile : session.responseFiles){
+        success = success && sendFile(session.socket, responseFile.file) && sendString(session.socket, responseFile.after);
+    }
+
+    closeResponseFiles(session);
+    countPhase(METRICS_PHASE_SEND, metricsClock() - start);
+
+    return success;
+}
 
-    int bytesLeft = stringBuffer.length();
-    int index = 0;
-    bytesSent = -1;
+bool sendString(int socket, const std::string &data){
+
+    size_t bytesLeft = data.length();
+    size_t index = 0;
 
     while(bytesLeft > 0){
         
-        bytesSent = send(current_socket, &stringBuffer.data()[index], bytesLeft, MSG_NOSIGNAL);
+        ssize_t bytesSent = send(socket, &data.data()[index], bytesLeft, MSG_NOSIGNAL);
         
         if(bytesSent == -1){
-            perror("send error");
+            if(errno == EINTR){
+                continue;
+            }
+            logErrno("send error");
             return false;
         };
 
         bytesLeft -= bytesSent;
         index += bytesSent;
+        countBytesSent(bytesSent);
     }
 
     return true;
 }
 
-int receiveMessage(){
+size_t responseLength(const Session &session){
 
-    //first we receive length of upcoming message
-    uint32_t  lengthOfMessage;
-    uint32_t bytesReceived = -1;
-    bytesReceived = recv(current_socket, &lengthOfMessage, sizeof(uint32_t),0);
-    if (bytesReceived == (unsigned)-1) {
-        perror("recv error");
-        return false;
-    }
-    if (bytesReceived == (unsigned)0) {
-        printf("\nClient closed remote socket\n");
-        return false;
+    size_t length = session.stringBuffer.length();
+    for(auto const &responseFile : session.responseFiles){
+        length += responseFile.file.length + responseFile.after.length();
     }
-    if (bytesReceived != sizeof(uint32_t)) {
-        printf("Error - could not receive length of message.\n");
-        return false;
-    }
-    lengthOfMessage = ntohl(lengthOfMessage);
 
-    //now we receive actual message
-    
-    std::vector<char> receiveBuffer;
-    receiveBuffer.resize(lengthOfMessage); //allocate memory for message
-    
-    bytesReceived = -1;
+    return length;
+}
 
-    //MSG_WAITALL is set so recv waits until entire message is received
-    bytesReceived = recv(current_socket, receiveBuffer.data(), lengthOfMessage, MSG_WAITALL);
-    if (bytesReceived == (unsigned)-1) {
-        perror("recv error");
-        return false;
-    }
-    if (bytesReceived == (unsigned)0) {
-        printf("\nClient closed remote socket\n");
-        return false;
+void closeResponseFiles(Session &session){
+
+    for(auto &responseFile : session.responseFiles){
+        if(responseFile.file.file != -1){
+            close(responseFile.file.file);
+        }
     }
-    if (bytesReceived != lengthOfMessage) {
-        printf("Received message is shorter than message size.\n");
-        return false;
+    session.responseFiles.clear();
+}
+
+bool sendFile(int socket, MessageFile &file){
+
+    bool success = true;
+
+    while(file.length > 0){
+
+        ssize_t bytesSent = sendfile(socket, file.file, &file.offset, file.length);
+
+        if(bytesSent == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            logErrno("sendfile error");
+            success = false;
+            break;
+        }
+
+        if(bytesSent == 0){
+            logError("Error - message file ended early");
+            success = false;
+            break;
+        }
+
+        file.length -= bytesSent;
+        countBytesSent(bytesSent);
     }
 
-    //load message into stringBuffer
-    stringBuffer.assign(receiveBuffer.data(), receiveBuffer.size());
+    close(file.file);
+    file = MessageFile();
 
-    return true;
+    return success;
 }
 
-bool checkUsername(std::string &username){
-    
-     if(std::regex_match (username, std::regex("[a-z0-9]{1,8}"))){
-         return true;
-     }
+int receiveMessage(Session &session){
 
-     return false;
-}
+    //only the bytes that belong to this message are read from the socket, at most RECEIVE_BUFFER_SIZE at a time
+    char buffer[RECEIVE_BUFFER_SIZE];
 
-bool checkSubject(std::string &subject){
-     if(std::regex_match (subject, std::regex(".{0,80}"))){
-         return true;
-     }
+    while(1){
+        size_t bytesWanted = session.inFrame ? std::min(session.frameBytesLeft, sizeof(buffer)) : frameHeaderSize(session) - session.frameHeaderReceived;
 
-     return false;
-}
+        //MSG_WAITALL is set so recv waits until the wanted bytes are received
+        ssize_t bytesReceived = recv(session.socket, buffer, bytesWanted, MSG_WAITALL);
+        if (bytesReceived == -1) {
+            logErrno("recv error");
+            return false;
+        }
+        if (bytesReceived == 0) {
+            logInfo("Client closed remote socket");
+            return false;
+        }
+        countBytesReceived(bytesReceived);
 
-void signalHandler(int sig) {
+        size_t consumed;
+        long long start = metricsClock();
+        int result = receiveData(session, buffer, bytesReceived, consumed);
+        session.parseTime += metricsClock() - start;
 
-    if(sig == SIGUSR1){ //custom signal, sent before child process exits
-        pid_t cpid;
-        int status;
+        if(result == RECEIVE_COMPLETE){
+            return true;
+        }
 
-        if((cpid = wait(&status)) > 0){ //waits for child process to exit
-            printf("Child process with id %d exited with code %d\n", cpid, status);
+        if(result == RECEIVE_TOO_LARGE){
+            session.stringBuffer = "ERR\n";
+            sendMessage(session);
+            return false;
         }
-        return;
     }
-    
-    if(sig == SIGINT){
+}
 
-        if(pid == 0){
-            exit(EXIT_SUCCESS);
+int receiveData(Session &session, const char *data, size_t length, size_t &consumed){
+
+    consumed = 0;
+
+    while(consumed < length){
+
+        //length of the next frame (4 bytes) and request-id of tagged frames (4 more), can arrive in pieces like everything else
+        if(!session.inFrame){
+            if(!session.messageStarted){
+                session.messageStarted = true;
+                session.stringBuffer.clear();
+                session.messageSize = 0;
+                session.messageTruncated = false;
+                session.requestTagged = false;
+            }
+
+            while(session.frameHeaderReceived < frameHeaderSize(session)){
+                if(consumed == length){
+                    return RECEIVE_INCOMPLETE;
+                }
+                size_t headerBytes = std::min(frameHeaderSize(session) - session.frameHeaderReceived, length - consumed);
+                memcpy(&session.frameHeader[session.frameHeaderReceived], &data[consumed], headerBytes);
+                session.frameHeaderReceived += headerBytes;
+                consumed += headerBytes;
+            }
+
+            uint32_t lengthOfFrame;
+            memcpy(&lengthOfFrame, session.frameHeader, sizeof(uint32_t));
+            lengthOfFrame = ntohl(lengthOfFrame);
+
+            if((lengthOfFrame & FRAME_TAGGED) && !session.requestTagged){
+                memcpy(&session.requestId, &session.frameHeader[sizeof(uint32_t)], sizeof(uint32_t));
+                session.requestId = ntohl(session.requestId);
+                session.requestTagged = true;
+            }
+
+            session.frameHeaderReceived = 0;
+            session.inFrame = true;
+            session.lastFrame = !(lengthOfFrame & FRAME_MORE_CHUNKS);
+            session.frameBytesLeft = lengthOfFrame & FRAME_LENGTH_MASK;
+
+            //checked before anything of the frame is received, so a bogus length never allocates memory
+            if(session.messageSize + session.frameBytesLeft > maxMessageSize){
+                logWarn("Message from %s is larger than %zu bytes", session.clientIP.c_str(), maxMessageSize);
+                return RECEIVE_TOO_LARGE;
+            }
         }
 
-        printf("\nStopping server...\n");
-        pid_t cpid;
-        int status;
-        while((cpid = wait(&status)) > 0){ //waits for all child processes to exit
-            printf("Child process with id %d exited with code %d\n", cpid, status);
-        };
-
-        exit(EXIT_SUCCESS);
+        size_t payloadBytes = std::min(session.frameBytesLeft, length - consumed);
+        if(payloadBytes > 0){
+            appendToMessage(session, &data[consumed], payloadBytes);
+            consumed += payloadBytes;
+            session.frameBytesLeft -= payloadBytes;
+            session.messageSize += payloadBytes;
+        }
 
+        if(session.frameBytesLeft == 0){
+            session.inFrame = false;
+            if(session.lastFrame){
+                session.messageStarted = false;
+                return RECEIVE_COMPLETE;
+            }
+        }
     }
 
-    exit(sig);
+    return RECEIVE_INCOMPLETE;
 }
 
-void lock(){ //locks filesystem
-    if(flock(fileLock, LOCK_EX) != 0){
-        perror("flock");
-        exit(EXIT_FAILURE);
-    };
-}
+size_t frameHeaderSize(const Session &session){
 
-void unlock(){ //unlocks filesystem
-    if(flock(fileLock, LOCK_UN) != 0){
-        perror("flock");
-        exit(EXIT_FAILURE);
-    };
+    if(session.frameHeaderReceived < FRAME_HEADER_SIZE){
+        return FRAME_HEADER_SIZE;
+    }
+
+    uint32_t lengthOfFrame;
+    memcpy(&lengthOfFrame, session.frameHeader, sizeof(uint32_t));
+    return (ntohl(lengthOfFrame) & FRAME_TAGGED) ? FRAME_TAGGED_HEADER_SIZE : FRAME_HEADER_SIZE;
 }
 
-bool checkIfIPisBlacklisted(){
-    
-    fs::path p{dataDirectory};
-    p /= "blacklistedIPs";
-    p /= clientIP;
+size_t buildFrameHeader(const Session &session, size_t length, char *header){
 
-    lock();
-    
-    if(!fs::exists(p)){ //if ip is not on blacklist
-        unlock();
-        return false;
+    //a longer length would run into the flag bits
+    if(length > FRAME_LENGTH_MASK){
+        return 0;
     }
 
-    //if ip is on blacklist, the timestamp is checked to see if blacklist ist still active
+    uint32_t lengthOfFrame = htonl(length | (session.requestTagged ? FRAME_TAGGED : 0));
+    memcpy(header, &lengthOfFrame, sizeof(uint32_t));
 
-    std::string line;
-    std::ifstream ipFile(p); 
-    getline (ipFile, line);
-    ipFile.close();
-    int timeOfBlacklist = stoi(line);
-    const auto clockNow = std::chrono::system_clock::now();
-    int currenttime = (int)std::chrono::duration_cast<std::chrono::seconds>(clockNow.time_since_epoch()).count();
-    if((currenttime - timeOfBlacklist) > IP_BLACKLIST_TIME){ //if blacklist time is allready over
-            fs::remove(p); //remove ip from blacklist
-            unlock();
-            return false;
+    if(!session.requestTagged){
+        return FRAME_HEADER_SIZE;
     }
 
-    //if blacklist time is not over yet
+    uint32_t requestId = htonl(session.requestId);
+    memcpy(&header[sizeof(uint32_t)], &requestId, sizeof(uint32_t));
 
-    printf("\nLogin attempt from blacklisted ip: %s\n", clientIP.c_str());
-    printf("IP is blocked for %d more seconds\n", IP_BLACKLIST_TIME - (currenttime - timeOfBlacklist));
+    return FRAME_TAGGED_HEADER_SIZE;
+}
 
-    unlock();
-    return true;
+void rejectOversizedResponse(Session &session){
+
+    logError("Response to %s is larger than %u bytes, sending ERR instead", session.clientIP.c_str(), FRAME_LENGTH_MASK);
+    closeResponseFiles(session);
+    session.stringBuffer = "ERR\n";
 }
 
-void addFailedLoginAttempt(){
-    
-    printf("\nFailed login attempt on ip: %s\n", clientIP.c_str());
-    
-    fs::path p{dataDirectory};
-    p /= "failedLoginAttempts";
+void appendToMessage(Session &session, const char *data, size_t length){
 
-    lock();
+    if(session.messageTruncated){
+        return;
+    }
 
-    create_directory(p); //ok to use even if directory already exists
-    
-    p /= clientIP;
-
-    if(fs::exists(p)){ //if ip already has failed attempts
-        std::ifstream ipFileRead(p); 
-        std::string line;
-        getline (ipFileRead, line);
-        int numberOfFailedAttempts = stoi(line);
-        if(numberOfFailedAttempts >= MAX_FAILED_LOGIN_ATTEMPTS){
-            addIPtoBlacklist();
-            fs::remove(p);
-            unlock();
-            return;
+    if(session.stagedMessage.file != -1){
+        if(!storage->append(session.stagedMessage, data, length)){
+            storage->discard(session.stagedMessage);
+            session.messageTruncated = true;
         }
-        ipFileRead.close();
+        return;
+    }
+
+    session.stringBuffer.append(data, length);
+
+    if(session.stringBuffer.length() > MESSAGE_MEMORY_LIMIT){
+        stageMessage(session);
+    }
+}
 
-        //increase number of failed attempts by one
-        std::ofstream ipFileWrite(p);
-        ipFileWrite << numberOfFailedAttempts + 1 << "\n";
-        ipFileWrite.close();
-        unlock();
+void stageMessage(Session &session){
+
+    //"SEND\n<receiver>\n<subject>\n" stays in stringBuffer for send(), the rest goes to the file
+    size_t receiverEnd = std::string::npos;
+    size_t subjectEnd = std::string::npos;
+    if(session.stringBuffer.compare(0, 5, "SEND\n") == 0){
+        receiverEnd = session.stringBuffer.find('\n', 5);
+    }
+    if(receiverEnd != std::string::npos){
+        subjectEnd = session.stringBuffer.find('\n', receiverEnd + 1);
+    }
+
+    if(subjectEnd == std::string::npos){
+        logWarn("Message from %s is too large for its command", session.clientIP.c_str());
+        session.stringBuffer.clear();
+        session.messageTruncated = true;
         return;
     }
 
-    //if file doesn't exist -> first failed attempt
-    //create file and write 1 to file (first failed attempt)
-    std::ofstream ipFile(p);
-    ipFile << 1 << "\n";
+    std::string_view header(session.stringBuffer);
+    std::string_view subject = header.substr(receiverEnd + 1, subjectEnd - receiverEnd - 1);
 
-    ipFile.close();
+    std::vector<std::string_view> receivers;
+    std::string receiverList;
+    if(splitList(header.substr(5, receiverEnd - 5), receivers)){
+        receiverList = joinReceivers(receivers);
+    }
 
-    unlock();
+    //same checks as in send(), bodies of SENDs that fail anyway are not written to disk
+    if(!session.loggedIn || receiverList.empty() || !isValidSubject(subject)
+        || !storage->stage(receiverList, session.sessionUsername, std::string(subject), session.stagedMessage)
+        || !storage->append(session.stagedMessage, &session.stringBuffer.data()[subjectEnd + 1], session.stringBuffer.length() - subjectEnd - 1)){
+        storage->discard(session.stagedMessage);
+        session.stringBuffer.clear();
+        session.messageTruncated = true;
+        return;
+    }
 
+    session.stringBuffer.resize(subjectEnd + 1);
 }
 
-void addIPtoBlacklist(){
+void blockSignals(){
 
-    printf("Client with ip %s had more than %d login attempts and will be blacklisted for %d seconds\n", clientIP.c_str(), MAX_FAILED_LOGIN_ATTEMPTS, IP_BLACKLIST_TIME);
-    
-    fs::path p{dataDirectory};
-    p /= "blacklistedIPs";
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGCHLD);
+    if(pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0){
+        fprintf(stderr, "signals can not be blocked\n");
+        exit(EXIT_FAILURE);
+    }
+}
 
-    lock();
+void signalLoop(){
 
-    create_directory(p); //ok to use even if directory already exists
-    
-    p /= clientIP;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGCHLD);
 
-    if(fs::exists(p)){ //if ip is already blacklisted
-        unlock();
-        return;
+    while(1){
+        int sig;
+        if(sigwait(&signals, &sig) != 0){
+            continue;
+        }
+
+        //SIGUSR1 is the custom signal a child process sends before it exits, SIGCHLD also comes for children that
+        //crashed or were killed, their unfinished messages must not keep the write-ahead log from being removed
+        if(sig == SIGUSR1 || sig == SIGCHLD){
+            pid_t cpid;
+            int status;
+
+            //signals that arrive while one is pending are merged, so every child that exited meanwhile is collected
+            while((cpid = waitpid(-1, &status, WNOHANG)) > 0){
+                logInfo("Child process with id %d exited with code %d", cpid, status);
+                dropProcessMessages(cpid);
+            }
+            continue;
+        }
+
+        if(sig == SIGINT){
+
+            if(pid == 0){
+                exit(EXIT_SUCCESS);
+            }
+
+            logInfo("Stopping server...");
+            pid_t cpid;
+            int status;
+            while((cpid = wait(&status)) > 0){ //waits for all child processes to exit
+                logInfo("Child process with id %d exited with code %d", cpid, status);
+            };
+
+            exit(EXIT_SUCCESS);
+        }
     }
+}
 
-    //if ip isn't blacklisted
-    //create file and write current timestamp
-    const auto clockNow = std::chrono::system_clock::now();
-    std::ofstream ipFile(p);
-    ipFile << std::chrono::duration_cast<std::chrono::seconds>(clockNow.time_since_epoch()).count() << '\n';
-    ipFile.close();
+void compactionLoop(){
+    while(1){
+        sleep(COMPACTION_INTERVAL);
+        storage->compact();
+    }
+}
 
-    unlock();
+bool checkIfIPisBlacklisted(const std::string &clientIP){
 
-    return;
-}
\ No newline at end of file
+    int timeLeft = blacklistTimeLeft(clientIP);
+    if(timeLeft == 0){
+        return false;
+    }
+
+    logWarn("Login attempt from blacklisted ip %s, blocked for %d more seconds", clientIP.c_str(), timeLeft);
+
+    return true;
+}
+
+void addFailedLoginAttempt(const std::string &clientIP){
+
+    logInfo("Failed login attempt on ip: %s", clientIP.c_str());
+
+    if(recordFailedLogin(clientIP)){
+        logWarn("Client with ip %s had more than %d login attempts and will be blacklisted for %d seconds", clientIP.c_str(), MAX_FAILED_LOGIN_ATTEMPTS, IP_BLACKLIST_TIME);
+    }
+}
+
+void loginSnapshotLoop(){
+    std::string path = (fs::path(dataDirectory) / LOGIN_TABLE_SNAPSHOT_FILE).string();
+    while(1){
+        sleep(loginSnapshotInterval);
+        saveLoginTable(path);
+    }
+}